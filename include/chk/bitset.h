@@ -0,0 +1,68 @@
+#ifndef BPKG_BITSET_H
+#define BPKG_BITSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-chunk completion state, one bit per chunk position packed into
+ * 64-bit words, bit i of the set in bit (i % 64) of word i / 64. Bits
+ * past the last chunk are kept clear so whole words can be counted and
+ * compared without masking the tail.
+ */
+#define BITSET_WORD_BITS 64
+
+static inline size_t bitset_words(size_t nbits) {
+    return (nbits + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS;
+}
+
+static inline int bitset_test(const uint64_t* bits, size_t i) {
+    return (bits[i / BITSET_WORD_BITS] >> (i % BITSET_WORD_BITS)) & 1;
+}
+
+static inline void bitset_set(uint64_t* bits, size_t i) {
+    bits[i / BITSET_WORD_BITS] |= (uint64_t) 1 << (i % BITSET_WORD_BITS);
+}
+
+// Number of set bits among the first nbits
+static inline size_t bitset_count(const uint64_t* bits, size_t nbits) {
+    size_t n = 0;
+    for (size_t w = 0; w < bitset_words(nbits); w++) {
+        n += (size_t) __builtin_popcountll(bits[w]);
+    }
+    return n;
+}
+
+// Whether bits first .. first + count - 1 are all set, a word at a time
+static inline int bitset_all(const uint64_t* bits, size_t first, size_t count) {
+    size_t end = first + count;
+    while (first < end) {
+        size_t lo = first % BITSET_WORD_BITS;
+        size_t span = end - first < BITSET_WORD_BITS - lo ? end - first : BITSET_WORD_BITS - lo;
+        uint64_t mask = (span == BITSET_WORD_BITS ? ~(uint64_t) 0 : ((uint64_t) 1 << span) - 1) << lo;
+        if ((bits[first / BITSET_WORD_BITS] & mask) != mask) {
+            return 0;
+        }
+        first += span;
+    }
+    return 1;
+}
+
+// First set bit at or after from, or nbits if there is none
+static inline size_t bitset_next(const uint64_t* bits, size_t from, size_t nbits) {
+    if (from >= nbits) {
+        return nbits;
+    }
+    size_t w = from / BITSET_WORD_BITS;
+    uint64_t word = bits[w] & (~(uint64_t) 0 << (from % BITSET_WORD_BITS));
+    while (word == 0) {
+        if (++w >= bitset_words(nbits)) {
+            return nbits;
+        }
+        word = bits[w];
+    }
+    size_t i = w * BITSET_WORD_BITS + (size_t) __builtin_ctzll(word);
+    return i < nbits ? i : nbits;
+}
+
+#endif
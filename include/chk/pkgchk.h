@@ -3,34 +3,81 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include<stdbool.h>
+#include <crypt/sha256.h>
 
 #define MAX_IDENT_LEN 1024
 #define MAX_FILENAME_LEN 255
 #define MAX_HASH_LEN 64
 
 /**
- * Query object, allows you to assign
- * hash strings to it.
- * Typically: malloc N number of strings for hashes
- *    after malloc the space for each string
- *    Make sure you deallocate in the destroy function
+ * Bump allocator for query results, counted in digests.
+ * Queries carved from it are released together by
+ * bpkg_arena_reset or bpkg_arena_destroy.
+ */
+struct bpkg_arena {
+    uint8_t (*base)[SHA256_DIGEST_LENGTH];
+    size_t capacity;
+    size_t used;
+};
+
+/**
+ * Query object, holds binary digests back to back.
+ * Hex conversion only happens when results are printed.
+ * bpkg_file_check reports through message instead of hashes, as
+ * does a hash lookup that finds no node.
+ * The buffer is sized once from the tree, arena is set when
+ * it was carved from one rather than malloc'd.
  */
 struct bpkg_query {
-	char** hashes;
+	uint8_t (*hashes)[SHA256_DIGEST_LENGTH];
 	size_t len;
     size_t capacity;
+    const char* message;
+    struct bpkg_arena* arena;
 };
 
-struct merkle_tree_node;
+struct merkle_tree;
+
+// stat fields that change whenever a file is replaced or rewritten
+struct bpkg_fingerprint {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+/**
+ * Fingerprints the file at path, or open on fd
+ * @return 0 on success, -1 if it cannot be stat'ed
+ */
+int bpkg_fingerprint_path(const char* path, struct bpkg_fingerprint* fp);
+int bpkg_fingerprint_fd(int fd, struct bpkg_fingerprint* fp);
+
+/*
+ * How bpkg_verify_chunks reads the data file. READ gathers runs of
+ * file-contiguous chunks into large reads with sequential readahead,
+ * MMAP hashes straight out of a mapping and DIRECT bypasses the page
+ * cache for cold files, falling back to READ where that is refused.
+ */
+enum bpkg_io_mode {
+    BPKG_IO_READ,
+    BPKG_IO_MMAP,
+    BPKG_IO_DIRECT,
+};
 
 // Structure to represent a chunk within the package
+// Offsets are 64-bit for packages past 4 GiB, a single chunk stays under it
 typedef struct chunk_obj {
-    char hash[MAX_HASH_LEN];
-    uint32_t offset;
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    uint64_t offset;
     uint32_t size;
 } Chunk;
 
@@ -38,37 +85,99 @@ typedef struct chunk_obj {
 typedef struct bpkg_obj {
     char ident[MAX_IDENT_LEN + 1];
     char filename[MAX_FILENAME_LEN + 1];
-    uint32_t size;
+    uint64_t size;
     uint32_t nhashes;
-    char **hashes;
+    uint8_t (*hashes)[SHA256_DIGEST_LENGTH];
     uint32_t nchunks;
     Chunk *chunks;
-    struct merkle_tree_node* merkle_root;
+    struct merkle_tree* merkle_tree;
+    // Workers used to hash the data file, 0 or 1 keeps it on the caller
+    uint32_t threads;
+    enum bpkg_io_mode io;
+    // Directory of the fingerprint cache, NULL leaves it off
+    const char* fp_cache;
+    // Rehash even when the fingerprint cache says the data file is unchanged
+    bool paranoid;
+    // Compiled package that hashes and chunks point into, NULL for parsed ones
+    void* map;
+    size_t map_len;
 } BpkgObj;
 
-bool is_chunk_complete(struct merkle_tree_node* node, struct bpkg_query complete_qry);
-void ensure_capacity_and_add_hash(struct bpkg_query* qry, char* hash);
-void merge_if_complete(struct bpkg_query* dest, struct bpkg_query* src, struct bpkg_query* complete_chunks);
-void free_query(struct bpkg_query* qry);
-bool is_chunk_complete_by_hash(const char* hash, struct bpkg_query* complete_chunks);
-bool all_hashes_complete(struct bpkg_query* qry, struct bpkg_query* complete_chunks);
 struct bpkg_query compare_files(struct bpkg_obj* obj, const char* filepath);
+struct bpkg_query compare_files_arena(struct bpkg_obj* obj, const char* filepath, struct bpkg_arena* arena);
 
-void merge_queries(struct bpkg_query* dest, struct bpkg_query* src);
+/**
+ * Hashes every chunk of filepath and checks it against the package,
+ * reading each at its own offset and size, on obj->threads workers
+ * @param obj, constructed bpkg object
+ * @param filepath, data file to check
+ * @param done, chunk bitset of bitset_words(nchunks) words, the bit of
+ *      each chunk that matches is set and all others cleared
+ * @return number of matching chunks
+ */
+size_t bpkg_verify_chunks(struct bpkg_obj* obj, const char* filepath, uint64_t* done);
+
+/**
+ * @return a cleared chunk bitset for obj, to be freed by the caller,
+ *      or NULL if it could not be allocated
+ */
+uint64_t* bpkg_chunk_bitset(const struct bpkg_obj* obj);
+
+/**
+ * Reserves room for capacity digests
+ * @return 0 on success, -1 if the allocation failed
+ */
+int bpkg_arena_init(struct bpkg_arena* arena, size_t capacity);
+
+/**
+ * Releases every query carved from the arena, keeping its storage
+ */
+void bpkg_arena_reset(struct bpkg_arena* arena);
+
+void bpkg_arena_destroy(struct bpkg_arena* arena);
 
 /**
  * Loads the package for when a value path is given
+ * Text .bpkg and compiled .bpkgc files are both accepted
  */
 struct bpkg_obj* bpkg_load(const char* path);
 
+#define BPKGC_MAGIC "BPKGC\0\0\0"
+#define BPKGC_MAGIC_LEN 8
+#define BPKGC_VERSION 1
+#define BPKGC_BYTE_ORDER 0x01020304u
+
+/**
+ * Writes obj as a compiled package that bpkg_load maps without parsing,
+ * its tables are used in place for as long as the object lives
+ * @param obj, loaded bpkg object
+ * @param path, output file
+ * @return 0 on success, -1 on failure
+ */
+int bpkg_compile(const struct bpkg_obj* obj, const char* path);
+
+/**
+ * Packages the data file at filepath, hashing its chunks on threads
+ * workers as verification would. The file is cut into a power of two
+ * chunks, at least two, of at most chunk_size bytes, and the ident is
+ * the root hash.
+ * @return package with its tree built, or NULL on failure
+ */
+struct bpkg_obj* bpkg_make(const char* filepath, uint32_t chunk_size, uint32_t threads, enum bpkg_io_mode mode);
+
+/**
+ * Writes obj as a text .bpkg
+ * @return 0 on success, -1 on failure
+ */
+int bpkg_save(const struct bpkg_obj* obj, const char* path);
+
 /**
  * Checks to see if the referenced filename in the bpkg file
  * exists or not.
  * @param bpkg, constructed bpkg object
- * @return query_result, a single string should be
- *      printable in hashes with len sized to 1.
- * 		If the file exists, hashes[0] should contain "File Exists"
- *		If the file does not exist, hashes[0] should contain "File Created"
+ * @return query_result, with message set and no hashes.
+ * 		If the file exists, message is "File Exists"
+ *		If the file does not exist, message is "File Created"
  */
 struct bpkg_query bpkg_file_check(struct bpkg_obj* bpkg);
 
@@ -79,6 +188,7 @@ struct bpkg_query bpkg_file_check(struct bpkg_obj* bpkg);
  * 		and the number of hashes that have been retrieved
  */
 struct bpkg_query bpkg_get_all_hashes(struct bpkg_obj* bpkg);
+struct bpkg_query bpkg_get_all_hashes_arena(struct bpkg_obj* bpkg, struct bpkg_arena* arena);
 
 /**
  * Retrieves all completed chunks of a package object
@@ -87,6 +197,7 @@ struct bpkg_query bpkg_get_all_hashes(struct bpkg_obj* bpkg);
  * 		and the number of hashes that have been retrieved
  */
 struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj* bpkg);
+struct bpkg_query bpkg_get_completed_chunks_arena(struct bpkg_obj* bpkg, struct bpkg_arena* arena);
 
 
 /**
@@ -99,7 +210,8 @@ struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj* bpkg);
  * @return query_result, This structure will contain a list of hashes
  * 		and the number of hashes that have been retrieved
  */
-struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg); 
+struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg);
+struct bpkg_query bpkg_get_min_completed_hashes_arena(struct bpkg_obj* bpkg, struct bpkg_arena* arena); 
 
 
 /**
@@ -111,14 +223,18 @@ struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg);
  * 	the second half of the file will be outputted
  * @param bpkg, constructed bpkg object
  * @return query_result, This structure will contain a list of hashes
- * 		and the number of hashes that have been retrieved
+ * 		and the number of hashes that have been retrieved. With no node
+ * 		of that hash, message is "No node found with the given hash"
  */
-struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, char* hash);
+struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, const uint8_t* hash);
+struct bpkg_query bpkg_get_all_chunk_hashes_from_hash_arena(struct bpkg_obj* bpkg, const uint8_t* hash, struct bpkg_arena* arena);
 
 
 /**
  * Deallocates the query result after it has been constructed from
  * the relevant queries above.
+ * The _arena variants take their results from arena when it has room
+ * and fall back to malloc otherwise, destroy is safe on either.
  */
 void bpkg_query_destroy(struct bpkg_query* qry);
 
@@ -2,6 +2,8 @@ typedef struct {
     char directory[256];
     int max_peers;
     unsigned short port;
+    int threads;
+    int proofs;
 } Config;
 
 int parse_config(const char *filename, Config *config);
\ No newline at end of file
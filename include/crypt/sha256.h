@@ -2,11 +2,17 @@
 #define BTYDE_CRYPT_SHA256
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
 
 #define SHA256_CHUNK_SZ (64)
 #define SHA256_INT_SZ (8)
 #define SHA256_DFTLEN (1024)
 #define SHA256_DIGEST_LENGTH (32)
+#define SHA256_AVX2_LANES (8)
+#define SHA256_AVX512_LANES (16)
+#define SHA256_MULTI_MAX_LANES SHA256_AVX512_LANES
 
 //Original: https://github.com/LekKit/sha256/blob/master/sha256.h
 struct sha256_compute_data {
@@ -27,12 +33,121 @@ void sha256_update(struct sha256_compute_data* data,
 void sha256_finalize(struct sha256_compute_data* data, 
 		uint8_t hash[SHA256_INT_SZ]);
 
+void sha256_output(struct sha256_compute_data* data, uint8_t* hash);
 
 void sha256_output_hex(struct sha256_compute_data* data, 
 		char hexbuf[SHA256_CHUNK_SZ]);
 
 void compute_hash(void *concat_string, char *output);
 
+/*
+ * Block compression backends. Each one consumes nblocks consecutive
+ * 64 byte blocks into the eight state words. The active backend is picked
+ * once at startup and used by sha256_update/sha256_finalize.
+ */
+typedef void (*sha256_block_fn)(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks);
+
+struct sha256_backend {
+	const char* name;
+	sha256_block_fn blocks;
+	int (*available)(void);
+};
+
+extern const uint32_t sha256_k[64];
+
+void sha256_blocks_scalar(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks);
+
+//src/crypt/sha256_x86.c
+void sha256_blocks_shani(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks);
+int sha256_shani_available(void);
+
+/*
+ * Multi-buffer kernels: advance lanes[i] (i < lane count) by nblocks
+ * blocks each, with hcomps[i] holding the state of message i.
+ */
+typedef void (*sha256_multiblock_fn)(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks);
+
+struct sha256_multi_backend {
+	const char* name;
+	uint32_t lanes;
+	sha256_multiblock_fn blocks;
+	int (*available)(void);
+};
+
+void sha256_multiblocks_avx2(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks);
+void sha256_multiblocks_avx512(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks);
+int sha256_avx2_available(void);
+int sha256_avx512_available(void);
+
+//src/crypt/sha256_arm.c
+void sha256_blocks_armv8(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks);
+int sha256_armv8_available(void);
+
+const char* sha256_backend_name(void);
+
+/**
+ * Hashes n messages of the same length, as many at a time as the widest
+ * usable multi-buffer backend allows.
+ * @param msgs, n pointers to len bytes each
+ * @param digests, receives the n binary digests in message order
+ */
+void sha256_multi(const uint8_t* const* msgs, size_t n, uint32_t len,
+		uint8_t (*digests)[SHA256_DIGEST_LENGTH]);
+
+/**
+ * Number of messages sha256_multi hashes per pass, callers batching
+ * reads should use a multiple of this.
+ */
+uint32_t sha256_multi_lanes(void);
+
+void sha256_digest_to_hex(const uint8_t digest[SHA256_DIGEST_LENGTH],
+		char hexbuf[SHA256_CHUNK_SZ]);
+
+/**
+ * Parses the first 64 characters of hex into a binary digest.
+ * @return 0 on success, -1 if any of them is not a hex digit
+ */
+int sha256_hex_to_digest(const char* hex,
+		uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+/**
+ * One shot hash of size bytes into a binary digest.
+ */
+void sha256_hash(const void* bytes, uint32_t size,
+		uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+/**
+ * Parent digest of a merkle interior node, the hash of the 128 hex
+ * characters of left followed by right.
+ */
+void sha256_merkle_parent(const uint8_t left[SHA256_DIGEST_LENGTH],
+		const uint8_t right[SHA256_DIGEST_LENGTH],
+		uint8_t parent[SHA256_DIGEST_LENGTH]);
+
+/**
+ * Compares two binary digests as four 64 bit words.
+ */
+static inline int sha256_digest_eq(const uint8_t* a, const uint8_t* b) {
+	uint64_t x[4], y[4];
+	memcpy(x, a, SHA256_DIGEST_LENGTH);
+	memcpy(y, b, SHA256_DIGEST_LENGTH);
+	return ((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3])) == 0;
+}
+
+/**
+ * Runs every backend usable on this CPU against the scalar code.
+ * @param out, stream to report per backend results to, may be NULL
+ * @return 0 if all usable backends agree with the scalar code
+ */
+int sha256_self_test(FILE* out);
+
 
 #endif
 
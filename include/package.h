@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
 
 #define PAYLOAD_MAX 4096
 #define DATA_MAX 4092
@@ -8,6 +10,7 @@
 #define PKT_MSG_DSN 0x03
 #define PKT_MSG_REQ 0x06
 #define PKT_MSG_RES 0x07
+#define PKT_MSG_PRF 0x08
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
 
@@ -23,6 +26,93 @@ typedef struct {
 
 #define MIN_IDENT 20
 
+/*
+ * REQ flags live in the byte after the identifier. With REQ_FLAG_PROOF the
+ * responder sends a PRF packet before the RES data: chunk position (u32),
+ * sibling count (u32), chunk digest, then the sibling digests leaf level
+ * first, so the requester can check the chunk against the root alone.
+ * The requester hashes the data it received and holds it back unless
+ * that matches the proven chunk digest.
+ */
+#define REQ_FLAGS_OFFSET 1096
+#define REQ_FLAG_PROOF 0x01
+#define PRF_LEAF_OFFSET 8
+#define PRF_SIBLINGS_OFFSET 40
+
+/*
+ * The wire version follows the REQ flags. Peers that predate it never
+ * cleared their REQ buffers, so the byte can hold anything from them.
+ * From version 2 a REQ also carries its offset and length as u64 at the
+ * _64 offsets, the u32 fields keep their low halves for older peers. A
+ * responder only takes the u64 fields when their low halves match the
+ * u32 ones, any other REQ is read as version 1. RES keeps a u32 offset,
+ * the low half of the absolute one: a response never strays more than
+ * 4 GiB from the offset requested, so the requester widens it against
+ * that.
+ */
+#define REQ_VERSION_OFFSET 1097
+#define REQ_OFFSET64_OFFSET 1104
+#define REQ_LEN64_OFFSET 1112
+#define WIRE_VERSION 2
+
+void serialize_packet(const btide_packet *packet, uint8_t *buffer);
+void deserialize_packet(const uint8_t *buffer, btide_packet *packet);
 void send_packet(int sockfd, const btide_packet* packet);
-void receive_packet(int sockfd, btide_packet* packet);
-void send_ack(int socket_fd);
\ No newline at end of file
+int receive_packet(int sockfd, btide_packet* packet);
+void send_ack(int socket_fd);
+
+/*
+ * Framed reader over a stream socket. Each fill is one large recv into a
+ * linear buffer of READER_PACKETS frames, after which every complete
+ * packet in it can be taken in turn. Packets start at multiples of
+ * PAYLOAD_MAX in the buffer, so they are handed out in place as aligned
+ * views that stay valid until the next fill. Once the buffer is filled to
+ * its end, the unread bytes are moved back to its front.
+ */
+#define READER_PACKETS 16
+
+typedef struct packet_reader {
+    _Alignas(btide_packet) uint8_t data[READER_PACKETS * PAYLOAD_MAX];
+    size_t start;
+    size_t end;
+} packet_reader;
+
+_Static_assert(sizeof(btide_packet) == PAYLOAD_MAX, "btide_packet must match its wire frame");
+
+/**
+ * Empties the reader for a new connection.
+ * @param reader, the reader to reset
+ */
+void packet_reader_init(packet_reader* reader);
+
+/**
+ * Receives as much as the buffer has room for with a single recv.
+ * @param reader, the reader of the socket
+ * @param sockfd, the socket to read, blocking or not
+ * @return the bytes received, 0 when the peer closed, -1 on error with
+ *      errno set, ENOBUFS if the buffer is full of unread packets
+ */
+ssize_t packet_reader_fill(packet_reader* reader, int sockfd);
+
+/**
+ * Takes the next complete packet from the buffer.
+ * @param reader, the reader of the socket
+ * @return a view of the packet valid until the next fill, NULL if no
+ *      complete packet is buffered
+ */
+const btide_packet* packet_reader_next(packet_reader* reader);
+
+/**
+ * @param reader, the reader of the socket
+ * @return whether a complete packet is buffered
+ */
+bool packet_reader_ready(const packet_reader* reader);
+
+/**
+ * Takes the next packet, receiving until one is complete.
+ * @param reader, the reader of the socket
+ * @param sockfd, the blocking socket to read
+ * @return a view of the packet valid until the next fill, NULL once the
+ *      peer closed or on an error, which has been reported
+ */
+const btide_packet* packet_reader_receive(packet_reader* reader, int sockfd);
@@ -1,17 +1,24 @@
 #include <pthread.h>
 
+struct packet_reader;
+
 typedef struct peer_node {
     char *ip;
     int port;
     int socket_fd;
+    // Frames the peer's answers, bytes of the next one may already be in it
+    struct packet_reader *reader;
     struct peer_node *next;
 } peer_node;
 
+struct merkle_tracker;
+
 typedef struct package_node {
     char *package_path;
     char *bpkg_path;
     char *ident;
     int complete;
+    struct merkle_tracker *tracker;
     struct package_node *next;
 } package_node;
 
@@ -26,7 +33,7 @@ peer_node* find_peer(peer_node *head, const char *ip, int port);
 void free_package_list(package_node **head);
 void print_package_list(package_node *head);
 int remove_package_from_list(package_node **head, const char *ident);
-void add_package_to_list(package_node **head, const char *path, const char *bpkg, int complete, const char *ident);
+void add_package_to_list(package_node **head, const char *path, const char *bpkg, int complete, const char *ident, struct merkle_tracker *tracker);
 package_node* find_package(package_node *head, const char *identifier);
 
 int disconnect_from_peer(peer_node **head, const char *ip, int port);
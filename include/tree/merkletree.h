@@ -2,28 +2,118 @@
 #define MERKLE_TREE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include<chk/pkgchk.h>
+#include <crypt/sha256.h>
 
 #define SHA256_HEXLEN (64)
 
-struct merkle_tree_node {
-    void* key;
-    void* value;
-    struct merkle_tree_node* left;
-    struct merkle_tree_node* right;
-    int is_leaf;
-    char expected_hash[SHA256_HEXLEN];
-    char computed_hash[SHA256_HEXLEN];
+/*
+ * Complete binary merkle tree stored implicitly in level order:
+ * node 0 is the root, node i has children 2i+1 and 2i+2, and the
+ * n_leaves chunk hashes occupy the last n_leaves slots in file order.
+ * bpkg_load only accepts power-of-two chunk counts, so the tree is
+ * always perfect and n_nodes == 2 * n_leaves - 1.
+ *
+ * index is an open-addressing table from digest to node, filled when the
+ * tree is built. Digests are already uniformly distributed, so the first
+ * eight bytes pick the slot directly. A slot holds node index + 1, or 0
+ * when empty. The table directly follows the hashes in the tree's single
+ * allocation and holds no pointers, so a tree can be copied or mapped from
+ * a file as one block of merkle_tree_bytes.
+ */
+struct merkle_tree {
+    size_t n_nodes;
+    size_t n_leaves;
+    uint32_t depth;
+    size_t index_mask;
+    uint8_t hashes[][SHA256_DIGEST_LENGTH];
 };
 
+static inline uint32_t* merkle_index(const struct merkle_tree* tree) {
+    return (uint32_t*) (tree->hashes + tree->n_nodes);
+}
 
-struct merkle_tree {
-    struct merkle_tree_node* root;
-    size_t n_nodes;
+static inline size_t merkle_tree_bytes(size_t n_nodes, size_t index_slots) {
+    return sizeof(struct merkle_tree) + n_nodes * SHA256_DIGEST_LENGTH + index_slots * sizeof(uint32_t);
+}
+
+#define MERKLE_PARENT(i) (((i) - 1) / 2)
+#define MERKLE_LEFT(i) (2 * (i) + 1)
+#define MERKLE_RIGHT(i) (2 * (i) + 2)
+#define MERKLE_SIBLING(i) (((i) & 1) ? (i) + 1 : (i) - 1)
+
+static inline int merkle_is_leaf(const struct merkle_tree* tree, size_t i) {
+    return i >= tree->n_leaves - 1;
+}
+
+// Node index of the leaf for chunk c
+static inline size_t merkle_leaf_node(const struct merkle_tree* tree, size_t c) {
+    return tree->n_leaves - 1 + c;
+}
+
+// Depth of node i, the root is at depth 0
+static inline uint32_t merkle_node_depth(size_t i) {
+    return (uint32_t) (63 - __builtin_clzll((unsigned long long) i + 1));
+}
+
+// First chunk and number of chunks covered by the subtree at node i
+static inline void merkle_leaf_range(const struct merkle_tree* tree, size_t i, size_t* first, size_t* count) {
+    uint32_t below = tree->depth - merkle_node_depth(i);
+    *first = ((i + 1) << below) - tree->n_leaves;
+    *count = (size_t) 1 << below;
+}
+
+struct merkle_tree* build_merkle_tree(struct chunk_obj* chunks, uint32_t nchunks);
+
+/**
+ * Same as build_merkle_tree, hashing the subtrees below a split level on
+ * up to threads worker threads. Small trees are built on the caller.
+ */
+struct merkle_tree* build_merkle_tree_mt(struct chunk_obj* chunks, uint32_t nchunks, uint32_t threads);
+void free_merkle_tree(struct merkle_tree* tree);
+
+/**
+ * Finds the node holding hash through the digest index. When several
+ * nodes share a digest the one with the smallest index is returned.
+ * @return node index, or -1 if no node matches
+ */
+ssize_t find_hash(const struct merkle_tree* tree, const uint8_t* hash);
+
+// nchunks is a uint32_t power of two, so a leaf is at most 31 levels down
+#define MERKLE_MAX_DEPTH 32
+
+/*
+ * Inclusion proof for one chunk: the digests of the siblings on the path
+ * from its leaf to the root, leaf level first. chunk's bits give the side
+ * of each step, so the proof checks against nothing but the root hash.
+ */
+struct merkle_proof {
+    uint32_t chunk;
+    uint32_t len;
+    uint8_t leaf[SHA256_DIGEST_LENGTH];
+    uint8_t siblings[MERKLE_MAX_DEPTH][SHA256_DIGEST_LENGTH];
 };
 
-struct merkle_tree_node* build_merkle_tree(struct chunk_obj* chunks, int start, int end);
-void free_merkle_tree(struct merkle_tree_node* node);
-int find_hash(struct merkle_tree_node* node, const char* hash);
+/**
+ * Fills proof with the sibling path of chunk.
+ * @return 0 on success, -1 if chunk is not in the tree
+ */
+int merkle_proof_build(const struct merkle_tree* tree, size_t chunk, struct merkle_proof* proof);
+
+/**
+ * Folds the proof up from its leaf and compares the result with root.
+ * @param depth leaf depth of the tree, the number of siblings a proof must have
+ * @return 1 if the leaf belongs to the tree with that root, 0 otherwise
+ */
+int merkle_proof_verify(const struct merkle_proof* proof, const uint8_t* root, uint32_t depth);
+
+/**
+ * Node index of the p-th node of an in-order walk, p < n_nodes.
+ */
+size_t merkle_inorder_node(const struct merkle_tree* tree, size_t p);
+
+void print_merkle_tree_hashes(const struct merkle_tree* tree);
 
-#endif
\ No newline at end of file
+#endif
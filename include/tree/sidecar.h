@@ -0,0 +1,141 @@
+#ifndef BPKG_SIDECAR_H
+#define BPKG_SIDECAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chk/pkgchk.h>
+#include <chk/bitset.h>
+#include <tree/merkletree.h>
+
+#define BPKG_SIDECAR_MAGIC "BTSTATE"
+#define BPKG_SIDECAR_VERSION 4
+#define BPKG_SIDECAR_SUFFIX ".state"
+
+#define BPKG_JOURNAL_MAGIC "BTJRNL"
+#define BPKG_JOURNAL_VERSION 1
+#define BPKG_JOURNAL_SUFFIX ".journal"
+// Records buffered before they are written out with one fdatasync
+#define BPKG_JOURNAL_BATCH 256
+
+/*
+ * <bpkg path>.state holds everything btide needs from a package so it is
+ * parsed and hashed once: this header, the chunk table, the built merkle
+ * tree with its digest index and the bitset of verified chunks. Sections are
+ * stored in native layout at 64-byte aligned offsets and used in place
+ * through a read-only mapping.
+ *
+ * bpkg records the .bpkg the file was built from, any change to it makes
+ * the sidecar stale. data records the data file as it was when the bitmap
+ * was stored, the bitset is only trusted while the data file still matches.
+ */
+struct bpkg_sidecar_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_bytes;
+    uint32_t nchunks;
+    uint32_t reserved;
+    uint64_t size;
+    struct bpkg_fingerprint bpkg;
+    struct bpkg_fingerprint data;
+    uint64_t chunks_off;
+    uint64_t tree_off;
+    uint64_t verified_off;
+    char ident[MAX_IDENT_LEN + 1];
+    char filename[MAX_FILENAME_LEN + 1];
+};
+
+/*
+ * <bpkg path>.journal carries progress past the sidecar's bitset, which is
+ * the last checkpoint. It is this header followed by fixed-size records
+ * appended as data arrives: RANGE for bytes from .. to - 1 written into a
+ * chunk and VERIFIED once the chunk hashes correctly. base is the data
+ * stamp of the checkpoint the records extend, every new checkpoint
+ * truncates the journal back to a header with the new base.
+ */
+struct bpkg_journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nchunks;
+    uint8_t root[SHA256_DIGEST_LENGTH];
+    struct bpkg_fingerprint base;
+};
+
+enum bpkg_journal_type {
+    BPKG_JOURNAL_RANGE = 0x52414e47,
+    BPKG_JOURNAL_VERIFIED = 0x56455249,
+};
+
+struct bpkg_journal_record {
+    uint32_t type;
+    uint32_t chunk;
+    uint32_t from;
+    uint32_t to;
+};
+
+struct bpkg_sidecar {
+    int fd;
+    void* map;
+    size_t map_len;
+    const struct bpkg_sidecar_header* header;
+    // Read-only view, chunks, hashes and merkle_tree point into the mapping
+    struct bpkg_obj obj;
+    // -1 when the journal could not be opened, progress then stops at checkpoints
+    int journal_fd;
+    uint64_t journal_len;
+    size_t journal_pending;
+    struct bpkg_journal_record journal[BPKG_JOURNAL_BATCH];
+};
+
+/**
+ * Maps the sidecar of bpkg_path.
+ * @return sidecar, or NULL if it is missing, malformed or older than the .bpkg
+ */
+struct bpkg_sidecar* bpkg_sidecar_open(const char* bpkg_path);
+
+/**
+ * Writes the sidecar of bpkg_path from obj, which must have its merkle tree
+ * built, replacing any existing one, then maps it.
+ * @return sidecar, or NULL if it could not be written
+ */
+struct bpkg_sidecar* bpkg_sidecar_create(const char* bpkg_path, const struct bpkg_obj* obj);
+
+/**
+ * Picks up from the last checkpoint of data_path. The checkpoint bitset is
+ * trusted as is when the data file has not changed since it was stored.
+ * It is also trusted when the file is the same inode at the package's
+ * size, last changed strictly before the journal was last written, and
+ * the journal extends it; the journal's records are then returned
+ * alongside.
+ * @param records, set to the journal records in order, free with free()
+ * @param count, set to the number of records
+ * @return the checkpoint bitset, or NULL if data_path must be rehashed
+ */
+const uint64_t* bpkg_sidecar_resume(struct bpkg_sidecar* sidecar, const char* data_path,
+                                    struct bpkg_journal_record** records, size_t* count);
+
+/**
+ * Stores the verified-chunk bitset as a checkpoint of data_path's current
+ * state and truncates the journal to extend it. Data the bitset depends on
+ * must already be durable.
+ * @return 0 on success, -1 on failure
+ */
+int bpkg_sidecar_store_verified(struct bpkg_sidecar* sidecar, const char* data_path, const uint64_t* done);
+
+/**
+ * Queues a journal record, see struct bpkg_journal_header. Records
+ * queued on a full batch are dropped until it is flushed.
+ * @return 1 once a full batch is queued and should be flushed, else 0
+ */
+int bpkg_sidecar_journal_append(struct bpkg_sidecar* sidecar, enum bpkg_journal_type type,
+                                uint32_t chunk, uint32_t from, uint32_t to);
+
+/**
+ * Writes the queued records and syncs the journal. The data they describe
+ * must be synced first, a record must never outlive the bytes it vouches for.
+ * @return 0 on success, -1 on failure
+ */
+int bpkg_sidecar_journal_flush(struct bpkg_sidecar* sidecar);
+
+void bpkg_sidecar_close(struct bpkg_sidecar* sidecar);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef MERKLE_TRACKER_H
+#define MERKLE_TRACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chk/pkgchk.h>
+#include <chk/bitset.h>
+#include <tree/merkletree.h>
+#include <tree/sidecar.h>
+
+/*
+ * Verification state of a package being downloaded. Each chunk counts the
+ * bytes written into it, up to its size. Once the count covers the chunk
+ * it is hashed on its own and, if it matches, its leaf is marked verified. A parent is
+ * verified as soon as both children are, so each chunk only touches the
+ * O(log n) nodes above it and the package is complete when the root is.
+ *
+ * The package comes from its sidecar when one is current, so reopening it
+ * skips parsing, the tree build and, if the data file is unchanged,
+ * rehashing. Leaves are tracked in the chunk bitset done, which is what
+ * the sidecar stores, and the n_leaves - 1 internal nodes in nodes.
+ *
+ * Between checkpoints every write and verification is journaled, so a
+ * restart replays the journal over the last checkpoint and only hashes
+ * chunks that were fully written but not yet verified. Completion, or a
+ * journal past MERKLE_JOURNAL_COMPACT_BYTES, takes a new checkpoint.
+ */
+struct merkle_tracker {
+    struct bpkg_obj* obj;
+    struct bpkg_sidecar* sidecar;
+    char* data_path;
+    uint32_t* received;
+    uint64_t* done;
+    uint64_t* nodes;
+    size_t verified_chunks;
+};
+
+/**
+ * Opens the package at bpkg_path, mapping its sidecar or parsing it,
+ * building the tree and writing a new sidecar.
+ * @return tracker with nothing verified, or NULL if the package is invalid
+ */
+struct merkle_tracker* merkle_tracker_open(const char* bpkg_path, uint32_t threads);
+
+/**
+ * Marks the chunks of data_path that are already good, from the sidecar
+ * bitmap when the file is unchanged since it was stored, else by hashing.
+ */
+void merkle_tracker_seed(struct merkle_tracker* tracker, const char* data_path);
+
+/**
+ * Records len bytes written at offset of the data file open on fd,
+ * verifying any chunk that is now fully written.
+ * @return number of chunks newly verified
+ */
+size_t merkle_tracker_record(struct merkle_tracker* tracker, int fd, uint64_t offset, uint32_t len);
+
+static inline int merkle_tracker_verified(const struct merkle_tracker* tracker, size_t node) {
+    const struct merkle_tree* tree = tracker->obj->merkle_tree;
+    return merkle_is_leaf(tree, node) ? bitset_test(tracker->done, node - (tree->n_leaves - 1))
+                                      : bitset_test(tracker->nodes, node);
+}
+
+static inline int merkle_tracker_complete(const struct merkle_tracker* tracker) {
+    return merkle_tracker_verified(tracker, 0);
+}
+
+void merkle_tracker_destroy(struct merkle_tracker* tracker);
+
+#endif
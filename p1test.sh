@@ -0,0 +1,409 @@
+#!/bin/bash
+# Unit tests for the hashing, merkle tree and package code, run through
+# pkgmain and pkgmake on packages made in a scratch directory. The long
+# case packages a sparse data file past 4 GiB, so chunk offsets, sizes
+# and verification run above 32 bits. Nothing but a few marker blocks is
+# written, the rest stays a hole.
+
+set -u
+make -s pkgmain pkgmake || exit 1
+
+export ASAN_OPTIONS=detect_leaks=0
+bin=$(pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+data="$work/sparse.data"
+pkg="$work/sparse.bpkg"
+size=$((4 * 1024 * 1024 * 1024 + 256 * 1024 * 1024 + 12345))
+failed=0
+
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "PASS: $1"
+	else
+		echo "FAIL: $1, expected $3, got $2"
+		failed=1
+	fi
+}
+
+# Packages name their data file relative to where they are checked from
+cd "$work" || exit 1
+
+# Every SHA-256 backend the CPU offers passes its known answers
+check "backends pass their self test" "$("$bin/pkgmain" -selftest | grep -c FAILED)" "0"
+
+# Chunk digests agree with sha256sum either side of the padding boundaries
+for len in 1 55 56 63 64 65 119 120 4096; do
+	head -c $((len * 4)) /dev/urandom > pad.data
+	"$bin/pkgmake" pad.data "$len" pad.bpkg || exit 1
+	check "digest of a $len byte chunk" "$(sed -n '/^chunks:/{n;p}' pad.bpkg | cut -d, -f1 | tr -d '\t')" \
+		"$(head -c "$len" pad.data | sha256sum | cut -d' ' -f1)"
+done
+
+truncate -s "$size" "$data" || exit 1
+for at in 4096 4294967295 4294967296 4400000000 $((size - 64)); do
+	printf 'marker %d' "$at" | dd of="$data" bs=1 seek="$at" conv=notrunc status=none
+done
+
+"$bin/pkgmake" "$data" 1048576 "$pkg" -j 4 || exit 1
+nchunks=$(sed -n 's/^nchunks://p' "$pkg")
+last=$(sed -n '$p' "$pkg" | cut -d, -f2,3)
+
+check "size recorded" "$(sed -n 's/^size://p' "$pkg")" "$size"
+check "last chunk ends at the file size" "$(( ${last%,*} + ${last#*,} ))" "$size"
+check "all chunks verify" "$("$bin/pkgmain" "$pkg" -chunk_check -j 4 | wc -l)" "$nchunks"
+check "root covers the file" "$("$bin/pkgmain" "$pkg" -min_hashes -j 4)" "$(sed -n '6p' "$pkg" | tr -d '\t')"
+
+# A flipped byte past 4 GiB fails exactly the chunk that holds it
+printf 'X' | dd of="$data" bs=1 seek=4400000000 conv=notrunc status=none
+check "corruption past 4 GiB is found" "$("$bin/pkgmain" "$pkg" -chunk_check -j 4 | wc -l)" "$((nchunks - 1))"
+
+"$bin/pkgmain" -compile "$pkg" "$work/sparse.bpkgc" || exit 1
+check "compiled package agrees" "$("$bin/pkgmain" "$work/sparse.bpkgc" -chunk_check -j 4 --paranoid | wc -l)" "$((nchunks - 1))"
+
+# Proofs only fold up to the root from a leaf at the depth of the tree
+head -c 100000 /dev/urandom > small.data
+"$bin/pkgmake" small.data 4096 small.bpkg || exit 1
+root=$(sed -n '6p' small.bpkg | tr -d '\t')
+nchunks=$(sed -n 's/^nchunks://p' small.bpkg)
+first=$(sed -n '/^chunks:/{n;p}' small.bpkg | cut -d, -f1 | tr -d '\t')
+"$bin/pkgmain" small.bpkg -proof "$first" > proof
+check "proof verifies" "$("$bin/pkgmain" -verify_proof "$root" "$nchunks" proof)" "Proof valid"
+check "proof needs the chunk count" "$("$bin/pkgmain" -verify_proof "$root" 3 proof)" \
+	"chunk count not provided, it must be a power of two"
+check "proof of another depth is rejected" "$("$bin/pkgmain" -verify_proof "$root" "$((nchunks * 2))" proof)" "Proof invalid"
+
+# The parent of the first chunk proves against the root with one sibling
+# fewer, it is an interior node and must not pass for a chunk
+parent=$(sed -n '/^hashes:/,/^nchunks:/p' small.bpkg | sed -n "$((nchunks / 2 + 1))p" | tr -d '\t')
+{ echo 0; echo "$parent"; sed -n '4,$p' proof; } > short
+check "interior node proof is rejected" "$("$bin/pkgmain" -verify_proof "$root" "$nchunks" short)" "Proof invalid"
+
+# Numbers too large for their field are rejected instead of wrapping
+sed 's/^size:.*/size:18446744073709551616/' small.bpkg > wide.bpkg
+check "oversized file size is rejected" "$("$bin/pkgmain" wide.bpkg -all_hashes 2>&1)" "Invalid file size"
+sed 's/^nchunks:.*/nchunks:4294967328/' small.bpkg > wide.bpkg
+check "oversized nchunks is rejected" "$("$bin/pkgmain" wide.bpkg -all_hashes 2>&1)" "Invalid nchunks"
+sed '$s/,[0-9]*,/,99999999999999999999,/' small.bpkg > wide.bpkg
+check "oversized chunk offset is rejected" "$("$bin/pkgmain" wide.bpkg -all_hashes 2>&1)" "Invalid chunk offset or size"
+sed '$s/,[0-9]*$/,4294967296/' small.bpkg > wide.bpkg
+check "oversized chunk size is rejected" "$("$bin/pkgmain" wide.bpkg -all_hashes 2>&1)" "Invalid chunk offset or size"
+sed 's/^size:.*/size:18446744073709551615/' small.bpkg > wide.bpkg
+check "largest file size still parses" "$("$bin/pkgmain" wide.bpkg -all_hashes 2>&1)" "$("$bin/pkgmain" small.bpkg -all_hashes)"
+
+# The fingerprint cache is only kept in the directory given to it
+rm -rf cache
+"$bin/pkgmain" small.bpkg -chunk_check > /dev/null
+check "no cache entry by default" "$(find . -name '*.fp' | wc -l)" "0"
+sleep 0.1
+check "cache miss verifies every chunk" "$("$bin/pkgmain" small.bpkg -chunk_check --fp-cache cache | wc -l)" "$nchunks"
+check "cache entry written" "$(find cache -name '*.fp' | wc -l)" "1"
+
+# A hit is answered from the entry alone, so with its bitset zeroed no
+# chunk shows up as verified
+entry=$(find cache -name '*.fp')
+unset_bits() {
+	dd if=/dev/zero of="$entry" bs=1 seek=$(($(stat -c %s "$entry") - 8)) count=8 conv=notrunc status=none
+}
+unset_bits
+check "cache hit skips the data file" "$("$bin/pkgmain" small.bpkg -chunk_check --fp-cache cache | wc -l)" "0"
+check "--paranoid rehashes" "$("$bin/pkgmain" small.bpkg -chunk_check --fp-cache cache --paranoid | wc -l)" "$nchunks"
+unset_bits
+touch small.data
+check "touched data file is stale" "$("$bin/pkgmain" small.bpkg -chunk_check --fp-cache cache | wc -l)" "$nchunks"
+
+# Two packages of one data file keep separate entries
+"$bin/pkgmake" small.data 4096 other.bpkg -ident other-package-of-small-data || exit 1
+"$bin/pkgmain" other.bpkg -chunk_check --fp-cache cache > /dev/null
+check "entries are kept per package" "$(find cache -name '*.fp' | wc -l)" "2"
+
+# -batch tags each result line with its query, a hash with no node too
+missing=$(printf '%064d' 0)
+printf 'small.bpkg -hashes_of %s\nother.bpkg -hashes_of %s\nsmall.bpkg -chunk_check\n' \
+	"$missing" "$first" > manifest
+"$bin/pkgmain" -batch manifest -j 2 > batch.out
+check "miss is reported in its own block" "$(sed -n 's/^1\t//p' batch.out)" \
+	"No node found with the given hash: $missing"
+for n in 1 2 3; do
+	check "batch query $n matches its single run" "$(sed -n "s/^$n\t//p" batch.out)" \
+		"$("$bin/pkgmain" $(sed -n "${n}p" manifest))"
+done
+check "every query is terminated" "$(grep -c -x '[0-9]*' batch.out)" "3"
+
+# Reference merkle tree in python, read from the package's own lists. The
+# nodes are level order with the chunks as leaves, a parent is the digest
+# of its children's hex digests joined
+tree() {
+	python3 - "$@" <<'PYEOF'
+import hashlib, sys
+mode, bpkg = sys.argv[1], sys.argv[2]
+text = open(bpkg).read()
+hashes = text.split('\nhashes:\n')[1].split('\nnchunks:')[0].split()
+chunks = [c.split(',')[0] for c in text.split('\nchunks:\n')[1].split()]
+nodes = hashes + chunks
+def inorder(i):
+	if i >= len(nodes):
+		return []
+	return inorder(2 * i + 1) + [nodes[i]] + inorder(2 * i + 2)
+if mode == 'all':
+	print('\n'.join(inorder(0)))
+elif mode == 'of':
+	# Duplicate digests resolve to the node nearest the root
+	first = last = nodes.index(sys.argv[3])
+	while 2 * first + 1 < len(nodes):
+		first, last = 2 * first + 1, 2 * last + 2
+	print('\n'.join(nodes[first:last + 1]))
+elif mode in ('min', 'good'):
+	# Leaves whose data matches, then the nodes nearest the root covering them
+	data = open(sys.argv[3], 'rb').read()
+	spans = [c.split(',') for c in text.split('\nchunks:\n')[1].split()]
+	good = [hashlib.sha256(data[int(o):int(o) + int(n)]).hexdigest() == h for h, o, n in spans]
+	def complete(i):
+		if i >= len(hashes):
+			return good[i - len(hashes)]
+		return complete(2 * i + 1) and complete(2 * i + 2)
+	def cover(i):
+		if complete(i):
+			return [nodes[i]]
+		return cover(2 * i + 1) + cover(2 * i + 2) if i < len(hashes) else []
+	print('\n'.join(cover(0)) if mode == 'min' else sum(good))
+elif mode == 'parents':
+	bad = [i for i in range(len(hashes)) if nodes[i] != hashlib.sha256(
+		(nodes[2 * i + 1] + nodes[2 * i + 2]).encode()).hexdigest()]
+	print(len(bad))
+PYEOF
+}
+
+# Digests are kept binary and only turned into hex for printing
+check "package parents are digests of their children" "$(tree parents small.bpkg)" "0"
+check "-all_hashes prints the tree in order" "$("$bin/pkgmain" small.bpkg -all_hashes)" "$(tree all small.bpkg)"
+check "-all_hashes lists every node" "$("$bin/pkgmain" small.bpkg -all_hashes | wc -l)" "$((2 * nchunks - 1))"
+upper=$(echo "$first" | tr a-f A-F)
+check "upper case hex finds the same node" "$("$bin/pkgmain" small.bpkg -hashes_of "$upper")" "$first"
+check "short hash is no node" "$("$bin/pkgmain" small.bpkg -hashes_of "${first:0:63}")" \
+	"No node found with the given hash: ${first:0:63}"
+check "non hex hash is no node" "$("$bin/pkgmain" small.bpkg -hashes_of "g${first:1}")" \
+	"No node found with the given hash: g${first:1}"
+check "-file_check reports through its message" "$("$bin/pkgmain" small.bpkg -file_check)" "File Exists"
+sed 's/^filename:.*/filename:created.data/' small.bpkg > created.bpkg
+check "-file_check reports a missing file" "$("$bin/pkgmain" created.bpkg -file_check)" "File Created"
+
+# The flat tree keeps node i's children at 2i+1 and 2i+2, so every
+# subtree's chunks are a contiguous run of the leaf level
+level() {
+	sed -n '/^hashes:/,/^nchunks:/p' "$1" | sed -n "$(($2 + 1))p" | tr -d '\t'
+}
+check "root holds every chunk" "$("$bin/pkgmain" small.bpkg -hashes_of "$root")" \
+	"$(sed -n '/^chunks:/,$p' small.bpkg | sed 1d | cut -d, -f1 | tr -d '\t')"
+check "left child holds the first half" "$("$bin/pkgmain" small.bpkg -hashes_of "$(level small.bpkg 2)")" \
+	"$(sed -n '/^chunks:/,$p' small.bpkg | sed 1d | head -n $((nchunks / 2)) | cut -d, -f1 | tr -d '\t')"
+check "right child holds the second half" "$("$bin/pkgmain" small.bpkg -hashes_of "$(level small.bpkg 3)")" \
+	"$(sed -n '/^chunks:/,$p' small.bpkg | sed 1d | tail -n $((nchunks / 2)) | cut -d, -f1 | tr -d '\t')"
+check "a chunk holds itself" "$("$bin/pkgmain" small.bpkg -hashes_of "$first")" "$first"
+for n in 1 2 4 8 16; do
+	head -c $((n * 512)) /dev/urandom > flat.data
+	"$bin/pkgmake" flat.data 512 flat.bpkg || exit 1
+	check "tree of $n blocks in order" "$("$bin/pkgmain" flat.bpkg -all_hashes)" "$(tree all flat.bpkg)"
+	flatroot=$(sed -n '6p' flat.bpkg | tr -d '\t')
+	check "root of $n blocks holds every chunk" "$("$bin/pkgmain" flat.bpkg -hashes_of "$flatroot" | wc -l)" \
+		"$(sed -n 's/^nchunks://p' flat.bpkg)"
+done
+
+# Every node is found through the digest index, whatever its depth
+for node in $(sed -n '/^hashes:/,$p' small.bpkg | grep -v ':' | cut -d, -f1 | tr -d '\t'); do
+	[ "$("$bin/pkgmain" small.bpkg -hashes_of "$node")" = "$(tree of small.bpkg "$node")" ] || \
+		echo "FAIL: -hashes_of $node"
+done > index.out
+check "every node of the index agrees with the reference" "$(cat index.out)" ""
+check "digest not in the tree misses" "$("$bin/pkgmain" small.bpkg -hashes_of "$missing")" \
+	"No node found with the given hash: $missing"
+
+# A data file of zeros repeats one digest per level, lookups take the
+# node nearest the root
+head -c 8192 /dev/zero > zero.data
+"$bin/pkgmake" zero.data 512 zero.bpkg || exit 1
+for at in 6 7 9 13; do
+	node=$(sed -n "${at}p" zero.bpkg | tr -d '\t')
+	check "repeated digest on line $at" "$("$bin/pkgmain" zero.bpkg -hashes_of "$node")" "$(tree of zero.bpkg "$node")"
+done
+zerochunk=$(sed -n '/^chunks:/{n;p}' zero.bpkg | cut -d, -f1 | tr -d '\t')
+check "repeated chunk digest is one chunk" "$("$bin/pkgmain" zero.bpkg -hashes_of "$zerochunk")" "$zerochunk"
+
+# Trees of 4096 chunks and up are built on -j workers, any thread count
+# must give the tree a single thread builds
+head -c $((16384 * 64)) /dev/urandom > many.data
+"$bin/pkgmake" many.data 64 many.bpkg || exit 1
+"$bin/pkgmain" many.bpkg -all_hashes -j 1 > many.1
+check "single thread build is the reference tree" "$(cat many.1)" "$(tree all many.bpkg)"
+for j in 2 3 8 64; do
+	check "tree built on $j threads" "$("$bin/pkgmain" many.bpkg -all_hashes -j "$j" | cmp - many.1 && echo same)" "same"
+done
+check "subtree built on 8 threads" "$("$bin/pkgmain" many.bpkg -hashes_of "$(level many.bpkg 5)" -j 8)" \
+	"$(tree of many.bpkg "$(level many.bpkg 5)")"
+
+# The .bpkg is parsed in place from its mapping, a damaged package is
+# rejected by the section it breaks and never read past its end
+bad() {
+	"$bin/pkgmain" bad.bpkg -all_hashes 2>&1 | head -n 1
+}
+sed '6s/.$//' small.bpkg > bad.bpkg
+check "truncated hash is rejected" "$(bad)" "Invalid hash"
+sed '7s/^\t./\tx/' small.bpkg > bad.bpkg
+check "non hex hash is rejected" "$(bad)" "Invalid hash"
+sed '$d' small.bpkg > bad.bpkg
+check "missing chunk is rejected" "$(bad)" "Invalid chunk hash"
+sed 's/^nhashes:.*/nhashes:3/' small.bpkg > bad.bpkg
+check "nhashes off the chunk count is rejected" "$(bad)" "Invalid nhashes"
+: > bad.bpkg
+check "empty package is rejected" "$(bad)" "Missing file size"
+printf '%s' "$(cat small.bpkg)" > bad.bpkg
+check "package without a final newline parses" "$("$bin/pkgmain" bad.bpkg -all_hashes)" "$(tree all small.bpkg)"
+sed 's/$/\r/' small.bpkg > bad.bpkg
+check "package with CRLF lines parses" "$("$bin/pkgmain" bad.bpkg -all_hashes)" "$(tree all small.bpkg)"
+check "missing package is reported" "$("$bin/pkgmain" nothere.bpkg -all_hashes 2>&1 | head -n 1)" \
+	"Failed to open .bpkg file!: No such file or directory"
+
+# A compiled package answers every query as its text does, and compiles
+# back to the same bytes
+"$bin/pkgmain" -compile small.bpkg small.bpkgc || exit 1
+for query in -all_hashes -min_hashes -chunk_check -file_check "-hashes_of $root" \
+		"-hashes_of $(level small.bpkg 3)" "-proof $first"; do
+	check "compiled $query" "$("$bin/pkgmain" small.bpkgc $query)" "$("$bin/pkgmain" small.bpkg $query)"
+done
+"$bin/pkgmain" -compile small.bpkgc again.bpkgc || exit 1
+check "compiled package compiles to itself" "$(cmp small.bpkgc again.bpkgc && echo same)" "same"
+"$bin/pkgmain" -compile many.bpkg many.bpkgc || exit 1
+check "compiled tree built on 8 threads" "$("$bin/pkgmain" many.bpkgc -all_hashes -j 8 | cmp - many.1 && echo same)" "same"
+
+# A damaged compiled package is refused rather than mapped past its end
+head -c 200 small.bpkgc > bad.bpkgc
+check "truncated compiled package is rejected" "$("$bin/pkgmain" bad.bpkgc -all_hashes 2>&1)" "Invalid compiled package"
+head -c $(($(stat -c %s small.bpkgc) - 1)) small.bpkgc > bad.bpkgc
+check "compiled package short one byte is rejected" "$("$bin/pkgmain" bad.bpkgc -all_hashes 2>&1)" "Invalid compiled package"
+{ head -c 8 small.bpkgc; printf '\x09\0\0\0'; tail -c +13 small.bpkgc; } > bad.bpkgc
+check "compiled package of another version is rejected" "$("$bin/pkgmain" bad.bpkgc -all_hashes 2>&1)" "Invalid compiled package"
+
+# Batched queries share one arena that is reset between them, each must
+# print what it does on its own whatever ran before it, larger or smaller
+printf 'X' | dd of=many.data bs=1 seek=70000 conv=notrunc status=none
+: > manifest
+for bpkg in many.bpkg small.bpkg many.bpkg flat.bpkg small.bpkgc many.bpkg; do
+	for query in -all_hashes -min_hashes -chunk_check -file_check; do
+		echo "$bpkg $query" >> manifest
+	done
+	echo "$bpkg -hashes_of $(level "${bpkg%c}" 1)" >> manifest
+done
+"$bin/pkgmain" -batch manifest -j 4 > batch.out
+total=$(wc -l < manifest)
+for ((n = 1; n <= total; n++)); do
+	[ "$(sed -n "s/^$n\t//p" batch.out)" = "$("$bin/pkgmain" $(sed -n "${n}p" manifest))" ] || \
+		echo "FAIL: batch query $n, $(sed -n "${n}p" manifest)"
+done > arena.out
+check "every batched query matches its single run" "$(cat arena.out)" ""
+check "every batched query is terminated" "$(grep -c -x '[0-9]*' batch.out)" "$total"
+
+# Completion is kept one bit per chunk, chunks either side of a word
+# boundary and at both ends must be told apart
+head -c $((256 * 64)) /dev/urandom > bits.data
+"$bin/pkgmake" bits.data 64 bits.bpkg || exit 1
+chunk_hashes() {
+	sed -n '/^chunks:/,$p' "$1" | sed 1d | cut -d, -f1 | tr -d '\t'
+}
+check "every chunk complete" "$("$bin/pkgmain" bits.bpkg -chunk_check)" "$(chunk_hashes bits.bpkg)"
+for c in 0 63 64 127 128 255; do
+	cp bits.data good.data
+	printf 'X' | dd of=bits.data bs=1 seek=$((c * 64 + 5)) conv=notrunc status=none
+	check "chunk $c alone incomplete" "$("$bin/pkgmain" bits.bpkg -chunk_check)" \
+		"$(chunk_hashes bits.bpkg | sed "$((c + 1))d")"
+	mv good.data bits.data
+done
+for c in 0 63 64 255; do
+	printf 'X' | dd of=bits.data bs=1 seek=$((c * 64)) conv=notrunc status=none
+done
+check "chunks 0, 63, 64 and 255 incomplete" "$("$bin/pkgmain" bits.bpkg -chunk_check)" \
+	"$(chunk_hashes bits.bpkg | sed '1d;64d;65d;256d')"
+check "completion of 8 threads agrees" "$("$bin/pkgmain" bits.bpkg -chunk_check -j 8)" \
+	"$("$bin/pkgmain" bits.bpkg -chunk_check)"
+
+# -min_hashes is the fewest complete nodes covering every complete chunk,
+# left to right, for any pattern of damage
+corrupt() {
+	for c in "$@"; do
+		printf 'X' | dd of=bits.data bs=1 seek=$((c * 64)) conv=notrunc status=none
+	done
+}
+head -c $((256 * 64)) /dev/urandom > bits.data
+"$bin/pkgmake" bits.data 64 bits.bpkg || exit 1
+cp bits.data clean.data
+check "complete package is covered by its root" "$("$bin/pkgmain" bits.bpkg -min_hashes)" "$(level bits.bpkg 1)"
+for damage in "0" "255" "63 64" "1 2 4 8 16 32 64 128" "$(seq -s " " 0 2 255)" "$(seq -s " " 1 254)" "$(seq -s " " 0 255)"; do
+	cp clean.data bits.data
+	corrupt $damage
+	check "cover with $(echo $damage | wc -w) chunks damaged from ${damage%% *}" \
+		"$("$bin/pkgmain" bits.bpkg -min_hashes)" "$(tree min bits.bpkg bits.data)"
+done
+for run in 1 2 3 4 5; do
+	cp clean.data bits.data
+	corrupt $(shuf -i 0-255 -n $((RANDOM % 40 + 1)))
+	check "cover of random damage $run" "$("$bin/pkgmain" bits.bpkg -min_hashes -j 4)" "$(tree min bits.bpkg bits.data)"
+done
+
+# Verification splits the chunks over -j workers, any count must find
+# the same chunks, including more workers than chunks
+head -c $((2 * 1024 * 1024 + 777)) /dev/urandom > pool.data
+"$bin/pkgmake" pool.data 4096 pool.bpkg || exit 1
+for at in 0 4096 1000000 $((2 * 1024 * 1024 + 700)); do
+	printf 'X' | dd of=pool.data bs=1 seek="$at" conv=notrunc status=none
+done
+"$bin/pkgmain" pool.bpkg -chunk_check -j 1 > pool.1
+check "damaged chunks are not complete" "$(wc -l < pool.1)" "$(($(sed -n 's/^nchunks://p' pool.bpkg) - 4))"
+for j in 2 3 7 16 1024; do
+	check "chunk check on $j threads" "$("$bin/pkgmain" pool.bpkg -chunk_check -j "$j" | cmp - pool.1 && echo same)" "same"
+	check "cover on $j threads" "$("$bin/pkgmain" pool.bpkg -min_hashes -j "$j")" "$(tree min pool.bpkg pool.data)"
+done
+check "file check on 8 threads" "$("$bin/pkgmain" pool.bpkg -file_check -j 8)" "File Exists"
+check "-j 0 is refused" "$("$bin/pkgmain" pool.bpkg -chunk_check -j 0)" "-j requires a thread count of at least 1"
+check "-j without a count is refused" "$("$bin/pkgmain" pool.bpkg -chunk_check -j)" "-j requires a thread count of at least 1"
+
+# Every -io mode reads the same bytes, down to the unaligned tail, and
+# reports itself on stderr only when asked for
+for mode in read mmap direct; do
+	check "-io $mode finds the damaged chunks" "$("$bin/pkgmain" pool.bpkg -chunk_check -io "$mode" -j 3 2>/dev/null | cmp - pool.1 && echo same)" "same"
+	check "-io $mode cover" "$("$bin/pkgmain" pool.bpkg -min_hashes -io "$mode" 2>/dev/null)" "$(tree min pool.bpkg pool.data)"
+	check "-io $mode reports on stderr" "$("$bin/pkgmain" pool.bpkg -chunk_check -io "$mode" 2>&1 >/dev/null | cut -d' ' -f1-2)" "$mode: verified"
+done
+check "no report without -io" "$("$bin/pkgmain" pool.bpkg -chunk_check 2>&1 >/dev/null)" ""
+check "unknown -io mode is refused" "$("$bin/pkgmain" pool.bpkg -chunk_check -io fast)" "-io requires one of read, mmap or direct"
+
+# A data file shorter than its package fails the chunks it lacks the
+# same way in every mode, a mapping must not be read past its end
+truncate -s 1000000 pool.data
+"$bin/pkgmain" pool.bpkg -chunk_check -io read 2>/dev/null > pool.short
+check "short data file fails its missing chunks" "$(wc -l < pool.short)" "$(tree good pool.bpkg pool.data)"
+for mode in mmap direct; do
+	check "short data file under -io $mode" "$("$bin/pkgmain" pool.bpkg -chunk_check -io "$mode" -j 4 2>/dev/null | cmp - pool.short && echo same)" "same"
+done
+
+# pkgmake writes the same package whatever workers and reads it uses
+head -c 1000003 /dev/urandom > make.data
+"$bin/pkgmake" make.data 4096 make.1.bpkg -j 1 || exit 1
+check "made package is its own reference tree" "$(tree parents make.1.bpkg)" "0"
+check "made package verifies" "$("$bin/pkgmain" make.1.bpkg -chunk_check | wc -l)" "$(sed -n 's/^nchunks://p' make.1.bpkg)"
+check "uneven size is split into chunks one byte apart" "$(sed -n '/^chunks:/,$p' make.1.bpkg | sed 1d | cut -d, -f3 | sort -u | tr '\n' ' ')" "3906 3907 "
+for args in "-j 4" "-j 64" "-io mmap" "-io direct -j 3" "-io read -j 2"; do
+	"$bin/pkgmake" make.data 4096 make.2.bpkg $args 2>/dev/null || exit 1
+	check "pkgmake $args" "$(cmp make.1.bpkg make.2.bpkg && echo same)" "same"
+done
+"$bin/pkgmake" make.data 4096 make.2.bpkg -ident custom-ident || exit 1
+check "-ident names the package" "$(sed -n 's/^ident://p' make.2.bpkg)" "custom-ident"
+check "-ident leaves the tree alone" "$(sed 1d make.2.bpkg)" "$(sed 1d make.1.bpkg)"
+"$bin/pkgmake" make.data 10000000 make.2.bpkg || exit 1
+check "chunk size past the file still makes two chunks" "$(sed -n 's/^nchunks://p' make.2.bpkg)" "2"
+check "empty data file is refused" "$(: > none.data; "$bin/pkgmake" none.data 4096 none.bpkg 2>&1)" "Data file is empty"
+check "zero chunk size is refused" "$("$bin/pkgmake" make.data 0 none.bpkg 2>&1)" "chunk size must be a positive number of bytes"
+check "missing data file is refused" "$("$bin/pkgmake" nothere.data 4096 none.bpkg 2>&1)" \
+	"Unable to open file: No such file or directory"
+check "refused package is not written" "$([ -e none.bpkg ] && echo written)" ""
+
+exit $failed
@@ -0,0 +1,462 @@
+#!/bin/bash
+# IO tests for btide. Each peer gets a config and a share directory in a
+# scratch directory, is driven through its command input and checked on
+# what it prints and the files it leaves behind. Servers run in the
+# background on a fifo, clients are run through their commands to QUIT.
+
+set -u
+make -s btide pkgmake pkgmain || exit 1
+
+export ASAN_OPTIONS=detect_leaks=0
+bin=$(pwd)
+work=$(mktemp -d)
+server=
+trap '[ -n "$server" ] && kill "$server" 2>/dev/null; rm -rf "$work"' EXIT
+# Below the ephemeral range, where a client socket could hold a peer's port
+port=$((10000 + RANDOM % 20000))
+failed=0
+
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "PASS: $1"
+	else
+		echo "FAIL: $1, expected $3, got $2"
+		failed=1
+	fi
+}
+
+# peer <name>: a config sharing <name>/ on its own port
+peer() {
+	port=$((port + 1))
+	mkdir -p "$1"
+	printf 'directory:%s\nmax_peers:256\nport:%d\n' "$1" "$port" > "$1.cfg"
+}
+
+# package <dir> <name> <size> <chunk size>: random data and its package,
+# the package names the data file bare so any share directory can hold it
+package() {
+	head -c "$3" /dev/urandom > "$1/$2.data"
+	(cd "$1" && "$bin/pkgmake" "$2.data" "$4" "$work/$2.bpkg") || exit 1
+}
+
+# run <name> <command>...: runs a peer through the commands and QUIT
+run() {
+	local name=$1
+	shift
+	printf '%s\n' "$@" QUIT | "$bin/btide" "$name.cfg" > "$name.log" 2>&1
+}
+
+# serve <name> <command>...: starts a peer in the background, send and
+# stop drive it afterwards
+serve() {
+	local name=$1
+	shift
+	mkfifo "$name.in"
+	"$bin/btide" "$name.cfg" < "$name.in" > "$name.log" 2>&1 &
+	server=$!
+	exec 3> "$name.in"
+	rm -f "$name.in"
+	for command in "$@"; do
+		echo "$command" >&3
+	done
+	sleep 0.5
+}
+
+send() {
+	echo "$1" >&3
+}
+
+stop() {
+	echo QUIT >&3
+	exec 3>&-
+	wait "$server"
+	server=
+}
+
+# fetches <bpkg> <port> [offset]: a FETCH for every chunk of the package
+fetches() {
+	local ident
+	ident=$(sed -n 's/^ident://p' "$1")
+	sed -n '/^chunks:/,$p' "$1" | sed 1d | while IFS=, read -r hash _; do
+		echo "FETCH 127.0.0.1:$2 $ident ${hash//[[:space:]]/}${3:+ $3}"
+	done
+}
+
+# status <name>: what the last PACKAGES of a peer's run said
+status() {
+	sed -n 's/^[0-9]*\. .* : //p' "$1.log" | tail -n 1
+}
+
+# fake_peer <port> <proof file> [stray | split <data file>]: accepts one
+# peer and answers its REQ with the proof given and RES packets of random
+# bytes. With stray they land past the end or before the start of the
+# requested range, with split they carry the data file's bytes and the
+# frames are cut up and run together on the stream
+fake_peer() {
+	python3 - "$@" <<'EOF' &
+import os, socket, struct, sys, time
+
+def frame(code, payload=b''):
+    return struct.pack('<HH', code, 0) + payload.ljust(4092, b'\0')
+
+def receive(conn):
+    data = b''
+    while len(data) < 4096:
+        part = conn.recv(4096 - len(data))
+        if not part:
+            sys.exit(1)
+        data += part
+    return data
+
+server = socket.create_server(('127.0.0.1', int(sys.argv[1])))
+proof = open(sys.argv[2]).read().split()
+conn, _ = server.accept()
+conn.sendall(frame(0x02))
+receive(conn)
+req = receive(conn)
+offset, length = struct.unpack_from('<II', req, 4)
+siblings = b''.join(bytes.fromhex(h) for h in proof[2:])
+conn.sendall(frame(0x08, struct.pack('<II', int(proof[0]), len(proof) - 2) +
+                   bytes.fromhex(proof[1]) + siblings))
+stray = sys.argv[3:4] == ['stray']
+data = open(sys.argv[4], 'rb').read() if sys.argv[3:4] == ['split'] else None
+stream = b''
+for i, at in enumerate(range(0, length, 2998)):
+    n = min(2998, length - at)
+    shift = (length if i % 2 == 0 else -at - n) if stray else 0
+    body = data[offset + at:offset + at + n] if data else os.urandom(n)
+    stream += frame(0x07, struct.pack('<I', (offset + at + shift) & 0xffffffff) +
+                    body.ljust(2998, b'\0') + struct.pack('<H', n) + req[12:1100])
+for at in range(0, len(stream), 1000 if data else len(stream)):
+    conn.sendall(stream[at:at + (1000 if data else len(stream))])
+    if data:
+        time.sleep(0.001)
+conn.recv(1)
+EOF
+	sleep 0.5
+}
+
+# raw_peer <port> <bpkg> <data file> <case>: connects to a peer as a bare
+# socket and prints what it makes of the peer's answers in that case
+raw_peer() {
+	python3 - "$@" <<'EOF'
+import socket, struct, sys, time
+
+port, bpkg, data_path, case = int(sys.argv[1]), sys.argv[2], sys.argv[3], sys.argv[4]
+text = open(bpkg).read()
+ident = text.split('ident:')[1].split()[0]
+chunks = [(h, int(o), int(z)) for h, o, z in (l.split(',') for l in text.split('\nchunks:')[1].split())]
+data = open(data_path, 'rb').read()
+
+def frame(code, payload=b''):
+    return struct.pack('<HH', code, 0) + payload.ljust(4092, b'\0')
+
+def receive(conn):
+    data = b''
+    while len(data) < 4096:
+        part = conn.recv(4096 - len(data))
+        if not part:
+            sys.exit(1)
+        data += part
+    return data
+
+def req(chunk, version=2, wide=None):
+    hash, offset, length = chunk
+    payload = bytearray(4092)
+    struct.pack_into('<II', payload, 0, offset, length)
+    payload[8:72] = hash.encode()
+    payload[72:72 + len(ident)] = ident.encode()
+    payload[1097] = version
+    struct.pack_into('<QQ', payload, 1104, *(wide or (offset, length)))
+    return frame(0x06, bytes(payload))
+
+# Puts the RES packets of one chunk back together, None on an error
+def collect(conn, chunk):
+    hash, offset, length = chunk
+    got = bytearray(length)
+    for _ in range((length + 2997) // 2998):
+        packet = receive(conn)
+        code, error = struct.unpack_from('<HH', packet)
+        if code != 0x07 or error:
+            return None
+        at, = struct.unpack_from('<I', packet, 4)
+        n, = struct.unpack_from('<H', packet, 8 + 2998)
+        got[at - offset:at - offset + n] = packet[8:8 + n]
+    return bytes(got)
+
+def served(conn, chunk):
+    return collect(conn, chunk) == data[chunk[1]:chunk[1] + chunk[2]]
+
+conn = socket.create_connection(('127.0.0.1', port))
+receive(conn)
+if case == 'framing':
+    # The ACK and every request in one write, then requests cut at odd
+    # places, one of them running into the next
+    conn.sendall(frame(0x0c) + b''.join(req(chunk) for chunk in chunks))
+    ok = sum(served(conn, chunk) for chunk in chunks)
+    stream = req(chunks[1]) + req(chunks[2])
+    for at in range(0, len(stream), 1000):
+        conn.sendall(stream[at:at + 1000])
+        time.sleep(0.01)
+    ok += served(conn, chunks[1]) + served(conn, chunks[2])
+    single = req(chunks[3])
+    for start, end in ((0, 1), (1, 4), (4, 4095), (4095, 4096)):
+        conn.sendall(single[start:end])
+        time.sleep(0.01)
+    ok += served(conn, chunks[3])
+    print(ok == len(chunks) + 3)
+    sys.exit(0)
+conn.sendall(frame(0x0c))
+if case == 'stale':
+    # An older peer's REQ with leftover bytes where the version and u64 fields go
+    conn.sendall(req(chunks[1], 0xaa, (0x1234567890, 0xdeadbeefcafe)))
+    print(served(conn, chunks[1]))
+elif case == 'frames':
+    # Every RES of the last chunk, whole and from an offset that leaves a
+    # short packet at the end of the file, byte for byte
+    hash, offset, length = chunks[-1]
+    ok = True
+    for skip in (0, 1000):
+        start = offset + skip
+        conn.sendall(req((hash, start, length - skip)))
+        for at in range(start, offset + length, 2998):
+            n = min(2998, offset + length - at)
+            expect = (struct.pack('<HHI', 0x07, 0, at) + data[at:at + n].ljust(2998, b'\0') +
+                      struct.pack('<H', n) + hash.encode() + ident.encode().ljust(1024, b'\0'))
+            ok = ok and receive(conn) == expect
+    print(ok)
+elif case == 'crowd':
+    # A hundred peers each have a request in before any answer is read
+    crowd = [conn] + [socket.create_connection(('127.0.0.1', port)) for _ in range(99)]
+    for peer in crowd[1:]:
+        receive(peer)
+        peer.sendall(frame(0x0c))
+    for i, peer in enumerate(crowd):
+        peer.sendall(req(chunks[i % len(chunks)]))
+    print(sum(served(peer, chunks[i % len(chunks)]) for i, peer in reversed(list(enumerate(crowd)))))
+EOF
+}
+
+inode() {
+	stat -c %i "$1"
+}
+
+cd "$work" || exit 1
+
+# The .state sidecar is written on the first open and trusted after that
+peer side
+package side a 1000000 65536
+run side "ADDPACKAGE a.bpkg" PACKAGES
+check "complete package reports COMPLETED" "$(status side)" "COMPLETED"
+check "sidecar written next to the package" "$([ -s a.bpkg.state ] && echo yes)" "yes"
+
+state=$(inode a.bpkg.state)
+run side "ADDPACKAGE a.bpkg" PACKAGES
+check "reopen keeps COMPLETED" "$(status side)" "COMPLETED"
+check "reopen reuses the sidecar" "$(inode a.bpkg.state)" "$state"
+
+# An edited package is newer than its sidecar, which is rebuilt
+touch -d '+2 seconds' a.bpkg
+run side "ADDPACKAGE a.bpkg" PACKAGES
+check "edited package still COMPLETED" "$(status side)" "COMPLETED"
+check "edited package rebuilds the sidecar" "$([ "$(inode a.bpkg.state)" != "$state" ] && echo yes)" "yes"
+
+printf 'not a sidecar' > a.bpkg.state
+run side "ADDPACKAGE a.bpkg" PACKAGES
+check "garbage sidecar is ignored" "$(status side)" "COMPLETED"
+check "garbage sidecar is rewritten" "$([ "$(stat -c %s a.bpkg.state)" -gt 13 ] && echo yes)" "yes"
+
+# A sidecar whose tree depth disagrees with its chunk count is stale
+state=$(inode a.bpkg.state)
+python3 - a.bpkg.state <<'EOF'
+import struct, sys
+with open(sys.argv[1], 'r+b') as f:
+    f.seek(152)
+    tree, = struct.unpack('<Q', f.read(8))
+    f.seek(tree + 16)
+    f.write(struct.pack('<I', 40))
+EOF
+run side "ADDPACKAGE a.bpkg" PACKAGES
+check "sidecar of the wrong depth is ignored" "$(status side)" "COMPLETED"
+check "sidecar of the wrong depth is rewritten" "$([ "$(inode a.bpkg.state)" != "$state" ] && echo yes)" "yes"
+
+# A data file replaced by another inode is rehashed, not taken on trust
+cp side/a.data copy.data
+printf 'X' | dd of=copy.data bs=1 seek=500000 conv=notrunc status=none
+mv copy.data side/a.data
+run side "ADDPACKAGE a.bpkg" PACKAGES
+check "replaced data file is rehashed" "$(status side)" "INCOMPLETE"
+
+# A fetch from another peer resumes from the journal after a restart and
+# checkpoints once the package is complete
+peer seed
+seed=$port
+peer leech
+package seed c 1000000 65536
+cp c.bpkg leech-c.bpkg
+serve seed "ADDPACKAGE c.bpkg"
+mapfile -t fetch < <(fetches c.bpkg "$seed")
+run leech "ADDPACKAGE leech-c.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[@]:0:8}" PACKAGES
+check "half a fetch is INCOMPLETE" "$(status leech)" "INCOMPLETE"
+check "journal holds the progress" "$([ "$(stat -c %s leech-c.bpkg.journal)" -gt 104 ] && echo yes)" "yes"
+run leech "ADDPACKAGE leech-c.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[@]:8}" PACKAGES
+check "resumed fetch completes" "$(status leech)" "COMPLETED"
+check "resumed fetch copies the data" "$(cmp seed/c.data leech/c.data && echo same)" "same"
+check "completion checkpoints the journal" "$(stat -c %s leech-c.bpkg.journal)" "104"
+run leech "ADDPACKAGE leech-c.bpkg" PACKAGES
+check "reopened download is COMPLETED" "$(status leech)" "COMPLETED"
+
+# The same inode cut to another size is not what the checkpoint describes
+truncate -s 0 leech/c.data
+run leech "ADDPACKAGE leech-c.bpkg" PACKAGES
+check "truncated download is INCOMPLETE" "$(status leech)" "INCOMPLETE"
+
+# Nor is a file edited in place after the journal was written, a tick of
+# the file clock later so the two times differ
+rm leech/c.data* leech-c.bpkg.*
+run leech "ADDPACKAGE leech-c.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[@]:0:8}"
+sleep 0.1
+printf 'X' | dd of=leech/c.data bs=1 seek=1000 conv=notrunc status=none
+run leech "ADDPACKAGE leech-c.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[@]:8}" PACKAGES
+check "chunk edited after the journal is refetched" "$(status leech)" "INCOMPLETE"
+
+# An edit in the same tick of the file clock as the last journal write
+# ties its times, which is not trusted either
+rm leech/c.data* leech-c.bpkg.*
+run leech "ADDPACKAGE leech-c.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[@]:0:8}"
+printf 'X' | dd of=leech/c.data bs=1 seek=1000 conv=notrunc status=none
+touch -d "$(stat -c %z leech/c.data)" leech-c.bpkg.journal
+run leech "ADDPACKAGE leech-c.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[@]:8}" PACKAGES
+check "chunk edited in the tick of the journal is refetched" "$(status leech)" "INCOMPLETE"
+stop
+
+# Chunks fetched with proofs are written once their data hashes to the
+# proven chunk
+peer seed
+seed=$port
+peer proven
+echo proofs:1 >> proven.cfg
+package seed b 1000000 65536
+cp b.bpkg proven-b.bpkg
+serve seed "ADDPACKAGE b.bpkg"
+mapfile -t fetch < <(fetches b.bpkg "$seed")
+run proven "ADDPACKAGE proven-b.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[@]}" PACKAGES
+stop
+check "proven fetch completes" "$(status proven)" "COMPLETED"
+check "proven fetch copies the data" "$(cmp seed/b.data proven/b.data && echo same)" "same"
+
+# A proof that checks out does not vouch for data that does not match it
+rm proven/b.data proven-b.bpkg.*
+fake=$((port + 100))
+"$bin/pkgmain" b.bpkg -proof "${fetch[0]##* }" > b.proof
+fake_peer "$fake" b.proof
+liar=$!
+run proven "ADDPACKAGE proven-b.bpkg" "CONNECT 127.0.0.1:$fake" "${fetch[0]/:$seed/:$fake}"
+wait "$liar"
+check "data that fails its proof is dropped" "$(grep -c 'Chunk data does not match its proof' proven.log)" "1"
+check "nothing of it is written" "$(cmp -s -n 1000000 proven/b.data /dev/zero && echo zeros)" "zeros"
+
+# Without proofs data is still only written inside the requested range
+peer trusting
+cp b.bpkg trusting-b.bpkg
+fake_peer "$fake" b.proof stray
+liar=$!
+run trusting "ADDPACKAGE trusting-b.bpkg" "CONNECT 127.0.0.1:$fake" "${fetch[0]/:$seed/:$fake}"
+wait "$liar"
+check "data outside the requested range is dropped" \
+	"$(grep -c 'Response data is outside the requested chunk' trusting.log)" "$(((62500 + 2997) / 2998))"
+check "nothing outside the range is written" "$(cmp -s -n 1000000 trusting/b.data /dev/zero && echo zeros)" "zeros"
+fake_peer "$fake" b.proof
+liar=$!
+run trusting "ADDPACKAGE trusting-b.bpkg" "CONNECT 127.0.0.1:$fake" "${fetch[0]/:$seed/:$fake} 4294967296" \
+	"${fetch[0]/:$seed/:$fake} 62499"
+kill "$liar" 2>/dev/null
+wait "$liar" 2>/dev/null
+check "offset past 4 GiB is past the chunk" "$(grep -c 'Offset is past the end of the chunk' trusting.log)" "1"
+check "offset of the last byte is fetched" "$(grep -c 'Successfully wrote 1 bytes' trusting.log)" "1"
+
+# The fetching side frames answers however the stream cuts them too
+rm trusting/b.data trusting-b.bpkg.*
+fake_peer "$fake" b.proof split seed/b.data
+liar=$!
+run trusting "ADDPACKAGE trusting-b.bpkg" "CONNECT 127.0.0.1:$fake" "${fetch[0]/:$seed/:$fake}"
+wait "$liar"
+check "split answers are all written" "$(grep -c 'Successfully wrote' trusting.log)" "$(((62500 + 2997) / 2998))"
+check "split answers write the chunk" "$(cmp -n 62500 seed/b.data trusting/b.data && echo same)" "same"
+
+# A REQ whose u64 fields disagree with its u32 ones is read as version 1
+peer plain
+package plain d 1000000 65536
+serve plain "ADDPACKAGE d.bpkg"
+check "stray version byte is served as version 1" "$(raw_peer "$port" d.bpkg plain/d.data stale)" "True"
+stop
+
+# One server answers many peers at once
+peer busy
+busy=$port
+package busy e 2000000 65536
+serve busy "ADDPACKAGE e.bpkg"
+mapfile -t fetch < <(fetches e.bpkg "$busy")
+for n in 1 2 3; do
+	peer "many$n"
+	cp e.bpkg "many$n-e.bpkg"
+	run "many$n" "ADDPACKAGE many$n-e.bpkg" "CONNECT 127.0.0.1:$busy" "${fetch[@]}" PACKAGES &
+done
+check "crowd of peers is served" "$(raw_peer "$busy" e.bpkg busy/e.data crowd)" "100"
+wait $(jobs -p | grep -vx "$server")
+for n in 1 2 3; do
+	check "concurrent fetch $n completes" "$(status "many$n")" "COMPLETED"
+	check "concurrent fetch $n copies the data" "$(cmp busy/e.data "many$n/e.data" && echo same)" "same"
+done
+stop
+
+# Packets are framed from the stream however it is cut
+peer framed
+package framed f 1000000 65536
+serve framed "ADDPACKAGE f.bpkg"
+check "split and coalesced packets are framed" "$(raw_peer "$port" f.bpkg framed/f.data framing)" "True"
+stop
+
+# RES data streamed from the file, down to the short packets that end a
+# chunk and the file
+peer stream
+stream=$port
+peer partial
+package stream g 1000003 65536
+cp g.bpkg partial-g.bpkg
+serve stream "ADDPACKAGE g.bpkg"
+check "RES packets match the file byte for byte" "$(raw_peer "$stream" g.bpkg stream/g.data frames)" "True"
+mapfile -t fetch < <(fetches g.bpkg "$stream")
+mapfile -t tails < <(fetches g.bpkg "$stream" 1000)
+run partial "ADDPACKAGE partial-g.bpkg" "CONNECT 127.0.0.1:$stream" "${tails[@]}" PACKAGES
+check "chunk tails alone are INCOMPLETE" "$(status partial)" "INCOMPLETE"
+check "chunk tails are written where they belong" \
+	"$(cmp -s -i 1000 -n 61500 stream/g.data partial/g.data && echo same)" "same"
+run partial "ADDPACKAGE partial-g.bpkg" "CONNECT 127.0.0.1:$stream" "${fetch[@]}" PACKAGES
+check "streamed fetch completes" "$(status partial)" "COMPLETED"
+check "streamed fetch copies the data" "$(cmp stream/g.data partial/g.data && echo same)" "same"
+stop
+
+# Chunks are verified as their bytes arrive, in any order and resent
+peer seed
+seed=$port
+peer track
+package seed h 1000000 65536
+cp h.bpkg track-h.bpkg
+serve seed "ADDPACKAGE h.bpkg"
+mapfile -t fetch < <(fetches h.bpkg "$seed")
+mapfile -t tails < <(fetches h.bpkg "$seed" 1000)
+run track "ADDPACKAGE track-h.bpkg" "CONNECT 127.0.0.1:$seed" "${tails[0]}" "${tails[0]}" PACKAGES
+check "resent tail that overcounts its chunk is not verified" "$(status track)" "INCOMPLETE"
+reversed=()
+for ((i = ${#fetch[@]} - 1; i > 0; i--)); do
+	reversed+=("${fetch[i]}")
+done
+run track "ADDPACKAGE track-h.bpkg" "CONNECT 127.0.0.1:$seed" "${reversed[@]}" "${reversed[@]:0:4}" PACKAGES
+check "all but the first chunk, backwards and resent, is INCOMPLETE" "$(status track)" "INCOMPLETE"
+run track "ADDPACKAGE track-h.bpkg" "CONNECT 127.0.0.1:$seed" "${fetch[0]}" PACKAGES
+check "the missing first chunk completes the tree" "$(status track)" "COMPLETED"
+check "tracked fetch copies the data" "$(cmp seed/h.data track/h.data && echo same)" "same"
+stop
+
+exit $failed
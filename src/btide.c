@@ -1,6 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <config.h>
 #include <peer.h>
 #include <pthread.h>
@@ -8,6 +10,7 @@
 #include <sys/stat.h>
 #include <chk/pkgchk.h>
 #include <tree/merkletree.h>
+#include <tree/tracker.h>
 #include <crypt/sha256.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -22,70 +25,105 @@ typedef struct {
 // PART 2
 //
 //SUBMISSION 34 FOR INPUTS
-void process_res_packet(btide_packet* packet, package_node* package_list) {
-    char identifier[1024];
-    char hash[64];
-    uint32_t file_offset;
-    uint16_t data_len;
-    char* received_data = malloc(MAX_RES_DATA);
-
-    memcpy(&file_offset, packet->pl.data, sizeof(file_offset));
-    memcpy(received_data, packet->pl.data + 4, MAX_RES_DATA);
-    memcpy(&data_len, packet->pl.data + 4 + MAX_RES_DATA, sizeof(data_len));
-    memcpy(hash, packet->pl.data + 6 + MAX_RES_DATA, sizeof(hash));
-    memcpy(identifier, packet->pl.data + 70 + MAX_RES_DATA, sizeof(identifier));
-
-    if (data_len > BUFFER_SIZE) {
-        fprintf(stderr, "Error: data_len %u exceeds BUFFER_SIZE %d\n", data_len, BUFFER_SIZE);
-        return; // Or handle error more appropriately
-    }
-    // FETCH 127.0.0.1:9856 5105d1a7ffbde836fe5aaa6704ecc751857561c6073e065f4a9e40654410b613b881a57aca9c0ec4853c5919d2998bc3355dac867137ffc74f3a85357de08b3b089a510c23312f87eb1604c81a895b554ef9f05138268ad65ed629e436d912e50eefe301c274c4a227850694c6dd9b3991975991c0585fa772c785b4c82545ed675b1ecde15310b827fbdbf931e76c5d4a85852667a775facf59a42d605cda91426c782dfc57141e367daab0a0d7a68e8eaf6cd692da6e8a407ea2f42ccc24ab34a917fa9c40adaed1d74cb6873acd5f208378d1411febdbca206e7e5a917e09e9c61975b849325fc703571b1ac89d276ed784c3c1cf31ff9f2e6497e6f731f90c081cbdd7d09c02b2016a8507c39bc98c198c66336cf6ea9fbf9349b1c4c8d44edca42d79a7f8187d800c9bd5fadce1ace400279ce9401cd9cd6693b8d95caf884896f22eb6ed2b6f8c5100ad9f94e1c295898a731503072837a384113a51c2457cef7538a3baae3e5d1d12f4d45969ee6ddd205d407eeac47e1800cd526bb59127e4731b49a2366b4835802d299de2f09d4116c5f672ded1616e19c325007f01d42eae395ac2893eaadb39e5ef55e56b98947cdc79ef31edbb9e47326875de076abd689d27d59b246b3a36c9f3ec1f389e5f7fd96aef504bc75fd18c47966cefb3e22bb9598a9c553a41bdd0466a349e770a3b384b3d883b37ce4ae804238 904fefa128f596dfb144e35faa7b7faefae93cd8d83847fb249d144f97e7ceb9
-
-    printf("file offset: %u\n", file_offset);
-    package_node* package = find_package(package_list, identifier);
-    if (!package) {
-        printf("Unable to request chunk, package is not managed\n");
-        free(received_data); 
-        return;
-    }
+// RES carries the low half of its offset, the rest is the request's
+static uint64_t res_packet_offset(const btide_packet* packet, uint64_t requested_offset) {
+    uint32_t low_offset;
+    memcpy(&low_offset, packet->pl.data, sizeof(low_offset));
+    return requested_offset + (uint32_t) (low_offset - (uint32_t) requested_offset);
+}
 
+// Writes received data into a package's file, only the chunks this write finished are rehashed
+static void package_write(package_node* package, uint64_t file_offset, const void* data, size_t data_len) {
     FILE *file = fopen(package->package_path, "r+b"); 
     if (!file) {
         perror("Failed to open file");
-        free(received_data); 
         return;
     }
 
     // Seek to the specified file offset
-    if (fseek(file, file_offset, SEEK_SET) != 0) {
+    if (fseeko(file, (off_t) file_offset, SEEK_SET) != 0) {
         perror("Failed to seek in file");
         fclose(file);
-        free(received_data); 
         return;
     }
 
     // Write the received data to the file
-    if (fwrite(received_data, 1, data_len, file) != data_len) {
+    if (fwrite(data, 1, data_len, file) != data_len) {
         perror("Failed to write to file");
     } else {
-        printf("Successfully wrote %u bytes to the file at offset %u\n", data_len, file_offset);
+        printf("Successfully wrote %zu bytes to the file at offset %" PRIu64 "\n", data_len, file_offset);
+
+        if (package->tracker && fflush(file) == 0 &&
+            merkle_tracker_record(package->tracker, fileno(file), file_offset, data_len) > 0 &&
+            merkle_tracker_complete(package->tracker)) {
+            package->complete = 1;
+        }
     }
 
-    free(received_data); 
     fclose(file);
 }
 
+// Reads len bytes of a package's file at file_offset
+static int package_read(const package_node* package, uint64_t file_offset, void* data, size_t len) {
+    FILE *file = fopen(package->package_path, "rb");
+    if (!file) {
+        return -1;
+    }
+    int ok = fseeko(file, (off_t) file_offset, SEEK_SET) == 0 && fread(data, 1, len, file) == len;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+// Writes a RES for the requested range, data outside it is dropped like in the proof path
+void process_res_packet(const btide_packet* packet, package_node* package_list, uint64_t requested_offset, uint32_t requested_len) {
+    char identifier[1024];
+    uint16_t data_len;
+
+    memcpy(&data_len, packet->pl.data + 4 + MAX_RES_DATA, sizeof(data_len));
+    memcpy(identifier, packet->pl.data + 70 + MAX_RES_DATA, sizeof(identifier));
+
+    uint64_t file_offset = res_packet_offset(packet, requested_offset);
+    if (data_len > MAX_RES_DATA || data_len > requested_len || file_offset < requested_offset ||
+        file_offset - requested_offset > requested_len - data_len) {
+        printf("Response data is outside the requested chunk\n");
+        return;
+    }
+    printf("file offset: %" PRIu64 "\n", file_offset);
+    package_node* package = find_package(package_list, identifier);
+    if (!package) {
+        printf("Unable to request chunk, package is not managed\n");
+        return;
+    }
+
+    package_write(package, file_offset, packet->pl.data + 4, data_len);
+}
+
+// Checks a PRF packet for the requested chunk against nothing but the package root
+static int proof_packet_valid(const btide_packet* packet, const struct merkle_tree* tree, const uint8_t* digest, struct merkle_proof* proof) {
+    if (packet->error > 0) {
+        return 0;
+    }
+    memcpy(&proof->chunk, packet->pl.data, sizeof(proof->chunk));
+    memcpy(&proof->len, packet->pl.data + 4, sizeof(proof->len));
+    if (proof->len >= MERKLE_MAX_DEPTH) {
+        return 0;
+    }
+    memcpy(proof->leaf, packet->pl.data + PRF_LEAF_OFFSET, SHA256_DIGEST_LENGTH);
+    memcpy(proof->siblings, packet->pl.data + PRF_SIBLINGS_OFFSET, proof->len * SHA256_DIGEST_LENGTH);
+    return sha256_digest_eq(proof->leaf, digest) && merkle_proof_verify(proof, tree->hashes[0], tree->depth);
+}
+
 //Processes the fetch command
-void fetch_command_handler(const char* command, peer_node* peer_list, package_node* package_list) {
+void fetch_command_handler(const char* command, peer_node* peer_list, package_node* package_list, int proofs) {
     char ip[INET_ADDRSTRLEN];
     int port;
     char identifier[1025];
     char hash[65];
-    uint32_t offset = 0;
+    uint64_t offset = 0;
     uint32_t data_len = 0;
 
     // Parse IP, port, identifier, hash, and optionally offset
-    int args = sscanf(command, "%[^:]:%d %1024s %64s %u", ip, &port, identifier, hash, &offset);
+    int args = sscanf(command, "%[^:]:%d %1024s %64s %" SCNu64, ip, &port, identifier, hash, &offset);
 
     if (args <= 3) {
         printf("Missing arguments from command\n");
@@ -106,72 +144,130 @@ void fetch_command_handler(const char* command, peer_node* peer_list, package_no
         return;
     }
     
-    // Load package object and validate hash
-    struct bpkg_obj* package_obj = bpkg_load(package->bpkg_path);
-    if (!package_obj) {
-        fprintf(stderr, "object isn't loaded properly\n");
-        printf("object isn't loaded properly\n");
-        return;
+    // The package and its tree were loaded once by ADDPACKAGE
+    const struct bpkg_obj* package_obj = package->tracker->obj;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    ssize_t node = -1;
+    if (sha256_hex_to_digest(hash, digest) == 0) {
+        node = find_hash(package_obj->merkle_tree, digest);
     }
-    struct merkle_tree_node* root = build_merkle_tree(package_obj->chunks, 0, package_obj->nchunks - 1);
-    package_obj->merkle_root = root;
-    if (find_hash(package_obj->merkle_root, hash) == 0) {
+    if (node < 0 || !merkle_is_leaf(package_obj->merkle_tree, node)) {
         fprintf(stderr, "Unable to request chunk, chunk hash does not belong to package\n");
         printf("Unable to request chunk, chunk hash does not belong to package\n");
-        bpkg_obj_destroy(package_obj);
         return;
     }
 
-    uint32_t file_offset = -1;
-    for (size_t i = 0; i < package_obj->nchunks; i++) {
-        if (strncmp(package_obj->chunks[i].hash, hash, 64) == 0) {
-            file_offset = package_obj->chunks[i].offset;
-            break;
+    // Leaves are stored in chunk order after the interior nodes
+    const Chunk* chunk = &package_obj->chunks[node - (package_obj->merkle_tree->n_leaves - 1)];
+    if (offset >= chunk->size) {
+        printf("Offset is past the end of the chunk\n");
+        return;
+    }
+    data_len = chunk->size - offset;
+    uint64_t total_offset = chunk->offset + offset;
+    uint32_t low_offset = (uint32_t) total_offset;
+    uint64_t wide_len = data_len;
+
+    // With proofs the chunk is put together first and only written once it hashes to the proven leaf
+    uint8_t* chunk_data = NULL;
+    if (proofs) {
+        chunk_data = calloc(1, chunk->size);
+        // The part of the chunk before offset is not requested, it comes from the local copy
+        if (!chunk_data || (offset > 0 && package_read(package, chunk->offset, chunk_data, offset) != 0)) {
+            printf("Unable to read the chunk from the local file\n");
+            free(chunk_data);
+            return;
         }
     }
 
-
-    uint32_t chunk_size = package_obj->size /package_obj->nchunks;
-    data_len = chunk_size - offset;
-    bpkg_obj_destroy(package_obj);
-    uint32_t total_offset = file_offset + offset;
     // Send REQ packet
     btide_packet req_packet;
+    memset(&req_packet, 0, sizeof(req_packet));
     req_packet.msg_code = PKT_MSG_REQ;
-    memcpy(req_packet.pl.data, &total_offset, sizeof(offset));
+    memcpy(req_packet.pl.data, &low_offset, sizeof(low_offset));
     memcpy(req_packet.pl.data + 4, &data_len, sizeof(data_len));
     memcpy(req_packet.pl.data + 8, hash, sizeof(hash));
     memcpy(req_packet.pl.data + 72, identifier, sizeof(identifier));
+    if (proofs) {
+        req_packet.pl.data[REQ_FLAGS_OFFSET] = REQ_FLAG_PROOF;
+    }
+    req_packet.pl.data[REQ_VERSION_OFFSET] = WIRE_VERSION;
+    memcpy(req_packet.pl.data + REQ_OFFSET64_OFFSET, &total_offset, sizeof(total_offset));
+    memcpy(req_packet.pl.data + REQ_LEN64_OFFSET, &wide_len, sizeof(wide_len));
     send_packet(peer->socket_fd, &req_packet);
 
     int expected_packets = (data_len + MAX_RES_DATA - 1) / MAX_RES_DATA; 
     int packets_received = 0;
+    int rejected = 0;
+    int proven = 0;
+    struct merkle_proof proof;
 
+    // Answers are framed by the peer's reader, however the stream cuts them
     while (packets_received < expected_packets) {
-        btide_packet res_packet;
-        receive_packet(peer->socket_fd, &res_packet);
-        if (res_packet.msg_code != PKT_MSG_RES) {
+        const btide_packet* res_packet = packet_reader_receive(peer->reader, peer->socket_fd);
+        if (!res_packet) {
+            free(chunk_data);
+            return;
+        }
+        if (res_packet->msg_code == PKT_MSG_PRF) {
+            if (proof_packet_valid(res_packet, package_obj->merkle_tree, digest, &proof)) {
+                proven = 1;
+            } else {
+                printf("Chunk proof does not match package root\n");
+                rejected = 1;
+            }
+            continue;
+        }
+        if (res_packet->msg_code != PKT_MSG_RES) {
             printf("Wrong packet type received\n");
             continue; 
         }
 
-        if (res_packet.error > 0) {
-            printf("Peer failed to send requested data, error: %d\n", res_packet.error);
+        if (res_packet->error > 0) {
+            printf("Peer failed to send requested data, error: %d\n", res_packet->error);
+            free(chunk_data);
             return;
         }
 
-        process_res_packet(&res_packet, package_list);
+        if (chunk_data) {
+            uint64_t file_offset = res_packet_offset(res_packet, total_offset);
+            uint16_t len;
+            memcpy(&len, res_packet->pl.data + 4 + MAX_RES_DATA, sizeof(len));
+            if (len > MAX_RES_DATA || file_offset < total_offset ||
+                file_offset - chunk->offset > chunk->size - len) {
+                printf("Response data is outside the requested chunk\n");
+                rejected = 1;
+            } else {
+                memcpy(chunk_data + (file_offset - chunk->offset), res_packet->pl.data + 4, len);
+            }
+        } else {
+            process_res_packet(res_packet, package_list, total_offset, data_len);
+        }
 
         packets_received++;
     }
+
+    if (chunk_data) {
+        uint8_t received[SHA256_DIGEST_LENGTH];
+        sha256_hash(chunk_data, chunk->size, received);
+        if (!rejected && !proven) {
+            printf("Peer sent no proof for the chunk\n");
+        } else if (!rejected && !sha256_digest_eq(received, proof.leaf)) {
+            printf("Chunk data does not match its proof\n");
+        } else if (!rejected) {
+            package_write(package, total_offset, chunk_data + offset, data_len);
+        }
+        free(chunk_data);
+    }
 }
 
 void process_add_package(char *command_str, Config *config, package_node **head) {
-    struct bpkg_obj* obj = bpkg_load(command_str);
-    if (!obj) {
+    struct merkle_tracker* tracker = merkle_tracker_open(command_str, config->threads);
+    if (!tracker) {
         printf("Unable to parse bpkg file\n");
         return;
     }
+    struct bpkg_obj* obj = tracker->obj;
 
     char full_path[1024];
     // Check if the directory ends with a slash
@@ -188,27 +284,23 @@ void process_add_package(char *command_str, Config *config, package_node **head)
         file = fopen(full_path, "wb");
         if (!file) {
             printf("Failed to create file '%s'\n", full_path);
-            bpkg_obj_destroy(obj);
+            merkle_tracker_destroy(tracker);
             return;
         }
-        fseek(file, obj->size - 1, SEEK_SET);
+        fseeko(file, (off_t) (obj->size - 1), SEEK_SET);
         fwrite("\0", 1, 1, file);
         fclose(file);
 
         file = fopen(full_path, "r");
         if (!file) {
-            bpkg_obj_destroy(obj);
+            merkle_tracker_destroy(tracker);
             return;
         }
     }
     fclose(file);
 
-    struct bpkg_query qry = compare_files(obj, full_path);
-    int complete = (qry.len == obj->nchunks) ? 1 : 0;
-
-    add_package_to_list(head, full_path, command_str, complete, obj->ident);
-    bpkg_obj_destroy(obj);
-    bpkg_query_destroy(&qry);
+    merkle_tracker_seed(tracker, full_path);
+    add_package_to_list(head, full_path, command_str, merkle_tracker_complete(tracker), obj->ident, tracker);
 }
 
 void* command_handler(void* arg) {
@@ -293,7 +385,7 @@ void* command_handler(void* arg) {
             pthread_mutex_unlock(tdata->mutex);
         } else if (strncmp(command, "FETCH", 5) == 0) {
             char* command_str = command + 6;
-            fetch_command_handler(command_str, head_peer, *tdata->head);
+            fetch_command_handler(command_str, head_peer, *tdata->head, tdata->config->proofs);
         }
     }
     return NULL;  // To satisfy the compiler, won't actually reach here
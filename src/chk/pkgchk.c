@@ -1,544 +1,1201 @@
+// O_DIRECT is a Linux extension
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <chk/pkgchk.h>
+#include <chk/bitset.h>
 #include <crypt/sha256.h>
 #include <tree/merkletree.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
 
 // PART 1
 
-/**
- * Loads the package for when a valid path is given
- *///
-struct bpkg_obj* bpkg_load(const char* path) {
-    FILE *bpkg_file = fopen(path, "r");
+// A hashes: or chunks: section, the lines after its header
+struct bpkg_section {
+    const char* start;
+    uint32_t count;
+    bool seen;
+    bool truncated;
+};
+
+// End of the line starting at p, its newline or the end of the text
+static const char* bpkg_line_end(const char* p, const char* end) {
+    const char* nl = memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
 
-    if (!bpkg_file) {
-        perror("Failed to open .bpkg file!");
-        return NULL;
-    }
+static const char* bpkg_next_line(const char* p, const char* end) {
+    const char* eol = bpkg_line_end(p, end);
+    return eol < end ? eol + 1 : end;
+}
 
-    struct bpkg_obj* obj = malloc(sizeof(struct bpkg_obj));
+static bool bpkg_key(const char* p, const char* eol, const char* key, size_t key_len) {
+    return (size_t) (eol - p) >= key_len && memcmp(p, key, key_len) == 0;
+}
 
-    if (!obj) {
-        perror("Failed to allocate memory for package object");
-        fclose(bpkg_file);
-        return NULL;
+/*
+ * Unsigned decimal with atoi's leading whitespace, 0 when there are no
+ * digits. Fails with out set to 0, rather than wrapping, when the value
+ * is above max.
+ */
+static int bpkg_parse_u64(const char* p, const char* end, uint64_t max, uint64_t* out) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
     }
+    if (p < end && *p == '+') {
+        p++;
+    }
+    uint64_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        uint64_t d = (uint64_t) (*p++ - '0');
+        if (value > (max - d) / 10) {
+            *out = 0;
+            return -1;
+        }
+        value = value * 10 + d;
+    }
+    *out = value;
+    return 0;
+}
 
-    // Initialize obj fields
-    memset(obj->ident, 0, sizeof(obj->ident));
-    memset(obj->filename, 0, sizeof(obj->filename));
-    obj->size = 0;
-    obj->nhashes = 0;
-    obj->nchunks = 0;
-    obj->hashes = NULL;
-    obj->chunks = NULL;
-    obj->merkle_root = NULL;
-
-    char line[1030];
-    while (fgets(line, sizeof(line), bpkg_file)) {
-        if (strncmp(line, "ident:", 6) == 0) {
-            char* ident_start = line + 6;
-            strncpy(obj->ident, ident_start, sizeof(obj->ident) - 1);
-            obj->ident[sizeof(obj->ident) - 1] = '\0';
-        } else if (strncmp(line, "filename:", 9) == 0) {
-            char* filename_start = line + 9;
-            size_t len = strlen(filename_start);
-            
-            if (filename_start[len - 1] == '\n') {
-                filename_start[len - 1] = '\0';
-            }
-
-            strncpy(obj->filename, filename_start, sizeof(obj->filename));
-            obj->filename[sizeof(obj->filename) - 1] = '\0';
-        } else if (strncmp(line, "size:", 5) == 0) {
-            char* size_start = line + 5;
-
-            obj->size = atoi(size_start);
-        } else if (strncmp(line, "nhashes:", 8) == 0) {
-            char* nhashes_start = line + 8;
-
-            obj->nhashes = atoi(nhashes_start);
-            
-        } else if (strncmp(line, "nchunks:", 8) == 0) {
-            char* nchunks = line + 8;
-
-            obj->nchunks = atoi(nchunks);
-        } else if (strncmp(line, "hashes:", 7) == 0) {
-            // Assuming obj->nhashes has already been initialized
-            obj->hashes = malloc(obj->nhashes * sizeof(char*));
-            if (obj->hashes == NULL) {
-                // Handle memory allocation failure
-                fprintf(stderr, "Memory allocation failed for obj->hashes\n");
-                exit(EXIT_FAILURE); // or return an error code, depending on your program structure
-            }
+// Records a section and steps over its lines
+static const char* bpkg_section_scan(struct bpkg_section* section, const char* p, const char* end, uint32_t count) {
+    section->start = p;
+    section->count = count;
+    section->seen = true;
+    section->truncated = false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (p >= end) {
+            section->truncated = true;
+            return end;
+        }
+        p = bpkg_next_line(p, end);
+    }
+    return p;
+}
 
-            for (int i = 0; i < obj->nhashes; i++) {
-                obj->hashes[i] = malloc((MAX_HASH_LEN + 1) * sizeof(char)); // Include space for null terminator
+// Decodes the 64 hex digits after leading whitespace, the line must hold all of them
+static const char* bpkg_parse_digest(const char* p, const char* eol, uint8_t* digest) {
+    while (p < eol && *p != '\n' && isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (eol - p < 2 * SHA256_DIGEST_LENGTH || sha256_hex_to_digest(p, digest) != 0) {
+        return NULL;
+    }
+    return p + 2 * SHA256_DIGEST_LENGTH;
+}
 
-                if (obj->hashes[i] == NULL) {
-                    // Handle memory allocation failure
-                    fprintf(stderr, "Memory allocation failed for obj->hashes[%d]\n", i);
-                    exit(EXIT_FAILURE); // or return an error code, depending on your program structure
-                }
+static int bpkg_parse_hashes(const struct bpkg_section* section, const char* end, uint8_t (*hashes)[SHA256_DIGEST_LENGTH]) {
+    const char* p = section->start;
+    for (uint32_t i = 0; i < section->count; i++) {
+        const char* eol = bpkg_line_end(p, end);
+        if (p >= end || !bpkg_parse_digest(p, eol, hashes[i])) {
+            return -1;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    return 0;
+}
 
-                if (fgets(line, sizeof(line), bpkg_file) != NULL) {
-                    char *token = strtok(line, " \t\n");
-                    if (token != NULL) {
-                        // Skip leading whitespace
-                        while (isspace(*token)) {
-                            token++;
-                        }
-                        strncpy(obj->hashes[i], token, MAX_HASH_LEN);
-                        obj->hashes[i][MAX_HASH_LEN] = '\0'; // Ensure null termination
-                    } 
-                } else {
-                    i--; 
-                    continue;
-                }
-            } 
-        } else if (strncmp(line, "chunks:", 7) == 0) {
-            obj->chunks = malloc(obj->nchunks * sizeof(struct chunk_obj));
+/*
+ * Each line is "hash,offset,size", a missing offset or size reads as 0.
+ * @return 0 on success, -1 for a bad hash, -2 for an offset or size out of range
+ */
+static int bpkg_parse_chunks(const struct bpkg_section* section, const char* end, Chunk* chunks) {
+    const char* p = section->start;
+    for (uint32_t i = 0; i < section->count; i++) {
+        const char* eol = bpkg_line_end(p, end);
+        const char* cursor = p < end ? bpkg_parse_digest(p, eol, chunks[i].hash) : NULL;
+        if (!cursor) {
+            return -1;
+        }
+        chunks[i].offset = 0;
+        chunks[i].size = 0;
 
-            if (obj->chunks == NULL) {
-                // Handle memory allocation failure
+        const char* comma = memchr(cursor, ',', eol - cursor);
+        if (comma) {
+            if (bpkg_parse_u64(comma + 1, eol, UINT64_MAX, &chunks[i].offset) != 0) {
+                return -2;
             }
-
-            for (int i = 0; i < obj->nchunks; i++) {
-                fgets(line, sizeof(line), bpkg_file);
-                // Split the line into substrings using strtok
-                char *token = strtok(line, ",");
-                if (token != NULL) {
-                    while (isspace(*token)) {
-                        token++;
-                    }
-                    strcpy(obj->chunks[i].hash, token);
-                    token = strtok(NULL, ",");
-                    if (token != NULL) {
-                        obj->chunks[i].offset = atoi(token);
-                        token = strtok(NULL, ",");
-                        if (token != NULL) {
-                            obj->chunks[i].size = atoi(token);
-                        }
-                    }
+            comma = memchr(comma + 1, ',', eol - comma - 1);
+            uint64_t size;
+            if (comma) {
+                if (bpkg_parse_u64(comma + 1, eol, UINT32_MAX, &size) != 0) {
+                    return -2;
                 }
+                chunks[i].size = (uint32_t) size;
             }
         }
+        p = eol < end ? eol + 1 : end;
     }
+    return 0;
+}
 
-    fclose(bpkg_file);
+/*
+ * Compiled package (.bpkgc): this header, nchunks chunk records and the
+ * nhashes interior hashes, at 8-byte aligned offsets in host byte order,
+ * which byte_order records. A chunk record is laid out as a Chunk, so
+ * both tables are used straight from the mapping, which the object keeps
+ * until it is destroyed. Where the ABI pads Chunk differently, e.g. on
+ * i386, the chunk records are copied instead.
+ */
+struct bpkgc_header {
+    char magic[BPKGC_MAGIC_LEN];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    uint32_t nchunks;
+    uint32_t nhashes;
+    uint64_t chunks_off;
+    uint64_t hashes_off;
+    char ident[MAX_IDENT_LEN];
+    char filename[MAX_FILENAME_LEN];
+};
+
+struct bpkgc_chunk {
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+#define BPKGC_CHUNKS_IN_PLACE (sizeof(struct bpkgc_chunk) == sizeof(Chunk) && \
+    offsetof(struct bpkgc_chunk, offset) == offsetof(Chunk, offset) && \
+    offsetof(struct bpkgc_chunk, size) == offsetof(Chunk, size))
+
+// Object with room for its hashes and chunks in the same allocation
+static struct bpkg_obj* bpkg_obj_alloc(const struct bpkg_obj* header, size_t nhashes, size_t nchunks) {
+    size_t hashes_bytes = nhashes * SHA256_DIGEST_LENGTH;
+    struct bpkg_obj* obj = malloc(sizeof(struct bpkg_obj) + hashes_bytes + nchunks * sizeof(Chunk));
+    if (!obj) {
+        perror("Failed to allocate memory for package object");
+        return NULL;
+    }
+    *obj = *header;
+    obj->hashes = (uint8_t (*)[SHA256_DIGEST_LENGTH]) (obj + 1);
+    obj->chunks = (Chunk*) ((uint8_t*) (obj + 1) + hashes_bytes);
+    obj->merkle_tree = NULL;
+    obj->map = NULL;
+    obj->map_len = 0;
+    return obj;
+}
 
+static int bpkg_check_counts(const struct bpkg_obj* obj) {
     if (!obj->size) {
         fprintf(stderr, "Missing file size\n");
-        bpkg_obj_destroy(obj);
-        return NULL;
+        return -1;
     } else if (!obj->nchunks) {
         fprintf(stderr, "Missing nchunks\n");
-        free(obj->hashes);
-        free(obj->chunks);
-        free(obj);
-        return NULL;
+        return -1;
     } else if (!obj->nhashes) {
         fprintf(stderr, "Missing nhashes\n");
-        free(obj->chunks);
-        for (int i = 0; i < obj->nhashes; i++) {
-            free(obj->hashes[i]);
-        }
-        free(obj->hashes);
-        free(obj);
-        return NULL;
+        return -1;
     }
     
 
     if (obj->nchunks && !(obj->nchunks & (obj->nchunks - 1)) == false) {
         fprintf(stderr, "Invalid nchunks\n");
-        free(obj->chunks);
-        for (int i = 0; i < obj->nhashes; i++) {
-            free(obj->hashes[i]);
-        }
-        free(obj->hashes);
-        free(obj);
-        return NULL;
+        return -1;
     }
 
     if (obj->nhashes != obj->nchunks - 1) {
         fprintf(stderr, "Invalid nhashes\n");
-        free(obj->chunks);
-        for (int i = 0; i < obj->nhashes; i++) {
-            free(obj->hashes[i]);
+        return -1;
+    }
+    return 0;
+}
+
+static struct bpkg_obj* bpkg_parse_compiled(uint8_t* data, size_t len) {
+    const struct bpkgc_header* hdr = (const struct bpkgc_header*) data;
+    if (len < sizeof(*hdr) || hdr->version != BPKGC_VERSION || hdr->byte_order != BPKGC_BYTE_ORDER ||
+        hdr->chunks_off % 8 || hdr->hashes_off % 8 ||
+        hdr->chunks_off > len || (len - hdr->chunks_off) / sizeof(struct bpkgc_chunk) < hdr->nchunks ||
+        hdr->hashes_off > len || (len - hdr->hashes_off) / SHA256_DIGEST_LENGTH < hdr->nhashes) {
+        fprintf(stderr, "Invalid compiled package\n");
+        return NULL;
+    }
+    struct bpkg_obj header = { 0 };
+    memcpy(header.ident, hdr->ident, MAX_IDENT_LEN);
+    memcpy(header.filename, hdr->filename, MAX_FILENAME_LEN);
+    header.size = hdr->size;
+    header.nchunks = hdr->nchunks;
+    header.nhashes = hdr->nhashes;
+    if (bpkg_check_counts(&header) != 0) {
+        return NULL;
+    }
+
+    struct bpkg_obj* obj = bpkg_obj_alloc(&header, 0, BPKGC_CHUNKS_IN_PLACE ? 0 : hdr->nchunks);
+    if (!obj) {
+        return NULL;
+    }
+    obj->hashes = (uint8_t (*)[SHA256_DIGEST_LENGTH]) (data + hdr->hashes_off);
+    obj->map = data;
+    obj->map_len = len;
+
+    if (BPKGC_CHUNKS_IN_PLACE) {
+        obj->chunks = (Chunk*) (data + hdr->chunks_off);
+        return obj;
+    }
+    const struct bpkgc_chunk* records = (const struct bpkgc_chunk*) (data + hdr->chunks_off);
+    for (uint32_t i = 0; i < hdr->nchunks; i++) {
+        memcpy(obj->chunks[i].hash, records[i].hash, SHA256_DIGEST_LENGTH);
+        obj->chunks[i].offset = records[i].offset;
+        obj->chunks[i].size = records[i].size;
+    }
+    return obj;
+}
+
+int bpkg_compile(const struct bpkg_obj* obj, const char* path) {
+    struct bpkgc_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BPKGC_MAGIC, sizeof(hdr.magic));
+    hdr.version = BPKGC_VERSION;
+    hdr.byte_order = BPKGC_BYTE_ORDER;
+    hdr.size = obj->size;
+    hdr.nchunks = obj->nchunks;
+    hdr.nhashes = obj->nhashes;
+    hdr.chunks_off = sizeof(hdr);
+    hdr.hashes_off = hdr.chunks_off + (uint64_t) obj->nchunks * sizeof(struct bpkgc_chunk);
+    memcpy(hdr.ident, obj->ident, MAX_IDENT_LEN);
+    memcpy(hdr.filename, obj->filename, MAX_FILENAME_LEN);
+
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        perror("Unable to create compiled package");
+        return -1;
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+    for (uint32_t i = 0; ok && i < obj->nchunks; i++) {
+        struct bpkgc_chunk record = { 0 };
+        memcpy(record.hash, obj->chunks[i].hash, SHA256_DIGEST_LENGTH);
+        record.offset = obj->chunks[i].offset;
+        record.size = obj->chunks[i].size;
+        ok = fwrite(&record, sizeof(record), 1, out) == 1;
+    }
+    ok = ok && fwrite(obj->hashes, SHA256_DIGEST_LENGTH, obj->nhashes, out) == obj->nhashes;
+    if (fclose(out) != 0 || !ok) {
+        perror("Failed to write compiled package");
+        remove(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parses the mapped text of a .bpkg in one pass over its lines. Sections
+ * are only located during the scan, so that the object, its hashes and
+ * its chunks can then be decoded straight into a single allocation.
+ */
+static struct bpkg_obj* bpkg_parse(const char* text, size_t len) {
+    const char* end = text + len;
+    struct bpkg_obj header = { 0 };
+    struct bpkg_section hashes = { 0 };
+    struct bpkg_section chunks = { 0 };
+    const char* invalid = NULL;
+    uint64_t count;
+
+    const char* p = text;
+    while (p < end) {
+        const char* eol = bpkg_line_end(p, end);
+        const char* next = eol < end ? eol + 1 : end;
+
+        if (bpkg_key(p, eol, "ident:", 6)) {
+            size_t n = eol - p - 6;
+            memcpy(header.ident, p + 6, n < MAX_IDENT_LEN ? n : MAX_IDENT_LEN);
+        } else if (bpkg_key(p, eol, "filename:", 9)) {
+            size_t n = eol - p - 9;
+            memcpy(header.filename, p + 9, n < MAX_FILENAME_LEN ? n : MAX_FILENAME_LEN);
+        } else if (bpkg_key(p, eol, "size:", 5)) {
+            if (bpkg_parse_u64(p + 5, eol, UINT64_MAX, &header.size) != 0) {
+                invalid = "Invalid file size";
+            }
+        } else if (bpkg_key(p, eol, "nhashes:", 8)) {
+            if (bpkg_parse_u64(p + 8, eol, UINT32_MAX, &count) != 0) {
+                invalid = "Invalid nhashes";
+            }
+            header.nhashes = (uint32_t) count;
+        } else if (bpkg_key(p, eol, "nchunks:", 8)) {
+            if (bpkg_parse_u64(p + 8, eol, UINT32_MAX, &count) != 0) {
+                invalid = "Invalid nchunks";
+            }
+            header.nchunks = (uint32_t) count;
+        } else if (bpkg_key(p, eol, "hashes:", 7)) {
+            // A section holds as many lines as the count read before it
+            next = bpkg_section_scan(&hashes, next, end, header.nhashes);
+        } else if (bpkg_key(p, eol, "chunks:", 7)) {
+            next = bpkg_section_scan(&chunks, next, end, header.nchunks);
         }
-        free(obj->hashes);
-        free(obj);
+        p = next;
+    }
+
+    // A count that does not fit is rejected before anything is sized by it
+    if (invalid) {
+        fprintf(stderr, "%s\n", invalid);
+        return NULL;
+    }
+    if (hashes.truncated) {
+        fprintf(stderr, "Invalid hash\n");
+        return NULL;
+    }
+    if (chunks.truncated) {
+        fprintf(stderr, "Invalid chunk hash\n");
+        return NULL;
+    }
+
+    struct bpkg_obj* obj = bpkg_obj_alloc(&header, hashes.count, chunks.count);
+    if (!obj) {
+        return NULL;
+    }
+    if (!hashes.seen) {
+        obj->hashes = NULL;
+    }
+    if (!chunks.seen) {
+        obj->chunks = NULL;
+    }
+
+    if (hashes.seen && bpkg_parse_hashes(&hashes, end, obj->hashes) != 0) {
+        fprintf(stderr, "Invalid hash\n");
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+    int chunk_error = chunks.seen ? bpkg_parse_chunks(&chunks, end, obj->chunks) : 0;
+    if (chunk_error != 0) {
+        fprintf(stderr, chunk_error == -1 ? "Invalid chunk hash\n" : "Invalid chunk offset or size\n");
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+
+    if (bpkg_check_counts(obj) != 0) {
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+
+    if (hashes.seen && hashes.count != obj->nhashes) {
+        fprintf(stderr, "Invalid nhashes\n");
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+
+    if (!obj->hashes || !obj->chunks) {
+        fprintf(stderr, "Missing hashes or chunks\n");
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+
+    if (chunks.count != obj->nchunks) {
+        fprintf(stderr, "Invalid nchunks\n");
+        bpkg_obj_destroy(obj);
         return NULL;
     }
 
     return obj;
 }
 
+/**
+ * Loads the package for when a valid path is given, either .bpkg text
+ * or a compiled .bpkgc, told apart by the compiled magic
+ *///
+struct bpkg_obj* bpkg_load(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open .bpkg file!");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to open .bpkg file!");
+        close(fd);
+        return NULL;
+    }
+
+    // The text is only read, a private read-only mapping avoids copying it
+    size_t len = (size_t) st.st_size;
+    void* text = NULL;
+    if (len > 0) {
+        text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) {
+            perror("Failed to map .bpkg file!");
+            close(fd);
+            return NULL;
+        }
+        posix_madvise(text, len, POSIX_MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    struct bpkg_obj* obj;
+    if (len >= BPKGC_MAGIC_LEN && memcmp(text, BPKGC_MAGIC, BPKGC_MAGIC_LEN) == 0) {
+        obj = bpkg_parse_compiled(text, len);
+    } else {
+        obj = bpkg_parse(text ? text : "", len);
+    }
+    // A compiled package keeps its mapping, the object points into it
+    if (text && (!obj || obj->map != text)) {
+        munmap(text, len);
+    }
+    return obj;
+}
+
 /**
  * Checks to see if the referenced filename in the bpkg file
  * exists or not.
  * @param bpkg, constructed bpkg object
- * @return query_result, a single string should be
- *      printable in hashes with len sized to 1.
- * 		If the file exists, hashes[0] should contain "File Exists"
- *		If the file does not exist, hashes[0] should contain "File Created"
+ * @return query_result, with message set and no hashes.
+ * 		If the file exists, message is "File Exists"
+ *		If the file does not exist, message is "File Created"
  */
 
 struct bpkg_query bpkg_file_check(struct bpkg_obj* bpkg) {
     struct bpkg_query query_result = { 0 };
-    query_result.hashes = malloc(sizeof(char*));
-
-    if (query_result.hashes == NULL) {
-        perror("Memory allocation failed for hash string");
-        exit(EXIT_FAILURE);
-    }
 
     if (access(bpkg->filename, F_OK) == 0) {
-        query_result.hashes[0] = strdup("File Exists");
+        query_result.message = "File Exists";
     } else {
-        query_result.hashes[0] = strdup("File Created");
+        query_result.message = "File Created";
     }
 
-    if (query_result.hashes[0] == NULL) {
-        perror("Memory allocation failed for hash string");
-        exit(EXIT_FAILURE);
-    }
-
-    query_result.len = 1;
     return query_result;
 }
 
-void collect_hashes_inorder(struct merkle_tree_node* node, char*** hashes, size_t* index, size_t* current_capacity) {
-    if (node == NULL) return;
+int bpkg_arena_init(struct bpkg_arena* arena, size_t capacity) {
+    arena->base = malloc(capacity * sizeof(*arena->base));
+    arena->capacity = arena->base ? capacity : 0;
+    arena->used = 0;
+    return arena->base ? 0 : -1;
+}
 
-    collect_hashes_inorder(node->left, hashes, index, current_capacity);
+void bpkg_arena_reset(struct bpkg_arena* arena) {
+    arena->used = 0;
+}
 
-    // Ensure there is enough space to add a new hash
-    if (*index >= *current_capacity) {
-        // Increase the capacity
-        *current_capacity *= 2;
-        *hashes = realloc(*hashes, *current_capacity * sizeof(char*));
-        if (*hashes == NULL) {
-            perror("Memory reallocation failed for hashes");
-            exit(EXIT_FAILURE);
-        }
+void bpkg_arena_destroy(struct bpkg_arena* arena) {
+    free(arena->base);
+    arena->base = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+}
+
+/*
+ * Gives qry room for exactly max digests, carved from arena when one is
+ * supplied and has the space, otherwise in one malloc. Every query knows
+ * its bound from the tree before it starts, so results never regrow.
+ */
+static int query_reserve(struct bpkg_query* qry, size_t max, struct bpkg_arena* arena) {
+    qry->len = 0;
+    qry->capacity = max;
+    qry->arena = NULL;
+    qry->hashes = NULL;
+    if (max == 0) {
+        return 0;
     }
+    if (arena && arena->capacity - arena->used >= max) {
+        qry->hashes = arena->base + arena->used;
+        qry->arena = arena;
+        arena->used += max;
+        return 0;
+    }
+    qry->hashes = malloc(max * sizeof(*qry->hashes));
+    if (!qry->hashes) {
+        perror("Failed to allocate query results");
+        qry->capacity = 0;
+        return -1;
+    }
+    return 0;
+}
 
-    // Allocate memory and store the hash
-    (*hashes)[*index] = malloc((MAX_HASH_LEN + 1) * sizeof(char));
-    if ((*hashes)[*index] == NULL) {
-        perror("Memory allocation failed for a hash string");
-        exit(EXIT_FAILURE);
+// Hands the unused tail of the last carve back to its arena
+static void query_trim(struct bpkg_query* qry) {
+    struct bpkg_arena* arena = qry->arena;
+    if (arena && qry->hashes + qry->capacity == arena->base + arena->used) {
+        arena->used -= qry->capacity - qry->len;
+        qry->capacity = qry->len;
     }
-    strcpy((*hashes)[*index], node->computed_hash);
-    (*index)++;
+}
 
-    collect_hashes_inorder(node->right, hashes, index, current_capacity);
+// Appends count consecutive digests into the reserved space
+static void query_add_hashes(struct bpkg_query* qry, const uint8_t (*hashes)[SHA256_DIGEST_LENGTH], size_t count) {
+    if (qry->len + count > qry->capacity) {
+        fprintf(stderr, "Query results exceed their reserved size\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(qry->hashes + qry->len, hashes, count * sizeof(*hashes));
+    qry->len += count;
 }
 
-// void collect_min_hashes(struct merkle_tree_node* node, struct bpkg_query* qry, struct bpkg_query* complete_chunks) {
-//     if (node == NULL) {
-//         return;
-//     }
+static void query_add_hash(struct bpkg_query* qry, const uint8_t* hash) {
+    query_add_hashes(qry, (const uint8_t (*)[SHA256_DIGEST_LENGTH]) hash, 1);
+}
 
-//     if (node->is_leaf) {
-//         if (is_chunk_complete(node, *complete_chunks)) {
-//             printf("Correct leaf count: %ld\n", qry->capacity);
-//         }
-//     }
+void collect_hashes_inorder(struct merkle_tree* tree, struct bpkg_query* qry) {
+    if (tree == NULL) return;
 
-//     struct bpkg_query left_qry = {0}, right_qry = {0};
-//     collect_min_hashes(node->left, &left_qry, complete_chunks);
-//     collect_min_hashes(node->right, &right_qry, complete_chunks);
-// }
+    for (size_t p = 0; p < tree->n_nodes; p++) {
+        query_add_hash(qry, tree->hashes[merkle_inorder_node(tree, p)]);
+    }
+}
 
-void collect_min_hashes(struct merkle_tree_node* node, struct bpkg_query* qry, struct bpkg_query* complete_chunks) {
-    if (node == NULL) {
+/*
+ * Minimal cover in one left to right pass. From each complete chunk c the
+ * covering node is grown bottom-up: a level k block starting at c joins
+ * its right sibling when c is aligned to the level above and the
+ * sibling's chunks are all complete, which bitset_all checks a word at a
+ * time. The top block is emitted and the scan resumes after it, skipping
+ * incomplete chunks by whole words. A block of size s costs O(s) checks,
+ * so the cost is linear and nothing is allocated beyond qry.
+ */
+void collect_min_hashes(struct merkle_tree* tree, struct bpkg_query* qry, const uint64_t* done) {
+    if (tree == NULL) {
         return;
     }
 
-    // Initialize capacity if it's not set
-    if (qry->capacity == 0) {
-        qry->capacity = 10; // Initial capacity
-        qry->hashes = malloc(qry->capacity * sizeof(char*));
-        if (qry->hashes == NULL) {
-            perror("Initial malloc failed for hashes");
-            exit(EXIT_FAILURE);
+    size_t n = tree->n_leaves;
+    for (size_t c = bitset_next(done, 0, n); c < n; ) {
+        uint32_t k = 0;
+        while (k < tree->depth && (c & (((size_t) 2 << k) - 1)) == 0 &&
+               bitset_all(done, c + ((size_t) 1 << k), (size_t) 1 << k)) {
+            k++;
         }
+
+        // In 1-based heap numbering the leaf is n + c and its level k ancestor (n + c) >> k
+        query_add_hash(qry, tree->hashes[((n + c) >> k) - 1]);
+        c = bitset_next(done, c + ((size_t) 1 << k), n);
     }
+}
 
-    if (node->is_leaf) {
-        if (is_chunk_complete(node, *complete_chunks)) {
-            if (qry->len == qry->capacity) {
-                qry->capacity *= 2;
-                char** new_hashes = realloc(qry->hashes, qry->capacity * sizeof(char*));
-                if (!new_hashes) {
-                    perror("Failed to realloc memory for hashes in leaf");
-                    exit(EXIT_FAILURE);
-                }
-                qry->hashes = new_hashes;
-            }
-            qry->hashes[qry->len++] = strdup(node->computed_hash);
-        }
-        return;
+uint64_t* bpkg_chunk_bitset(const struct bpkg_obj* obj) {
+    uint64_t* done = calloc(bitset_words(obj->nchunks), sizeof(*done));
+    if (!done) {
+        perror("Failed to allocate chunk bitset");
     }
+    return done;
+}
 
-    struct bpkg_query left_qry = {0}, right_qry = {0};
-    collect_min_hashes(node->left, &left_qry, complete_chunks);
-    collect_min_hashes(node->right, &right_qry, complete_chunks);
+// The leaves under a node are contiguous at the end of the array
+void collect_leaf_hashes(struct merkle_tree* tree, size_t node, struct bpkg_query* qry) {
+    size_t first, count;
+    merkle_leaf_range(tree, node, &first, &count);
+    query_add_hashes(qry, tree->hashes + merkle_leaf_node(tree, first), count);
+}
 
-    if (left_qry.len == 1 && right_qry.len == 1) {
-        if (strcmp(left_qry.hashes[0], node->left->computed_hash) == 0 && strcmp(right_qry.hashes[0], node->right->computed_hash) == 0) {
-            if (qry->len == qry->capacity) {
-                qry->capacity *= 2;
-                char** new_hashes = realloc(qry->hashes, qry->capacity * sizeof(char*));
-                if (!new_hashes) {
-                    perror("Failed to realloc memory for hashes in non-leaf");
-                    exit(EXIT_FAILURE);
-                }
-                qry->hashes = new_hashes;
-            }
-            qry->hashes[qry->len++] = strdup(node->computed_hash);
-            bpkg_query_destroy(&left_qry);
-            bpkg_query_destroy(&right_qry);
-        } else {
-            merge_queries(qry, &left_qry);
-            merge_queries(qry, &right_qry);
-        }
-    } else {
-        merge_queries(qry, &left_qry);
-        merge_queries(qry, &right_qry);
-    }
+/**
+ * Retrieves a list of all hashes within the package/tree
+ * @param bpkg, constructed bpkg object
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved
+ */
+struct bpkg_query bpkg_get_all_hashes(struct bpkg_obj* bpkg) {
+    return bpkg_get_all_hashes_arena(bpkg, NULL);
 }
 
-bool is_chunk_complete(struct merkle_tree_node* node, struct bpkg_query complete_qry) {
-    for (size_t i = 0; i < complete_qry.len; i++) { 
-        if (strcmp(node->computed_hash, complete_qry.hashes[i]) == 0) {
-            return true;  
-        }
+struct bpkg_query bpkg_get_all_hashes_arena(struct bpkg_obj* bpkg, struct bpkg_arena* arena) {
+    struct bpkg_query qry = { 0 };
+
+    // Collect hashes from the Merkle tree
+    if (bpkg->merkle_tree && query_reserve(&qry, bpkg->merkle_tree->n_nodes, arena) == 0) {
+        collect_hashes_inorder(bpkg->merkle_tree, &qry);
     }
-    return false; 
+
+    return qry;
 }
 
-void merge_queries(struct bpkg_query* dest, struct bpkg_query* src) {
-    if (dest->len + src->len >= dest->capacity) {
-        while (dest->capacity <= dest->len + src->len) {
-            dest->capacity *= 2;
+
+// Below this many chunks per worker a pool costs more than it saves
+#define BPKG_VERIFY_MIN_CHUNKS_PER_THREAD 1024
+// Most bytes fetched per read, file-contiguous chunks are gathered up to this
+#define BPKG_IO_SPAN (1 << 20)
+// O_DIRECT needs offsets, lengths and buffers aligned to the logical block size
+#define BPKG_IO_ALIGN 4096
+
+// Shared by the workers of one verification, each brings its own buffer
+struct bpkg_io {
+    enum bpkg_io_mode mode;
+    int fd;
+    const uint8_t* map;
+    size_t map_len;
+};
+
+struct bpkg_verify_job {
+    const struct bpkg_obj* obj;
+    const struct bpkg_io* io;
+    size_t first;
+    size_t count;
+    uint64_t* done;
+    size_t matched;
+    // Store each digest in the chunk table instead of checking it
+    bool fill;
+};
+
+// Reads until len bytes or end of file, returns how many were read
+static size_t bpkg_pread_upto(int fd, uint8_t* buf, size_t len, uint64_t offset) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, (off_t) (offset + got));
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-        char** new_hashes = realloc(dest->hashes, dest->capacity * sizeof(char*));
-        if (!new_hashes) {
-            perror("realloc failed");
-            exit(EXIT_FAILURE);
+        if (n <= 0) {
+            break;
         }
-        dest->hashes = new_hashes;
+        got += (size_t) n;
     }
+    return got;
+}
 
-    for (size_t i = 0; i < src->len; i++) {
-        dest->hashes[dest->len++] = src->hashes[i];
-        src->hashes[i] = NULL; // Avoid double free
+/*
+ * Makes the file bytes lo .. hi available at *base, by pointing into the
+ * mapping or by one read into buffer. Direct reads widen the range to
+ * block boundaries, so *base is then an offset into buffer.
+ * @return number of bytes valid from *base, short at end of file
+ */
+static size_t bpkg_io_fetch(const struct bpkg_io* io, uint8_t* buffer, uint64_t lo, uint64_t hi, const uint8_t** base) {
+    if (io->mode == BPKG_IO_MMAP) {
+        if (lo >= io->map_len) {
+            return 0;
+        }
+        *base = io->map + lo;
+        return (hi < io->map_len ? hi : io->map_len) - lo;
+    }
+    if (io->mode == BPKG_IO_DIRECT) {
+        uint64_t start = lo & ~(uint64_t) (BPKG_IO_ALIGN - 1);
+        uint64_t stop = (hi + BPKG_IO_ALIGN - 1) & ~(uint64_t) (BPKG_IO_ALIGN - 1);
+        size_t got = bpkg_pread_upto(io->fd, buffer, stop - start, start);
+        *base = buffer + (lo - start);
+        return got > lo - start ? got - (lo - start) : 0;
     }
-    free(src->hashes);
-    src->hashes = NULL;
-    src->len = 0;
+    *base = buffer;
+    return bpkg_pread_upto(io->fd, buffer, hi - lo, lo);
 }
 
-// Recursively search in left and right subtrees until the hash is found
-struct merkle_tree_node* find_node_by_hash(struct merkle_tree_node* node, const char* hash) {
-    if (node == NULL) {
-        return NULL;  // Base case: node is NULL
+/*
+ * Walks the job's range in spans of file-contiguous chunks, fetching each
+ * span with a single read, and hashes the chunks in place a multi-buffer
+ * batch at a time. A batch needs equal lengths, so it also ends wherever
+ * the chunk size changes.
+ */
+static void* bpkg_verify_worker(void* arg) {
+    struct bpkg_verify_job* job = arg;
+    const Chunk* chunks = job->obj->chunks;
+    size_t end = job->first + job->count;
+
+    size_t buffer_len = BPKG_IO_SPAN;
+    for (size_t c = job->first; c < end; c++) {
+        if (chunks[c].size > buffer_len) {
+            buffer_len = chunks[c].size;
+        }
     }
-    if (strcmp(node->computed_hash, hash) == 0) {
-        return node;  // Hash matches
+
+    uint8_t* buffer = NULL;
+    if (job->io->mode != BPKG_IO_MMAP &&
+        posix_memalign((void**) &buffer, BPKG_IO_ALIGN, buffer_len + 2 * BPKG_IO_ALIGN) != 0) {
+        perror("Failed to allocate memory for buffer");
+        return NULL;
     }
 
-    struct merkle_tree_node* leftResult = find_node_by_hash(node->left, hash);
-    if (leftResult != NULL) return leftResult;
+    uint32_t batch = sha256_multi_lanes();
+    const uint8_t* msgs[SHA256_MULTI_MAX_LANES];
+    size_t indices[SHA256_MULTI_MAX_LANES];
+    uint8_t digests[SHA256_MULTI_MAX_LANES][SHA256_DIGEST_LENGTH];
+
+    for (size_t c = job->first; c < end; ) {
+        uint64_t lo = chunks[c].offset;
+        uint64_t hi = lo + chunks[c].size;
+        size_t span_end = c + 1;
+        while (span_end < end && chunks[span_end].offset == hi &&
+               hi + chunks[span_end].size - lo <= buffer_len) {
+            hi += chunks[span_end++].size;
+        }
+
+        const uint8_t* base;
+        size_t avail = bpkg_io_fetch(job->io, buffer, lo, hi, &base);
+
+        while (c < span_end) {
+            uint32_t size = chunks[c].size;
+            uint32_t n = 0;
+            for (; c < span_end && n < batch && chunks[c].size == size; c++) {
+                uint64_t at = chunks[c].offset - lo;
+                if (at + size > avail) {
+                    fprintf(stderr, "Failed to read full chunk\n");
+                    continue;
+                }
+                msgs[n] = base + at;
+                indices[n++] = c;
+            }
+
+            sha256_multi(msgs, n, size, digests);
+
+            for (uint32_t j = 0; j < n; j++) {
+                if (job->fill) {
+                    memcpy(job->obj->chunks[indices[j]].hash, digests[j], SHA256_DIGEST_LENGTH);
+                }
+                if (job->fill || sha256_digest_eq(digests[j], chunks[indices[j]].hash)) {
+                    bitset_set(job->done, indices[j]);
+                    job->matched++;
+                }
+            }
+        }
+    }
 
-    struct merkle_tree_node* rightResult = find_node_by_hash(node->right, hash);
-    return rightResult;
+    free(buffer);
+    return NULL;
 }
 
-void collect_leaf_hashes(struct merkle_tree_node* node, struct bpkg_query* qry, size_t* capacity) {
-    if (node == NULL) {
-        return; // Base case: node is NULL
+/*
+ * Opens filepath for mode. Direct I/O falls back to buffered reads where
+ * the platform or filesystem (tmpfs for one) refuses it.
+ * @return 0 on success, -1 if the file cannot be opened
+ */
+static int bpkg_io_open(struct bpkg_io* io, const char* filepath, enum bpkg_io_mode mode) {
+    *io = (struct bpkg_io) { .mode = mode, .fd = -1 };
+#ifdef O_DIRECT
+    if (mode == BPKG_IO_DIRECT) {
+        io->fd = open(filepath, O_RDONLY | O_DIRECT);
     }
-    if (node->left == NULL && node->right == NULL) { // It's a leaf node
-        if (qry->len >= *capacity) { // Need more space
-            *capacity *= 2; // Double the capacity
-            qry->hashes = realloc(qry->hashes, *capacity * sizeof(char*)); // Attempt to resize
-            if (qry->hashes == NULL) {
-                perror("Failed to realloc memory for hashes");
-                exit(EXIT_FAILURE);
+#endif
+    if (io->fd < 0) {
+        if (mode == BPKG_IO_DIRECT) {
+            fprintf(stderr, "Direct I/O unavailable, using buffered reads\n");
+            io->mode = BPKG_IO_READ;
+        }
+        io->fd = open(filepath, O_RDONLY);
+    }
+    if (io->fd < 0) {
+        perror("Unable to open file");
+        return -1;
+    }
+
+    if (io->mode == BPKG_IO_MMAP) {
+        struct stat st;
+        if (fstat(io->fd, &st) == 0 && st.st_size > 0) {
+            void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, io->fd, 0);
+            if (map != MAP_FAILED) {
+                io->map = map;
+                io->map_len = (size_t) st.st_size;
+                posix_madvise(map, io->map_len, POSIX_MADV_SEQUENTIAL);
+                posix_madvise(map, io->map_len, POSIX_MADV_WILLNEED);
             }
         }
-        qry->hashes[qry->len] = strdup(node->computed_hash); // Store the hash
-        qry->len++; // Increment the length
-        return;
+        // An empty or unmappable file verifies nothing, as a failed read would
+    } else if (io->mode == BPKG_IO_READ) {
+        posix_fadvise(io->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     }
-    // Recursively collect hashes from both subtrees
-    collect_leaf_hashes(node->left, qry, capacity);
-    collect_leaf_hashes(node->right, qry, capacity);
+    return 0;
 }
 
-/**
- * Retrieves a list of all hashes within the package/tree
- * @param bpkg, constructed bpkg object
- * @return query_result, This structure will contain a list of hashes
- * 		and the number of hashes that have been retrieved
- */
-struct bpkg_query bpkg_get_all_hashes(struct bpkg_obj* bpkg) {
-    struct bpkg_query qry = { 0 };
-    size_t initial_capacity = 10;
-    size_t index = 0;
+static void bpkg_io_close(struct bpkg_io* io) {
+    if (io->map) {
+        munmap((void*) io->map, io->map_len);
+    }
+    close(io->fd);
+}
 
-    // Initialize memory for hash pointers
-    qry.hashes = malloc(initial_capacity * sizeof(char*));
-    if (qry.hashes == NULL) {
-        perror("Memory allocation failed for qry.hashes");
-        exit(EXIT_FAILURE);
+static void bpkg_fingerprint_stat(const struct stat* st, struct bpkg_fingerprint* fp) {
+    fp->dev = st->st_dev;
+    fp->ino = st->st_ino;
+    fp->size = st->st_size;
+    fp->mtime_sec = st->st_mtim.tv_sec;
+    fp->mtime_nsec = st->st_mtim.tv_nsec;
+    fp->ctime_sec = st->st_ctim.tv_sec;
+    fp->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+int bpkg_fingerprint_path(const char* path, struct bpkg_fingerprint* fp) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
     }
+    bpkg_fingerprint_stat(&st, fp);
+    return 0;
+}
 
-    // Collect hashes from the Merkle tree
-    collect_hashes_inorder(bpkg->merkle_root, &qry.hashes, &index, &initial_capacity);
+int bpkg_fingerprint_fd(int fd, struct bpkg_fingerprint* fp) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    bpkg_fingerprint_stat(&st, fp);
+    return 0;
+}
 
-    // Set the actual number of hashes
-    qry.len = index;
+#define BPKG_FP_MAGIC "BPKGFP\0"
+#define BPKG_FP_VERSION 1
+#define BPKG_FP_SUFFIX ".fp"
+#define BPKG_FP_PATH_MAX 4096
+
+/*
+ * A cache entry remembers the last verification of a data file against
+ * one package: the package it was checked against, the file's fingerprint
+ * at the time and the resulting chunk bitset, which follows this header.
+ * Entries live in obj->fp_cache, named by the hash of the package ident
+ * and the data file's real path, so packages sharing a file keep apart.
+ */
+struct bpkg_fp_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nchunks;
+    uint64_t size;
+    uint8_t root[SHA256_DIGEST_LENGTH];
+    struct bpkg_fingerprint data;
+    uint64_t matched;
+};
+
+static int bpkg_fp_header_fill(const struct bpkg_obj* obj, const struct bpkg_fingerprint* data, struct bpkg_fp_header* hdr) {
+    if (!obj->merkle_tree) {
+        return -1;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, BPKG_FP_MAGIC, sizeof(hdr->magic));
+    hdr->version = BPKG_FP_VERSION;
+    hdr->nchunks = obj->nchunks;
+    hdr->size = obj->size;
+    memcpy(hdr->root, obj->merkle_tree->hashes[0], SHA256_DIGEST_LENGTH);
+    hdr->data = *data;
+    return 0;
+}
 
-    return qry;
+/*
+ * Path of the cache entry for obj and filepath, with tag appended.
+ * @return 0 on success, -1 when there is no cache or the path does not fit
+ */
+static int bpkg_fp_path(const struct bpkg_obj* obj, const char* filepath, const char* tag, char* out) {
+    if (!obj->fp_cache) {
+        return -1;
+    }
+    char* real = realpath(filepath, NULL);
+    if (!real) {
+        return -1;
+    }
+    char key[MAX_IDENT_LEN + BPKG_FP_PATH_MAX + 2];
+    int key_len = snprintf(key, sizeof(key), "%s\n%s", obj->ident, real);
+    free(real);
+    if (key_len < 0 || key_len >= (int) sizeof(key)) {
+        return -1;
+    }
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_HEXLEN + 1];
+    sha256_hash(key, (uint32_t) key_len, digest);
+    sha256_digest_to_hex(digest, hex);
+    int len = snprintf(out, BPKG_FP_PATH_MAX, "%s/%s%s%s", obj->fp_cache, hex, BPKG_FP_SUFFIX, tag);
+    return (len < 0 || len >= BPKG_FP_PATH_MAX) ? -1 : 0;
 }
 
+static int bpkg_fp_older(int64_t sec, int64_t nsec, const struct timespec* than) {
+    return sec < than->tv_sec || (sec == than->tv_sec && nsec < than->tv_nsec);
+}
 
-/**
- * Retrieves all completed chunks of a package object
- * @param bpkg, constructed bpkg object
- * @return query_result, This structure will contain a list of hashes
- * 		and the number of hashes that have been retrieved
+/*
+ * Fills done from the cache when it was written for this package and the
+ * data file still has the same fingerprint. As with racily clean entries
+ * in git, a data file touched no earlier than the cache itself could have
+ * changed within one timestamp tick, so it is not trusted.
+ * @return number of matching chunks, or -1 on a miss
  */
-struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj* obj) { 
-    struct bpkg_query qry = {0};
-    FILE* file = fopen(obj->filename, "rb");
-    if (!file) {
-        perror("Unable to open file");
-        return qry;
+static ssize_t bpkg_fp_load(const struct bpkg_obj* obj, const char* filepath, const struct bpkg_fingerprint* data, uint64_t* done) {
+    char path[BPKG_FP_PATH_MAX];
+    struct bpkg_fp_header expect, hdr;
+    if (bpkg_fp_path(obj, filepath, "", path) != 0 || bpkg_fp_header_fill(obj, data, &expect) != 0) {
+        return -1;
     }
 
-    long chunkSize = obj->size / obj->nchunks;
-    uint8_t* buffer = malloc(chunkSize);
-    if (!buffer) {
-        perror("Failed to allocate memory for buffer");
-        fclose(file);
-        return qry;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
     }
+    size_t nbytes = bitset_words(obj->nchunks) * sizeof(*done);
+    struct stat st;
+    ssize_t matched = -1;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size == sizeof(hdr) + nbytes &&
+        pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr) &&
+        memcmp(&hdr, &expect, offsetof(struct bpkg_fp_header, matched)) == 0 &&
+        bpkg_fp_older(data->mtime_sec, data->mtime_nsec, &st.st_mtim) &&
+        bpkg_fp_older(data->ctime_sec, data->ctime_nsec, &st.st_mtim) &&
+        pread(fd, done, nbytes, sizeof(hdr)) == (ssize_t) nbytes) {
+        matched = (ssize_t) hdr.matched;
+    }
+    close(fd);
+    return matched;
+}
 
-    struct sha256_compute_data cdata;
-    uint8_t hash[SHA256_DIGEST_LENGTH];
-    char hexHash[MAX_HASH_LEN + 1] = {0}; 
+// Best effort, written aside and renamed so a reader never sees half a cache
+static void bpkg_fp_store(const struct bpkg_obj* obj, const char* filepath, const struct bpkg_fingerprint* data,
+                          const uint64_t* done, size_t matched) {
+    char path[BPKG_FP_PATH_MAX];
+    char tmp[BPKG_FP_PATH_MAX];
+    char tag[32];
+    struct bpkg_fp_header hdr;
+    snprintf(tag, sizeof(tag), ".%ld", (long) getpid());
+    if (bpkg_fp_path(obj, filepath, "", path) != 0 || bpkg_fp_path(obj, filepath, tag, tmp) != 0 ||
+        bpkg_fp_header_fill(obj, data, &hdr) != 0) {
+        return;
+    }
+    hdr.matched = matched;
 
-    qry.hashes = malloc(obj->nchunks * sizeof(char*));
-    if (qry.hashes == NULL) {
-        perror("Memory allocation failed for qry.hashes");
-        free(buffer);
-        fclose(file);
-        return qry;
+    // The directory is made on first use, an existing one is fine
+    if (mkdir(obj->fp_cache, 0777) != 0 && errno != EEXIST) {
+        return;
     }
 
-    qry.len = 0;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    size_t nbytes = bitset_words(obj->nchunks) * sizeof(*done);
+    int ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr) && write(fd, done, nbytes) == (ssize_t) nbytes;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
 
-    for (int i = 0; i < obj->nchunks; i++) {
-        if (fread(buffer, 1, chunkSize, file) != chunkSize) {
-            perror("Failed to read full chunk");
-            continue;
+/*
+ * Hashes the chunks of an open data file on obj->threads workers, setting
+ * the bit of each chunk that matches, or with fill of each chunk read in
+ * full, whose digest then replaces its hash.
+ * @return number of bits set
+ */
+static size_t bpkg_hash_pool(struct bpkg_obj* obj, const struct bpkg_io* io, uint64_t* done, bool fill) {
+    size_t words = bitset_words(obj->nchunks);
+    uint32_t threads = obj->threads > 1 ? obj->threads : 1;
+    if (threads > obj->nchunks / BPKG_VERIFY_MIN_CHUNKS_PER_THREAD) {
+        threads = obj->nchunks / BPKG_VERIFY_MIN_CHUNKS_PER_THREAD;
+    }
+    if (threads > words) {
+        threads = (uint32_t) words;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    pthread_t workers[threads];
+    struct bpkg_verify_job jobs[threads];
+    int joinable[threads];
+
+    // Ranges are cut on word boundaries so no two workers set bits in the same word
+    for (uint32_t t = 0; t < threads; t++) {
+        size_t first = words * t / threads * BITSET_WORD_BITS;
+        size_t last = words * (t + 1) / threads * BITSET_WORD_BITS;
+        jobs[t] = (struct bpkg_verify_job) {
+            .obj = obj,
+            .io = io,
+            .first = first,
+            .count = (last < obj->nchunks ? last : obj->nchunks) - first,
+            .done = done,
+            .fill = fill,
+        };
+        joinable[t] = threads > 1 && pthread_create(&workers[t], NULL, bpkg_verify_worker, &jobs[t]) == 0;
+        if (!joinable[t]) {
+            bpkg_verify_worker(&jobs[t]);
         }
+    }
 
-        sha256_compute_data_init(&cdata);
-        sha256_update(&cdata, buffer, chunkSize);
-        sha256_finalize(&cdata, hash);
-        sha256_output_hex(&cdata, hexHash);
+    size_t matched = 0;
+    for (uint32_t t = 0; t < threads; t++) {
+        if (joinable[t]) {
+            pthread_join(workers[t], NULL);
+        }
+        matched += jobs[t].matched;
+    }
+    return matched;
+}
 
-        if (strcmp(hexHash, obj->chunks[i].hash) == 0) {
-            qry.hashes[qry.len] = strdup(hexHash);
-            qry.len++;
+/**
+ * Hashes every chunk of filepath and checks it against the package
+ * @param obj, constructed bpkg object
+ * @param filepath, data file to check
+ * @param done, chunk bitset, the bit of each chunk that matches is set
+ * @return number of matching chunks
+ */
+size_t bpkg_verify_chunks(struct bpkg_obj* obj, const char* filepath, uint64_t* done) {
+    size_t words = bitset_words(obj->nchunks);
+    memset(done, 0, words * sizeof(*done));
+
+    // With a cache, an unchanged data file gets its last result back without being read
+    struct bpkg_fingerprint before = {0};
+    int fingerprinted = obj->fp_cache && bpkg_fingerprint_path(filepath, &before) == 0;
+    if (fingerprinted && !obj->paranoid) {
+        ssize_t cached = bpkg_fp_load(obj, filepath, &before, done);
+        if (cached >= 0) {
+            return (size_t) cached;
         }
+        memset(done, 0, words * sizeof(*done));
     }
 
-    free(buffer);
-    fclose(file);
+    struct bpkg_io io;
+    if (bpkg_io_open(&io, filepath, obj->io) != 0) {
+        return 0;
+    }
+    size_t matched = bpkg_hash_pool(obj, &io, done, false);
 
-    // Resize array of hashes to match the number of matches found
-    if (qry.len > 0) {
-        qry.hashes = realloc(qry.hashes, qry.len * sizeof(char*));
-    } else {
-        free(qry.hashes);
-        qry.hashes = NULL;
+    // Only cached if the file was the same one, unchanged, throughout
+    struct bpkg_fingerprint after = {0};
+    if (fingerprinted && bpkg_fingerprint_fd(io.fd, &after) == 0 && memcmp(&before, &after, sizeof(after)) == 0) {
+        bpkg_fp_store(obj, filepath, &before, done, matched);
     }
 
-    return qry;
+    bpkg_io_close(&io);
+    return matched;
 }
 
-struct bpkg_query compare_files(struct bpkg_obj* obj, const char* filepath) {
-    struct bpkg_query qry = {0};
-    FILE* file = fopen(filepath, "rb");
-    if (!file) {
-        perror("Unable to open file");
-        return qry;
+/*
+ * Lays out nchunks contiguous chunks over size bytes, the first size %
+ * nchunks of them a byte longer, so equal sizes stay together for the
+ * multi-buffer hash.
+ */
+static void bpkg_make_chunks(Chunk* chunks, uint32_t nchunks, uint64_t size) {
+    uint32_t base = (uint32_t) (size / nchunks);
+    uint32_t longer = (uint32_t) (size % nchunks);
+    uint64_t offset = 0;
+    for (uint32_t c = 0; c < nchunks; c++) {
+        chunks[c].offset = offset;
+        chunks[c].size = base + (c < longer);
+        offset += chunks[c].size;
     }
+}
 
-    long chunkSize = obj->size / obj->nchunks;
-    uint8_t* buffer = malloc(chunkSize);
-    if (!buffer) {
-        perror("Failed to allocate memory for buffer");
-        fclose(file);
-        return qry;
+struct bpkg_obj* bpkg_make(const char* filepath, uint32_t chunk_size, uint32_t threads, enum bpkg_io_mode mode) {
+    struct bpkg_obj header = { 0 };
+    const char* name = strrchr(filepath, '/');
+    name = name ? name + 1 : filepath;
+    if (chunk_size == 0) {
+        fprintf(stderr, "Invalid chunk size\n");
+        return NULL;
     }
+    if (strlen(name) > MAX_FILENAME_LEN) {
+        fprintf(stderr, "Data file name is too long\n");
+        return NULL;
+    }
+    memcpy(header.filename, name, strlen(name));
 
-    struct sha256_compute_data cdata;
-    uint8_t hash[SHA256_DIGEST_LENGTH];
-    char hexHash[MAX_HASH_LEN + 1] = {0}; 
-
-    qry.hashes = malloc(obj->nchunks * sizeof(char*));
-    if (qry.hashes == NULL) {
-        perror("Memory allocation failed for qry.hashes");
-        free(buffer);
-        fclose(file);
-        return qry;
+    struct bpkg_io io;
+    struct stat st;
+    if (bpkg_io_open(&io, filepath, mode) != 0) {
+        return NULL;
+    }
+    if (fstat(io.fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Data file is empty\n");
+        bpkg_io_close(&io);
+        return NULL;
     }
 
-    qry.len = 0;
+    // The tree needs a power of two chunks, at least two, so a count between rounds up
+    uint64_t want = ((uint64_t) st.st_size + chunk_size - 1) / chunk_size;
+    uint64_t nchunks = 2;
+    while (nchunks < want) {
+        nchunks <<= 1;
+    }
+    if (nchunks > (uint64_t) st.st_size || nchunks > UINT32_MAX) {
+        fprintf(stderr, "Chunk size is too small for the data file\n");
+        bpkg_io_close(&io);
+        return NULL;
+    }
+    header.size = (uint64_t) st.st_size;
+    header.nchunks = (uint32_t) nchunks;
+    header.nhashes = header.nchunks - 1;
+    header.threads = threads;
+    header.io = io.mode;
+
+    struct bpkg_obj* obj = bpkg_obj_alloc(&header, header.nhashes, header.nchunks);
+    uint64_t* done = obj ? bpkg_chunk_bitset(obj) : NULL;
+    if (!done) {
+        free(obj);
+        bpkg_io_close(&io);
+        return NULL;
+    }
+    bpkg_make_chunks(obj->chunks, obj->nchunks, obj->size);
+    size_t hashed = bpkg_hash_pool(obj, &io, done, true);
+    free(done);
+    bpkg_io_close(&io);
+    if (hashed != obj->nchunks) {
+        fprintf(stderr, "Data file changed while it was hashed\n");
+        free(obj);
+        return NULL;
+    }
 
-    for (int i = 0; i < obj->nchunks; i++) {
-        if (fread(buffer, 1, chunkSize, file) != chunkSize) {
-            perror("Failed to read full chunk");
-            continue;
-        }
+    obj->merkle_tree = build_merkle_tree_mt(obj->chunks, obj->nchunks, threads);
+    if (!obj->merkle_tree) {
+        free(obj);
+        return NULL;
+    }
+    memcpy(obj->hashes, obj->merkle_tree->hashes, (size_t) obj->nhashes * SHA256_DIGEST_LENGTH);
+    char hex[SHA256_CHUNK_SZ];
+    sha256_digest_to_hex(obj->merkle_tree->hashes[0], hex);
+    memcpy(obj->ident, hex, SHA256_DIGEST_LENGTH * 2);
+    return obj;
+}
 
-        sha256_compute_data_init(&cdata);
-        sha256_update(&cdata, buffer, chunkSize);
-        sha256_finalize(&cdata, hash);
-        sha256_output_hex(&cdata, hexHash);
+int bpkg_save(const struct bpkg_obj* obj, const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror("Unable to create package");
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, BPKG_IO_SPAN);
+
+    char hex[SHA256_CHUNK_SZ];
+    fprintf(out, "ident:%s\nfilename:%s\nsize:%" PRIu64 "\nnhashes:%u\nhashes:\n",
+            obj->ident, obj->filename, obj->size, obj->nhashes);
+    for (uint32_t i = 0; i < obj->nhashes; i++) {
+        sha256_digest_to_hex(obj->hashes[i], hex);
+        fprintf(out, "\t%.64s\n", hex);
+    }
+    fprintf(out, "nchunks:%u\nchunks:\n", obj->nchunks);
+    for (uint32_t i = 0; i < obj->nchunks; i++) {
+        sha256_digest_to_hex(obj->chunks[i].hash, hex);
+        fprintf(out, "\t%.64s,%" PRIu64 ",%u\n", hex, obj->chunks[i].offset, obj->chunks[i].size);
+    }
 
-        if (strcmp(hexHash, obj->chunks[i].hash) == 0) {
-            qry.hashes[qry.len] = strdup(hexHash);
-            qry.len++;
-        }
+    bool ok = !ferror(out);
+    if (fclose(out) != 0 || !ok) {
+        perror("Failed to write package");
+        remove(path);
+        return -1;
     }
+    return 0;
+}
 
-    free(buffer);
-    fclose(file);
+/**
+ * Retrieves all completed chunks of a package object
+ * @param bpkg, constructed bpkg object
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved
+ */
+struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj* obj) { 
+    return compare_files_arena(obj, obj->filename, NULL);
+}
 
-    // Resize array of hashes to match the number of matches found
-    if (qry.len > 0) {
-        qry.hashes = realloc(qry.hashes, qry.len * sizeof(char*));
-    } else {
-        free(qry.hashes);
-        qry.hashes = NULL;
+struct bpkg_query bpkg_get_completed_chunks_arena(struct bpkg_obj* obj, struct bpkg_arena* arena) {
+    return compare_files_arena(obj, obj->filename, arena);
+}
+
+struct bpkg_query compare_files(struct bpkg_obj* obj, const char* filepath) {
+    return compare_files_arena(obj, filepath, NULL);
+}
+
+struct bpkg_query compare_files_arena(struct bpkg_obj* obj, const char* filepath, struct bpkg_arena* arena) {
+    struct bpkg_query qry = {0};
+    uint64_t* done = bpkg_chunk_bitset(obj);
+    if (!done) {
+        return qry;
+    }
+
+    size_t matched = bpkg_verify_chunks(obj, filepath, done);
+    if (query_reserve(&qry, matched, arena) == 0) {
+        for (size_t c = bitset_next(done, 0, obj->nchunks); c < obj->nchunks; c = bitset_next(done, c + 1, obj->nchunks)) {
+            query_add_hash(&qry, obj->chunks[c].hash);
+        }
     }
 
+    free(done);
     return qry;
 }
 
@@ -552,20 +1209,27 @@ struct bpkg_query compare_files(struct bpkg_obj* obj, const char* filepath) {
  * 		and the number of hashes that have been retrieved
  */
 struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg) {
+    return bpkg_get_min_completed_hashes_arena(bpkg, NULL);
+}
+
+struct bpkg_query bpkg_get_min_completed_hashes_arena(struct bpkg_obj* bpkg, struct bpkg_arena* arena) {
     struct bpkg_query qry = { 0 };
-    struct bpkg_query chunk_qry = bpkg_get_completed_chunks(bpkg);
-    qry.capacity = 10;
-    qry.hashes = malloc(qry.capacity * sizeof(char*));
-    if (qry.hashes == NULL) {
-        perror("Failed to allocate memory for hash array");
-        exit(EXIT_FAILURE);
+    if (!bpkg->merkle_tree) {
+        return qry;
+    }
+
+    uint64_t* done = bpkg_chunk_bitset(bpkg);
+    if (!done) {
+        return qry;
     }
-    qry.len = 0;
 
-    if (bpkg->merkle_root) {
-        collect_min_hashes(bpkg->merkle_root, &qry, &chunk_qry);
+    // A cover never has more hashes than there are complete chunks
+    size_t matched = bpkg_verify_chunks(bpkg, bpkg->filename, done);
+    if (query_reserve(&qry, matched, arena) == 0) {
+        collect_min_hashes(bpkg->merkle_tree, &qry, done);
+        query_trim(&qry);
     }
-    bpkg_query_destroy(&chunk_qry);
+    free(done);
     return qry;
 }
 
@@ -581,23 +1245,24 @@ struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg) {
  * @return query_result, This structure will contain a list of hashes
  * 		and the number of hashes that have been retrieved
  */
-struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, char* hash) {
+struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, const uint8_t* hash) {
+    return bpkg_get_all_chunk_hashes_from_hash_arena(bpkg, hash, NULL);
+}
+
+struct bpkg_query bpkg_get_all_chunk_hashes_from_hash_arena(struct bpkg_obj* bpkg, const uint8_t* hash, struct bpkg_arena* arena) {
     struct bpkg_query qry = {0};
-    size_t capacity = 10; // Starting capacity
-    qry.hashes = malloc(MAX_HASH_LEN); // Allocate initial array
-    if (qry.hashes == NULL) {
-        perror("Memory allocation failed for qry.hashes");
-        exit(EXIT_FAILURE);
-    }
-    qry.len = 0;
 
-    struct merkle_tree_node* foundNode = find_node_by_hash(bpkg->merkle_root, hash);
-    if (foundNode == NULL) {
-        printf("No node found with the given hash: %s\n", hash);
+    ssize_t foundNode = find_hash(bpkg->merkle_tree, hash);
+    if (foundNode < 0) {
+        qry.message = "No node found with the given hash";
         return qry;
     }
 
-    collect_leaf_hashes(foundNode, &qry, &capacity);
+    size_t first, count;
+    merkle_leaf_range(bpkg->merkle_tree, foundNode, &first, &count);
+    if (query_reserve(&qry, count, arena) == 0) {
+        collect_leaf_hashes(bpkg->merkle_tree, foundNode, &qry);
+    }
 
     return qry;
 }
@@ -608,13 +1273,14 @@ struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, cha
  * the relevant queries above.
  */
 void bpkg_query_destroy(struct bpkg_query* qry) {
-    if (qry->hashes != NULL) {
-        for (size_t i = 0; i < qry->len; i++) {
-            free(qry->hashes[i]);
-        }
-        free(qry->hashes); 
-        qry->hashes = NULL; 
+    // Arena results are released with their arena
+    if (!qry->arena) {
+        free(qry->hashes);
     }
+    qry->hashes = NULL; 
+    qry->arena = NULL;
+    qry->len = 0;
+    qry->capacity = 0;
 }
 
 /**
@@ -623,20 +1289,14 @@ void bpkg_query_destroy(struct bpkg_query* qry) {
  */
 // Free dynamically allocated memory before exiting the program
 void bpkg_obj_destroy(struct bpkg_obj* obj) {
-    if (obj->hashes != NULL) {
-        for (int i = 0; i < obj->nhashes; i++) {
-            free(obj->hashes[i]);
-        }
-        free(obj->hashes);
-    }
-    
-    if (obj->chunks != NULL) {
-        free(obj->chunks);
+    if (obj->merkle_tree) {
+        free_merkle_tree(obj->merkle_tree);
     }
-    if (obj->merkle_root) {
-        free_merkle_tree(obj->merkle_root);
+
+    // hashes and chunks share the object's allocation or its mapping
+    if (obj->map) {
+        munmap(obj->map, obj->map_len);
     }
-    
     free(obj);
 }
 
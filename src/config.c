@@ -13,11 +13,17 @@ int parse_config(const char *filename, Config *config) {
         return 1;
     }
 
+    // Optional keys
+    config->threads = 1;
+    config->proofs = 0;
+
     char line[256];
     while (fgets(line, sizeof(line), file)) {
         if (sscanf(line, "directory:%255s", config->directory) == 1) continue;
         if (sscanf(line, "max_peers:%d", &config->max_peers) == 1) continue;
         if (sscanf(line, "port:%hu", &config->port) == 1) continue;
+        if (sscanf(line, "threads:%d", &config->threads) == 1) continue;
+        if (sscanf(line, "proofs:%d", &config->proofs) == 1) continue;
     }
 
     DIR* dir = opendir(config->directory);
@@ -41,6 +47,16 @@ int parse_config(const char *filename, Config *config) {
         return 5;
     }
 
+    if (config->threads < 1 || config->threads > 256) {
+        fprintf(stderr, "Invalid number of threads\n");
+        return 6;
+    }
+
+    if (config->proofs != 0 && config->proofs != 1) {
+        fprintf(stderr, "Invalid proofs setting\n");
+        return 7;
+    }
+
     fclose(file);
     return 0;
 }
\ No newline at end of file
@@ -13,7 +13,7 @@
 #define TOTAL_CHUNKS 256
 
 //Constant List from: https://en.wikipedia.org/wiki/SHA-2#Pseudocode
-static const uint32_t k[SHA256K] = {
+const uint32_t sha256_k[SHA256K] = {
     0x428a2f98, 0x71374491, 
     0xb5c0fbcf, 0xe9b5dba5, 
     0x3956c25b, 0x59f111f1, 
@@ -67,8 +67,8 @@ void sha256_compute_data_init(struct sha256_compute_data* data) {
 
 //Derived from: https://en.wikipedia.org/wiki/SHA-2#Pseudocode
 //And https://github.com/LekKit/sha256/blob/master/sha256.c
-void sha256_calculate_chunk(struct sha256_compute_data *data, 
-		uint8_t chunk[SHA256_CHUNK_SZ]) {
+static void sha256_compress(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* chunk) {
 	uint32_t w[SHA256_CHUNK_SZ];
 	uint32_t tv[SHA256_INT_SZ];
 
@@ -97,7 +97,7 @@ void sha256_calculate_chunk(struct sha256_compute_data *data,
 	}
 
 	for(uint32_t i = 0; i < SHA256_INT_SZ; i++) {
-		tv[i] = data->hcomps[i];
+		tv[i] = hcomps[i];
 	}
 
 	for(uint32_t i = 0; i < SHA256_CHUNK_SZ; i++) {
@@ -108,7 +108,7 @@ void sha256_calculate_chunk(struct sha256_compute_data *data,
 		uint32_t ch = (tv[4] & tv[5]) 
 			    ^ (~tv[4] & tv[6]);
 		
-		uint32_t temp1 = tv[7] + S1 + ch + k[i] + w[i];
+		uint32_t temp1 = tv[7] + S1 + ch + sha256_k[i] + w[i];
 		
 		uint32_t S0 = rotate_r(tv[0], 2) 
 			    ^ rotate_r(tv[0], 13) 
@@ -131,8 +131,336 @@ void sha256_calculate_chunk(struct sha256_compute_data *data,
 	}
 
 	for(uint32_t i = 0; i < SHA256_INT_SZ; i++) {
-		data->hcomps[i] += tv[i];
+		hcomps[i] += tv[i];
+	}
+}
+
+void sha256_blocks_scalar(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks) {
+	while (nblocks--) {
+		sha256_compress(hcomps, blocks);
+		blocks += SHA256_CHUNK_SZ;
+	}
+}
+
+void sha256_calculate_chunk(struct sha256_compute_data *data, 
+		uint8_t chunk[SHA256_CHUNK_SZ]) {
+	sha256_compress(data->hcomps, chunk);
+}
+
+/*
+ * Backends in order of preference. The first one whose probe succeeds
+ * and which agrees with the scalar code on the known-answer vectors is
+ * used for every sha256_update/sha256_finalize call in the process.
+ */
+static const struct sha256_backend sha256_backends[] = {
+	{ "sha-ni", sha256_blocks_shani, sha256_shani_available },
+	{ "armv8-ce", sha256_blocks_armv8, sha256_armv8_available },
+	{ "scalar", sha256_blocks_scalar, NULL },
+};
+
+#define SHA256_NBACKENDS \
+	(sizeof(sha256_backends) / sizeof(sha256_backends[0]))
+
+static const struct sha256_backend* sha256_active =
+	&sha256_backends[SHA256_NBACKENDS - 1];
+
+/*
+ * Hashes a set of messages (empty, sub-block, block boundary, multi-block
+ * and an odd length) with the given backend and the scalar code and
+ * compares the digests. Returns 0 when every message matches.
+ */
+static int sha256_check_backend(const struct sha256_backend* backend) {
+	static const uint32_t lengths[] = { 0, 3, 55, 56, 64, 119, 128, 1000 };
+	uint8_t msg[1000];
+
+	for (uint32_t i = 0; i < sizeof(msg); i++) {
+		msg[i] = (uint8_t) (i * 167 + 13);
 	}
+
+	for (uint32_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		uint32_t want[SHA256_INT_SZ] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+		};
+		uint32_t got[SHA256_INT_SZ];
+		uint8_t tail[2 * SHA256_CHUNK_SZ] = { 0 };
+		uint32_t full = lengths[i] / SHA256_CHUNK_SZ;
+		uint32_t rest = lengths[i] % SHA256_CHUNK_SZ;
+		uint32_t ntail = (rest < 56) ? 1 : 2;
+		uint64_t bits = (uint64_t) lengths[i] * 8;
+
+		memcpy(tail, msg + full * SHA256_CHUNK_SZ, rest);
+		tail[rest] = 0x80;
+		for (int32_t b = 0; b < 8; b++) {
+			tail[ntail * SHA256_CHUNK_SZ - 1 - b] = (bits >> (8 * b)) & 255;
+		}
+
+		memcpy(got, want, sizeof(got));
+		sha256_blocks_scalar(want, msg, full);
+		sha256_blocks_scalar(want, tail, ntail);
+		backend->blocks(got, msg, full);
+		backend->blocks(got, tail, ntail);
+
+		if (memcmp(want, got, sizeof(got)) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void sha256_multi_lanes_hash(const struct sha256_multi_backend* backend,
+		const uint8_t* const* msgs, uint32_t len,
+		uint8_t (*digests)[SHA256_DIGEST_LENGTH]);
+
+static void sha256_multiblocks_single(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks) {
+	sha256_active->blocks(hcomps[0], lanes[0], nblocks);
+}
+
+/*
+ * Whether sixteen vector lanes beat one SHA-NI/ARMv8 stream depends on the
+ * core, so to keep the choice deterministic the vector backends are only
+ * used when the single stream backend is the scalar code.
+ */
+static const struct sha256_multi_backend sha256_multi_backends[] = {
+	{ "avx512", SHA256_AVX512_LANES, sha256_multiblocks_avx512,
+		sha256_avx512_available },
+	{ "avx2", SHA256_AVX2_LANES, sha256_multiblocks_avx2,
+		sha256_avx2_available },
+	{ "single", 1, sha256_multiblocks_single, NULL },
+};
+
+#define SHA256_NMULTI \
+	(sizeof(sha256_multi_backends) / sizeof(sha256_multi_backends[0]))
+
+static const struct sha256_multi_backend* sha256_multi_active =
+	&sha256_multi_backends[SHA256_NMULTI - 1];
+
+//Same messages as sha256_check_backend, one per lane at staggered offsets
+static int sha256_check_multi_backend(
+		const struct sha256_multi_backend* backend) {
+	static const uint32_t lengths[] = { 0, 3, 55, 56, 64, 119, 128, 1000 };
+	uint8_t msg[1000 + SHA256_MULTI_MAX_LANES];
+	const uint8_t* msgs[SHA256_MULTI_MAX_LANES];
+	uint8_t got[SHA256_MULTI_MAX_LANES][SHA256_DIGEST_LENGTH];
+
+	for (uint32_t i = 0; i < sizeof(msg); i++) {
+		msg[i] = (uint8_t) (i * 167 + 13);
+	}
+	for (uint32_t l = 0; l < backend->lanes; l++) {
+		msgs[l] = msg + l;
+	}
+
+	for (uint32_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		sha256_multi_lanes_hash(backend, msgs, lengths[i], got);
+
+		for (uint32_t l = 0; l < backend->lanes; l++) {
+			struct sha256_compute_data data;
+			uint8_t want[SHA256_DIGEST_LENGTH];
+
+			sha256_compute_data_init(&data);
+			sha256_update(&data, (void*) msgs[l], lengths[i]);
+			sha256_finalize(&data, want);
+			sha256_output(&data, want);
+
+			if (memcmp(want, got[l], SHA256_DIGEST_LENGTH) != 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void sha256_merkle_init(void);
+static void bin_to_hex(const void* data, uint32_t len, char* out);
+
+__attribute__((constructor))
+static void sha256_select_backend(void) {
+	sha256_merkle_init();
+
+	for (size_t i = 0; i < SHA256_NBACKENDS; i++) {
+		const struct sha256_backend* backend = &sha256_backends[i];
+		if (backend->available && !backend->available()) {
+			continue;
+		}
+		if (sha256_check_backend(backend) == 0) {
+			sha256_active = backend;
+			break;
+		}
+	}
+
+	if (sha256_active->blocks != sha256_blocks_scalar) {
+		return;
+	}
+
+	for (size_t i = 0; i < SHA256_NMULTI; i++) {
+		const struct sha256_multi_backend* backend = &sha256_multi_backends[i];
+		if (backend->available && !backend->available()) {
+			continue;
+		}
+		if (sha256_check_multi_backend(backend) == 0) {
+			sha256_multi_active = backend;
+			break;
+		}
+	}
+}
+
+const char* sha256_backend_name(void) {
+	return sha256_active->name;
+}
+
+/*
+ * Checks the fixed-length interior node kernel against hashing the hex
+ * text of both children with the generic streaming code.
+ */
+static int sha256_check_merkle_parent(FILE* out) {
+	uint8_t left[SHA256_DIGEST_LENGTH], right[SHA256_DIGEST_LENGTH];
+	uint8_t want[SHA256_DIGEST_LENGTH], got[SHA256_DIGEST_LENGTH];
+	char text[4 * SHA256_DIGEST_LENGTH];
+	int failed = 0;
+
+	for (uint32_t round = 0; round < 8 && !failed; round++) {
+		for (uint32_t i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+			left[i] = (uint8_t) (round * 31 + i * 7);
+			right[i] = (uint8_t) (round * 17 + i * 13 + 5);
+		}
+		bin_to_hex(left, SHA256_DIGEST_LENGTH, text);
+		bin_to_hex(right, SHA256_DIGEST_LENGTH, text + 2 * SHA256_DIGEST_LENGTH);
+		sha256_hash(text, sizeof(text), want);
+		sha256_merkle_parent(left, right, got);
+		failed = memcmp(want, got, SHA256_DIGEST_LENGTH) != 0;
+	}
+
+	if (out) {
+		fprintf(out, "merkle-parent: %s\n", failed ? "FAILED" : "ok");
+	}
+	return failed;
+}
+
+int sha256_self_test(FILE* out) {
+	int failed = 0;
+
+	for (size_t i = 0; i < SHA256_NBACKENDS; i++) {
+		const struct sha256_backend* backend = &sha256_backends[i];
+		const char* status;
+
+		if (backend->available && !backend->available()) {
+			status = "unavailable";
+		} else if (sha256_check_backend(backend) == 0) {
+			status = "ok";
+		} else {
+			status = "FAILED";
+			failed = 1;
+		}
+
+		if (out) {
+			fprintf(out, "%s: %s%s\n", backend->name, status,
+					backend == sha256_active ? " (active)" : "");
+		}
+	}
+
+	failed |= sha256_check_merkle_parent(out);
+
+	for (size_t i = 0; i < SHA256_NMULTI; i++) {
+		const struct sha256_multi_backend* backend = &sha256_multi_backends[i];
+		const char* status;
+
+		if (backend->available && !backend->available()) {
+			status = "unavailable";
+		} else if (sha256_check_multi_backend(backend) == 0) {
+			status = "ok";
+		} else {
+			status = "FAILED";
+			failed = 1;
+		}
+
+		if (out) {
+			fprintf(out, "multi-%s (%u lanes): %s%s\n", backend->name,
+					backend->lanes, status,
+					backend == sha256_multi_active ? " (active)" : "");
+		}
+	}
+	return failed;
+}
+
+/*
+ * Runs one full pass of the given backend: msgs holds exactly
+ * backend->lanes messages of len bytes. The whole blocks are read in place,
+ * only the padded tail blocks are built in a scratch buffer.
+ */
+static void sha256_multi_lanes_hash(const struct sha256_multi_backend* backend,
+		const uint8_t* const* msgs, uint32_t len,
+		uint8_t (*digests)[SHA256_DIGEST_LENGTH]) {
+	uint32_t hcomps[SHA256_MULTI_MAX_LANES][SHA256_INT_SZ];
+	uint8_t tails[SHA256_MULTI_MAX_LANES][2 * SHA256_CHUNK_SZ];
+	const uint8_t* tail_ptrs[SHA256_MULTI_MAX_LANES];
+	uint32_t full = len / SHA256_CHUNK_SZ;
+	uint32_t rest = len % SHA256_CHUNK_SZ;
+	uint32_t ntail = (rest < 56) ? 1 : 2;
+	uint64_t bits = (uint64_t) len * 8;
+
+	for (uint32_t l = 0; l < backend->lanes; l++) {
+		struct sha256_compute_data data;
+		sha256_compute_data_init(&data);
+		memcpy(hcomps[l], data.hcomps, sizeof(hcomps[l]));
+
+		memset(tails[l], 0, ntail * SHA256_CHUNK_SZ);
+		memcpy(tails[l], msgs[l] + (size_t) full * SHA256_CHUNK_SZ, rest);
+		tails[l][rest] = 0x80;
+		for (int32_t b = 0; b < 8; b++) {
+			tails[l][ntail * SHA256_CHUNK_SZ - 1 - b] = (bits >> (8 * b)) & 255;
+		}
+		tail_ptrs[l] = tails[l];
+	}
+
+	if (full) {
+		backend->blocks(hcomps, msgs, full);
+	}
+	backend->blocks(hcomps, tail_ptrs, ntail);
+
+	for (uint32_t l = 0; l < backend->lanes; l++) {
+		for (uint32_t i = 0; i < SHA256_INT_SZ; i++) {
+			digests[l][i*4] = (hcomps[l][i] >> 24) & 255;
+			digests[l][i*4 + 1] = (hcomps[l][i] >> 16) & 255;
+			digests[l][i*4 + 2] = (hcomps[l][i] >> 8) & 255;
+			digests[l][i*4 + 3] = hcomps[l][i] & 255;
+		}
+	}
+}
+
+uint32_t sha256_multi_lanes(void) {
+	return sha256_multi_active->lanes;
+}
+
+void sha256_multi(const uint8_t* const* msgs, size_t n, uint32_t len,
+		uint8_t (*digests)[SHA256_DIGEST_LENGTH]) {
+	const struct sha256_multi_backend* backend = sha256_multi_active;
+	uint32_t lanes = backend->lanes;
+
+	while (n >= lanes) {
+		sha256_multi_lanes_hash(backend, msgs, len, digests);
+		msgs += lanes;
+		digests += lanes;
+		n -= lanes;
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	/*
+	 * A partially filled pass costs as much as a full one, so the idle
+	 * lanes repeat the last message and their digests are dropped.
+	 */
+	const uint8_t* padded[SHA256_MULTI_MAX_LANES];
+	uint8_t scratch[SHA256_MULTI_MAX_LANES][SHA256_DIGEST_LENGTH];
+
+	for (uint32_t l = 0; l < lanes; l++) {
+		padded[l] = msgs[l < n ? l : n - 1];
+	}
+	sha256_multi_lanes_hash(backend, padded, len, scratch);
+	memcpy(digests, scratch, n * SHA256_DIGEST_LENGTH);
 }
 
 //Derived from: https://en.wikipedia.org/wiki/SHA-2#Pseudocode
@@ -154,13 +482,13 @@ void sha256_update(struct sha256_compute_data *data,
 		ptr += (64 - data->chunk_size);
 		size -= (64 - data->chunk_size);
 		data->chunk_size = 0;
-		sha256_calculate_chunk(data, tmp_chunk);
+		sha256_active->blocks(data->hcomps, tmp_chunk, 1);
 	}
 
-	while (size >= 64) {
-		sha256_calculate_chunk(data, ptr);
-		ptr += 64;
-		size -= 64; 
+	if (size >= 64) {
+		sha256_active->blocks(data->hcomps, ptr, size / 64);
+		ptr += size & ~63u;
+		size &= 63;
 	}
 
 	memcpy(data->last_chunk + data->chunk_size, ptr, size);
@@ -183,7 +511,7 @@ void sha256_finalize(struct sha256_compute_data *data,
 			64 - data->chunk_size);
 
 	if (data->chunk_size > 56) {
-		sha256_calculate_chunk(data, data->last_chunk);
+		sha256_active->blocks(data->hcomps, data->last_chunk, 1);
 		memset(data->last_chunk, 0, 64);
 	}
 
@@ -195,7 +523,7 @@ void sha256_finalize(struct sha256_compute_data *data,
 		size >>= 8;
 	}
 
-	sha256_calculate_chunk(data, data->last_chunk);
+	sha256_active->blocks(data->hcomps, data->last_chunk, 1);
 }
 
 //Original: https://github.com/LekKit/sha256/blob/master/sha256.c
@@ -229,12 +557,174 @@ void sha256_output_hex(struct sha256_compute_data* data,
 	bin_to_hex(hash, 32, hexbuf);
 }
 
-// Function to convert a hexadecimal string to its binary representation
-void hex_to_bin(const char* hex_string, uint8_t* bin_data) {
-    int len = strlen(hex_string);
-    for (int i = 0; i < len / 2; i++) {
-        sscanf(hex_string + 2 * i, "%2hhx", &bin_data[i]);
-    }
+void sha256_digest_to_hex(const uint8_t digest[SHA256_DIGEST_LENGTH],
+		char hexbuf[SHA256_CHUNK_SZ]) {
+	bin_to_hex(digest, SHA256_DIGEST_LENGTH, hexbuf);
+}
+
+/*
+ * Merkle interior nodes hash the 128 hex characters of their two children.
+ * That message is always exactly two blocks, so the third (padding) block
+ * is the same for every node: 0x80, zeros, then a bit length of 1024.
+ * Its round inputs k[i] + w[i] are computed once at startup.
+ */
+static uint8_t sha256_pad128_block[SHA256_CHUNK_SZ];
+static uint32_t sha256_pad128_kw[SHA256K];
+
+#define SHA256_S0(x) (rotate_r(x, 2) ^ rotate_r(x, 13) ^ rotate_r(x, 22))
+#define SHA256_S1(x) (rotate_r(x, 6) ^ rotate_r(x, 11) ^ rotate_r(x, 25))
+#define SHA256_G0(x) (rotate_r(x, 7) ^ rotate_r(x, 18) ^ (x >> 3))
+#define SHA256_G1(x) (rotate_r(x, 17) ^ rotate_r(x, 19) ^ (x >> 10))
+
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i) do { \
+		uint32_t t1 = h + SHA256_S1(e) + (g ^ (e & (f ^ g))) + kw[i]; \
+		uint32_t t2 = SHA256_S0(a) + ((a & b) | (c & (a | b))); \
+		d += t1; \
+		h = t1 + t2; \
+	} while (0)
+
+#define SHA256_ROUNDS8(i) \
+	SHA256_ROUND(a, b, c, d, e, f, g, h, i + 0); \
+	SHA256_ROUND(h, a, b, c, d, e, f, g, i + 1); \
+	SHA256_ROUND(g, h, a, b, c, d, e, f, i + 2); \
+	SHA256_ROUND(f, g, h, a, b, c, d, e, i + 3); \
+	SHA256_ROUND(e, f, g, h, a, b, c, d, i + 4); \
+	SHA256_ROUND(d, e, f, g, h, a, b, c, i + 5); \
+	SHA256_ROUND(c, d, e, f, g, h, a, b, i + 6); \
+	SHA256_ROUND(b, c, d, e, f, g, h, a, i + 7)
+
+//Fully unrolled compression over precomputed k[i] + w[i]
+static void sha256_compress_kw(uint32_t hcomps[SHA256_INT_SZ],
+		const uint32_t kw[SHA256K]) {
+	uint32_t a = hcomps[0], b = hcomps[1], c = hcomps[2], d = hcomps[3];
+	uint32_t e = hcomps[4], f = hcomps[5], g = hcomps[6], h = hcomps[7];
+
+	SHA256_ROUNDS8(0);
+	SHA256_ROUNDS8(8);
+	SHA256_ROUNDS8(16);
+	SHA256_ROUNDS8(24);
+	SHA256_ROUNDS8(32);
+	SHA256_ROUNDS8(40);
+	SHA256_ROUNDS8(48);
+	SHA256_ROUNDS8(56);
+
+	hcomps[0] += a;
+	hcomps[1] += b;
+	hcomps[2] += c;
+	hcomps[3] += d;
+	hcomps[4] += e;
+	hcomps[5] += f;
+	hcomps[6] += g;
+	hcomps[7] += h;
+}
+
+static void sha256_schedule_kw(uint32_t w[SHA256K], uint32_t kw[SHA256K]) {
+	for (uint32_t i = 16; i < SHA256K; i++) {
+		w[i] = w[i-16] + SHA256_G0(w[i-15]) + w[i-7] + SHA256_G1(w[i-2]);
+	}
+	for (uint32_t i = 0; i < SHA256K; i++) {
+		kw[i] = sha256_k[i] + w[i];
+	}
+}
+
+//Two lowercase hex characters of a byte, high nibble first
+static inline uint32_t hex_pair(uint8_t c) {
+	uint32_t hi = c >> 4, lo = c & 15;
+	hi += (hi < 10) ? '0' : 'a' - 10;
+	lo += (lo < 10) ? '0' : 'a' - 10;
+	return hi << 8 | lo;
+}
+
+static void sha256_hex_block_kw(const uint8_t digest[SHA256_DIGEST_LENGTH],
+		uint32_t kw[SHA256K]) {
+	uint32_t w[SHA256K];
+	for (uint32_t i = 0; i < 16; i++) {
+		w[i] = hex_pair(digest[i*2]) << 16 | hex_pair(digest[i*2 + 1]);
+	}
+	sha256_schedule_kw(w, kw);
+}
+
+static void sha256_merkle_init(void) {
+	uint32_t w[SHA256K] = { 0 };
+
+	sha256_pad128_block[0] = 0x80;
+	sha256_pad128_block[SHA256_CHUNK_SZ - 2] = (1024 >> 8) & 255;
+	sha256_pad128_block[SHA256_CHUNK_SZ - 1] = 1024 & 255;
+
+	w[0] = 0x80000000;
+	w[15] = 1024;
+	sha256_schedule_kw(w, sha256_pad128_kw);
+}
+
+void sha256_merkle_parent(const uint8_t left[SHA256_DIGEST_LENGTH],
+		const uint8_t right[SHA256_DIGEST_LENGTH],
+		uint8_t parent[SHA256_DIGEST_LENGTH]) {
+	uint32_t hcomps[SHA256_INT_SZ] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	if (sha256_active->blocks == sha256_blocks_scalar) {
+		uint32_t kw[SHA256K];
+		sha256_hex_block_kw(left, kw);
+		sha256_compress_kw(hcomps, kw);
+		sha256_hex_block_kw(right, kw);
+		sha256_compress_kw(hcomps, kw);
+		sha256_compress_kw(hcomps, sha256_pad128_kw);
+	} else {
+		//Hardware rounds beat the unrolled code, only skip the padding work
+		uint8_t blocks[2 * SHA256_CHUNK_SZ];
+		bin_to_hex(left, SHA256_DIGEST_LENGTH, (char*) blocks);
+		bin_to_hex(right, SHA256_DIGEST_LENGTH, (char*) blocks + SHA256_CHUNK_SZ);
+		sha256_active->blocks(hcomps, blocks, 2);
+		sha256_active->blocks(hcomps, sha256_pad128_block, 1);
+	}
+
+	for (uint32_t i = 0; i < SHA256_INT_SZ; i++) {
+		parent[i*4] = (hcomps[i] >> 24) & 255;
+		parent[i*4 + 1] = (hcomps[i] >> 16) & 255;
+		parent[i*4 + 2] = (hcomps[i] >> 8) & 255;
+		parent[i*4 + 3] = hcomps[i] & 255;
+	}
+}
+
+/*
+ * Nibble value + 1 of each hex digit, 0 for every other byte. Hex digits
+ * are close to random, so a table avoids a mispredicted branch per
+ * character. The remaining check only fails on bad input, which stops
+ * the scan at the first non-digit, e.g. a string's terminator.
+ */
+static const uint8_t hex_nibble_table[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+int sha256_hex_to_digest(const char* hex,
+		uint8_t digest[SHA256_DIGEST_LENGTH]) {
+	const uint8_t* in = (const uint8_t*) hex;
+	for (uint32_t i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		uint8_t hi = hex_nibble_table[in[i*2]];
+		if (hi == 0) {
+			return -1;
+		}
+		uint8_t lo = hex_nibble_table[in[i*2 + 1]];
+		if (lo == 0) {
+			return -1;
+		}
+		digest[i] = (uint8_t) ((hi - 1) << 4 | (lo - 1));
+	}
+	return 0;
+}
+
+void sha256_hash(const void* bytes, uint32_t size,
+		uint8_t digest[SHA256_DIGEST_LENGTH]) {
+	struct sha256_compute_data data;
+	sha256_compute_data_init(&data);
+	sha256_update(&data, (void*) bytes, size);
+	sha256_finalize(&data, digest);
+	sha256_output(&data, digest);
 }
 
 void compute_hash(void *concat_string, char *output) {
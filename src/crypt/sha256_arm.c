@@ -0,0 +1,64 @@
+#include <crypt/sha256.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define ARMV8_TARGET __attribute__((target("arch=armv8-a+crypto")))
+
+int sha256_armv8_available(void) {
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+//Derived from: ARMv8-A Cryptographic Extension reference
+//and https://github.com/noloader/SHA-Intrinsics/blob/master/sha256-arm.c
+ARMV8_TARGET
+void sha256_blocks_armv8(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks) {
+	uint32x4_t state0 = vld1q_u32(&hcomps[0]);
+	uint32x4_t state1 = vld1q_u32(&hcomps[4]);
+
+	while (nblocks--) {
+		uint32x4_t abcd = state0;
+		uint32x4_t efgh = state1;
+		uint32x4_t w[16];
+
+		for (int i = 0; i < 4; i++) {
+			w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 16 * i)));
+		}
+
+		for (int i = 4; i < 16; i++) {
+			w[i] = vsha256su1q_u32(vsha256su0q_u32(w[i - 4], w[i - 3]),
+					w[i - 2], w[i - 1]);
+		}
+
+		for (int i = 0; i < 16; i++) {
+			uint32x4_t wk = vaddq_u32(w[i], vld1q_u32(&sha256_k[4 * i]));
+			uint32x4_t prev = state0;
+			state0 = vsha256hq_u32(state0, state1, wk);
+			state1 = vsha256h2q_u32(state1, prev, wk);
+		}
+
+		state0 = vaddq_u32(state0, abcd);
+		state1 = vaddq_u32(state1, efgh);
+		blocks += SHA256_CHUNK_SZ;
+	}
+
+	vst1q_u32(&hcomps[0], state0);
+	vst1q_u32(&hcomps[4], state1);
+}
+
+#else
+
+int sha256_armv8_available(void) {
+	return 0;
+}
+
+void sha256_blocks_armv8(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks) {
+	sha256_blocks_scalar(hcomps, blocks, nblocks);
+}
+
+#endif
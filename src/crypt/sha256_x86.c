@@ -0,0 +1,305 @@
+#include <crypt/sha256.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+int sha256_shani_available(void) {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	//SSSE3 (ecx bit 9) and SSE4.1 (ecx bit 19)
+	if (!(ecx & (1u << 9)) || !(ecx & (1u << 19))) {
+		return 0;
+	}
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	//SHA extensions (ebx bit 29)
+	return (ebx & (1u << 29)) != 0;
+}
+
+//Derived from: Intel SHA Extensions white paper (Gulley et al., 2013)
+//and https://github.com/noloader/SHA-Intrinsics/blob/master/sha256-x86.c
+SHANI_TARGET
+void sha256_blocks_shani(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks) {
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+			0x0405060700010203ULL);
+	__m128i state0, state1, tmp;
+
+	//Rearrange ABCD/EFGH into the ABEF/CDGH layout sha256rnds2 expects
+	tmp = _mm_loadu_si128((const __m128i*) &hcomps[0]);
+	state1 = _mm_loadu_si128((const __m128i*) &hcomps[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (nblocks--) {
+		__m128i abef = state0;
+		__m128i cdgh = state1;
+		__m128i w[16];
+
+		for (int i = 0; i < 4; i++) {
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i*) (blocks + 16 * i)), bswap);
+		}
+
+		for (int i = 4; i < 16; i++) {
+			tmp = _mm_sha256msg1_epu32(w[i - 4], w[i - 3]);
+			tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[i - 1], w[i - 2], 4));
+			w[i] = _mm_sha256msg2_epu32(tmp, w[i - 1]);
+		}
+
+		for (int i = 0; i < 16; i++) {
+			tmp = _mm_add_epi32(w[i],
+					_mm_loadu_si128((const __m128i*) &sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+			tmp = _mm_shuffle_epi32(tmp, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		blocks += SHA256_CHUNK_SZ;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i*) &hcomps[0], state0);
+	_mm_storeu_si128((__m128i*) &hcomps[4], state1);
+}
+
+#else
+
+int sha256_shani_available(void) {
+	return 0;
+}
+
+void sha256_blocks_shani(uint32_t hcomps[SHA256_INT_SZ],
+		const uint8_t* blocks, size_t nblocks) {
+	sha256_blocks_scalar(hcomps, blocks, nblocks);
+}
+
+#endif
+
+/*
+ * The multi-buffer kernels want the 16 vector registers of x86-64, 32-bit
+ * builds keep SHA-NI above and fall back to scalar lanes here.
+ */
+#if defined(__x86_64__)
+
+int sha256_avx2_available(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+int sha256_avx512_available(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+/*
+ * Multi-buffer kernels: every 32 bit lane of a vector register carries the
+ * state of a different message, so one pass over the 64 rounds advances
+ * 8 (AVX2) or 16 (AVX-512) independent messages by one block.
+ */
+static inline uint32_t load_be32(const uint8_t* p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+		| (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+#define ROR256(x, n) \
+	_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define XOR256(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+#define ADD256(a, b) _mm256_add_epi32(a, b)
+
+__attribute__((target("avx2")))
+void sha256_multiblocks_avx2(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks) {
+	uint32_t tmp[SHA256_AVX2_LANES];
+	__m256i s[SHA256_INT_SZ];
+
+	for (int j = 0; j < SHA256_INT_SZ; j++) {
+		for (int l = 0; l < SHA256_AVX2_LANES; l++) {
+			tmp[l] = hcomps[l][j];
+		}
+		s[j] = _mm256_loadu_si256((const __m256i*) tmp);
+	}
+
+	for (size_t blk = 0; blk < nblocks; blk++) {
+		size_t base = blk * SHA256_CHUNK_SZ;
+		__m256i w[16];
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3];
+		__m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+		for (int t = 0; t < 16; t++) {
+			for (int l = 0; l < SHA256_AVX2_LANES; l++) {
+				tmp[l] = load_be32(lanes[l] + base + 4 * t);
+			}
+			w[t] = _mm256_loadu_si256((const __m256i*) tmp);
+		}
+
+		for (int t = 0; t < 64; t++) {
+			if (t >= 16) {
+				__m256i w15 = w[(t - 15) & 15];
+				__m256i w2 = w[(t - 2) & 15];
+				__m256i s0 = XOR256(ROR256(w15, 7), ROR256(w15, 18),
+						_mm256_srli_epi32(w15, 3));
+				__m256i s1 = XOR256(ROR256(w2, 17), ROR256(w2, 19),
+						_mm256_srli_epi32(w2, 10));
+				w[t & 15] = ADD256(ADD256(w[t & 15], s0),
+						ADD256(w[(t - 7) & 15], s1));
+			}
+
+			__m256i S1 = XOR256(ROR256(e, 6), ROR256(e, 11), ROR256(e, 25));
+			__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+					_mm256_andnot_si256(e, g));
+			__m256i temp1 = ADD256(ADD256(h, S1), ADD256(ch,
+					ADD256(_mm256_set1_epi32(sha256_k[t]), w[t & 15])));
+			__m256i S0 = XOR256(ROR256(a, 2), ROR256(a, 13), ROR256(a, 22));
+			__m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+					_mm256_and_si256(c, _mm256_or_si256(a, b)));
+			__m256i temp2 = ADD256(S0, maj);
+
+			h = g;
+			g = f;
+			f = e;
+			e = ADD256(d, temp1);
+			d = c;
+			c = b;
+			b = a;
+			a = ADD256(temp1, temp2);
+		}
+
+		s[0] = ADD256(s[0], a);
+		s[1] = ADD256(s[1], b);
+		s[2] = ADD256(s[2], c);
+		s[3] = ADD256(s[3], d);
+		s[4] = ADD256(s[4], e);
+		s[5] = ADD256(s[5], f);
+		s[6] = ADD256(s[6], g);
+		s[7] = ADD256(s[7], h);
+	}
+
+	for (int j = 0; j < SHA256_INT_SZ; j++) {
+		_mm256_storeu_si256((__m256i*) tmp, s[j]);
+		for (int l = 0; l < SHA256_AVX2_LANES; l++) {
+			hcomps[l][j] = tmp[l];
+		}
+	}
+}
+
+#define ROR512(x, n) _mm512_ror_epi32(x, n)
+#define XOR512(a, b, c) _mm512_ternarylogic_epi32(a, b, c, 0x96)
+#define ADD512(a, b) _mm512_add_epi32(a, b)
+
+__attribute__((target("avx512f")))
+void sha256_multiblocks_avx512(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks) {
+	uint32_t tmp[SHA256_AVX512_LANES];
+	__m512i s[SHA256_INT_SZ];
+
+	for (int j = 0; j < SHA256_INT_SZ; j++) {
+		for (int l = 0; l < SHA256_AVX512_LANES; l++) {
+			tmp[l] = hcomps[l][j];
+		}
+		s[j] = _mm512_loadu_si512(tmp);
+	}
+
+	for (size_t blk = 0; blk < nblocks; blk++) {
+		size_t base = blk * SHA256_CHUNK_SZ;
+		__m512i w[16];
+		__m512i a = s[0], b = s[1], c = s[2], d = s[3];
+		__m512i e = s[4], f = s[5], g = s[6], h = s[7];
+
+		for (int t = 0; t < 16; t++) {
+			for (int l = 0; l < SHA256_AVX512_LANES; l++) {
+				tmp[l] = load_be32(lanes[l] + base + 4 * t);
+			}
+			w[t] = _mm512_loadu_si512(tmp);
+		}
+
+		for (int t = 0; t < 64; t++) {
+			if (t >= 16) {
+				__m512i w15 = w[(t - 15) & 15];
+				__m512i w2 = w[(t - 2) & 15];
+				__m512i s0 = XOR512(ROR512(w15, 7), ROR512(w15, 18),
+						_mm512_srli_epi32(w15, 3));
+				__m512i s1 = XOR512(ROR512(w2, 17), ROR512(w2, 19),
+						_mm512_srli_epi32(w2, 10));
+				w[t & 15] = ADD512(ADD512(w[t & 15], s0),
+						ADD512(w[(t - 7) & 15], s1));
+			}
+
+			__m512i S1 = XOR512(ROR512(e, 6), ROR512(e, 11), ROR512(e, 25));
+			//ch(e, f, g) and maj(a, b, c) as single ternary-logic ops
+			__m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+			__m512i temp1 = ADD512(ADD512(h, S1), ADD512(ch,
+					ADD512(_mm512_set1_epi32(sha256_k[t]), w[t & 15])));
+			__m512i S0 = XOR512(ROR512(a, 2), ROR512(a, 13), ROR512(a, 22));
+			__m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xE8);
+			__m512i temp2 = ADD512(S0, maj);
+
+			h = g;
+			g = f;
+			f = e;
+			e = ADD512(d, temp1);
+			d = c;
+			c = b;
+			b = a;
+			a = ADD512(temp1, temp2);
+		}
+
+		s[0] = ADD512(s[0], a);
+		s[1] = ADD512(s[1], b);
+		s[2] = ADD512(s[2], c);
+		s[3] = ADD512(s[3], d);
+		s[4] = ADD512(s[4], e);
+		s[5] = ADD512(s[5], f);
+		s[6] = ADD512(s[6], g);
+		s[7] = ADD512(s[7], h);
+	}
+
+	for (int j = 0; j < SHA256_INT_SZ; j++) {
+		_mm512_storeu_si512(tmp, s[j]);
+		for (int l = 0; l < SHA256_AVX512_LANES; l++) {
+			hcomps[l][j] = tmp[l];
+		}
+	}
+}
+
+#else
+
+int sha256_avx2_available(void) {
+	return 0;
+}
+
+int sha256_avx512_available(void) {
+	return 0;
+}
+
+void sha256_multiblocks_avx2(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks) {
+	for (int l = 0; l < SHA256_AVX2_LANES; l++) {
+		sha256_blocks_scalar(hcomps[l], lanes[l], nblocks);
+	}
+}
+
+void sha256_multiblocks_avx512(uint32_t (*hcomps)[SHA256_INT_SZ],
+		const uint8_t* const* lanes, size_t nblocks) {
+	for (int l = 0; l < SHA256_AVX512_LANES; l++) {
+		sha256_blocks_scalar(hcomps[l], lanes[l], nblocks);
+	}
+}
+
+#endif
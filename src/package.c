@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <errno.h>
 
 void serialize_packet(const btide_packet *packet, uint8_t *buffer) {
     memcpy(buffer, &packet->msg_code, sizeof(packet->msg_code));
@@ -24,25 +25,85 @@ void send_packet(int sockfd, const btide_packet* packet) {
     send(sockfd, buffer, PAYLOAD_MAX, 0);
 }
 
-// void receive_packet(int sockfd, btide_packet* packet) {
-//     uint8_t buffer[PAYLOAD_MAX + 4];
-//     recv(sockfd, buffer, PAYLOAD_MAX + 4, 0);
-//     deserialize_packet(buffer, packet);
-// }
-
-void receive_packet(int sockfd, btide_packet* packet) {
+// Reads exactly one packet, a frame may arrive over several segments
+int receive_packet(int sockfd, btide_packet* packet) {
     uint8_t buffer[PAYLOAD_MAX];
-    int bytes_received = recv(sockfd, buffer, PAYLOAD_MAX, 0);
-    if (bytes_received <= 0) {
+    size_t received = 0;
+    while (received < PAYLOAD_MAX) {
+        ssize_t bytes_received = recv(sockfd, buffer + received, PAYLOAD_MAX - received, 0);
+        if (bytes_received <= 0) {
+            if (bytes_received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_received == 0) {
+                printf("Peer has closed the connection\n");
+            } else {
+                perror("Receive failed");
+            }
+            return -1;
+        }
+        received += bytes_received;
+    }
+
+    deserialize_packet(buffer, packet);
+    return 0;
+}
+
+void packet_reader_init(packet_reader* reader) {
+    reader->start = 0;
+    reader->end = 0;
+}
+
+ssize_t packet_reader_fill(packet_reader* reader, int sockfd) {
+    if (reader->start == reader->end) {
+        reader->start = 0;
+        reader->end = 0;
+    } else if (reader->end == sizeof(reader->data) && reader->start > 0) {
+        // Move what is left to the front, start keeps packets aligned
+        memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == sizeof(reader->data)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t bytes_received = recv(sockfd, reader->data + reader->end, sizeof(reader->data) - reader->end, 0);
+    if (bytes_received > 0) {
+        reader->end += bytes_received;
+    }
+    return bytes_received;
+}
+
+const btide_packet* packet_reader_next(packet_reader* reader) {
+    if (!packet_reader_ready(reader)) {
+        return NULL;
+    }
+    const btide_packet* packet = (const btide_packet*) (reader->data + reader->start);
+    reader->start += PAYLOAD_MAX;
+    return packet;
+}
+
+bool packet_reader_ready(const packet_reader* reader) {
+    return reader->end - reader->start >= PAYLOAD_MAX;
+}
+
+const btide_packet* packet_reader_receive(packet_reader* reader, int sockfd) {
+    const btide_packet* packet;
+    while ((packet = packet_reader_next(reader)) == NULL) {
+        ssize_t bytes_received = packet_reader_fill(reader, sockfd);
+        if (bytes_received > 0 || (bytes_received < 0 && errno == EINTR)) {
+            continue;
+        }
         if (bytes_received == 0) {
             printf("Peer has closed the connection\n");
         } else {
             perror("Receive failed");
         }
-        return;
+        return NULL;
     }
-
-    deserialize_packet(buffer, packet);
+    return packet;
 }
 
 void send_ack(int socket_fd) {
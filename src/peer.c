@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,11 +8,32 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <chk/pkgchk.h>
+#include <tree/tracker.h>
+#include <tree/merkletree.h>
 #include <signal.h>
 #include <peer.h>
 #include <package.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+// Connections handled per epoll_wait
+#define SERVER_MAX_EVENTS 64
+// Packets a connection queues before it sends them
+#define SERVER_OUT_PACKETS 8
+
+/*
+ * Where the parts of a RES frame sit: the header with the packet's u32
+ * offset, the data, then the length, hash and identifier.
+ */
+#define RES_HEAD_LEN 8
+#define RES_LEN_POS (4 + 4 + MAX_RES_DATA)
+#define RES_HASH_POS (RES_LEN_POS + 2)
+#define RES_IDENT_POS (RES_HASH_POS + 64)
 
 void add_peer_to_list(peer_node **head, const char *ip, int port, int sock_fd) {
     peer_node *new_node = (peer_node *)malloc(sizeof(peer_node));
@@ -20,6 +42,14 @@ void add_peer_to_list(peer_node **head, const char *ip, int port, int sock_fd) {
         return;
     }
 
+    new_node->reader = malloc(sizeof(*new_node->reader));
+    if (new_node->reader == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(new_node);
+        return;
+    }
+    packet_reader_init(new_node->reader);
+
     new_node->ip = strdup(ip);
     new_node->port = port;
     new_node->socket_fd = sock_fd;
@@ -57,6 +87,7 @@ void free_peer_list(peer_node **head) {
     while (current != NULL) {
         peer_node *next = current->next;
         free(current->ip);
+        free(current->reader);
         free(current);
         current = next;
     }
@@ -74,7 +105,7 @@ peer_node* find_peer(peer_node *head, const char *ip, int port) {
     return NULL;  // No match found
 }
 
-void add_package_to_list(package_node **head, const char *path, const char *bpkg, int complete, const char *ident) {
+void add_package_to_list(package_node **head, const char *path, const char *bpkg, int complete, const char *ident, struct merkle_tracker *tracker) {
     package_node *new_node = (package_node *)malloc(sizeof(package_node));
     if (new_node == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
@@ -84,6 +115,7 @@ void add_package_to_list(package_node **head, const char *path, const char *bpkg
     new_node->package_path = strdup(path);
     new_node->bpkg_path = strdup(bpkg);
     new_node->complete = complete;
+    new_node->tracker = tracker;
     new_node->ident = strdup(ident);
     new_node->next = *head;
 
@@ -124,6 +156,7 @@ int remove_package_from_list(package_node **head, const char *ident) {
             free(current->package_path);
             free(current->bpkg_path);
             free(current->ident);
+            merkle_tracker_destroy(current->tracker);
             free(current);
             return 1; 
         }
@@ -159,6 +192,7 @@ void free_package_list(package_node **head) {
         free(current->package_path);
         free(current->bpkg_path);
         free(current->ident);
+        merkle_tracker_destroy(current->tracker);
         free(current);
         current = next;
     }
@@ -179,26 +213,470 @@ package_node* find_package(package_node *head, const char *identifier) {
 }
 
 
+// Fills in the sibling path of the requested chunk, or an error PRF if it is not a chunk of the package
+static void build_proof(const package_node* package, const char* hash, btide_packet* prf_packet) {
+    const struct merkle_tree* tree = package->tracker->obj->merkle_tree;
+    memset(prf_packet, 0, sizeof(*prf_packet));
+    prf_packet->msg_code = PKT_MSG_PRF;
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    ssize_t node = -1;
+    if (sha256_hex_to_digest(hash, digest) == 0) {
+        node = find_hash(tree, digest);
+    }
+
+    struct merkle_proof proof;
+    if (node < 0 || !merkle_is_leaf(tree, node) ||
+        merkle_proof_build(tree, node - (tree->n_leaves - 1), &proof) != 0) {
+        prf_packet->error = 1;
+    } else {
+        memcpy(prf_packet->pl.data, &proof.chunk, sizeof(proof.chunk));
+        memcpy(prf_packet->pl.data + 4, &proof.len, sizeof(proof.len));
+        memcpy(prf_packet->pl.data + PRF_LEAF_OFFSET, proof.leaf, SHA256_DIGEST_LENGTH);
+        memcpy(prf_packet->pl.data + PRF_SIBLINGS_OFFSET, proof.siblings, proof.len * SHA256_DIGEST_LENGTH);
+    }
+}
+
 void sigint_handler(int signum) {
     printf("\nReceived SIGINT (Ctrl + C). Quitting...\n");
     exit(signum); // Exit the program with the signal number
 }
 
-int init_server(int port, int max_peers, package_node **package_list, pthread_mutex_t *mutex) {
-    int server_fd, new_socket, client_socket[max_peers], max_sd, sd;
-    int activity, i, valread;
+/*
+ * State of one server side connection. Sockets are non-blocking and
+ * registered edge triggered, so every handler runs until the kernel says
+ * EAGAIN. Each wakeup handles every packet buffered by the reader, and
+ * queued output goes out in as few sends as it fits. Requests are served
+ * one at a time: the packet after a REQ waits until its RES stream is
+ * sent, and nothing is read while the queue is full, which keeps a peer
+ * that stops reading from growing our buffers.
+ *
+ * RES data is not copied through user space. The frame is kept as a
+ * template whose data area stays zero. The tail of one RES and the header
+ * of the next go out together in a sendmsg with MSG_MORE, and the data
+ * between them is sent from the file with sendfile.
+ */
+struct peer_conn {
+    int fd;
     struct sockaddr_in address;
-    char buffer[BUFFER_SIZE]; 
+    packet_reader reader;
+    uint8_t out[SERVER_OUT_PACKETS * PAYLOAD_MAX];
+    size_t out_len;
+    size_t out_sent;
+    // The RES stream in progress, file_fd is -1 when idle
+    int file_fd;
+    uint64_t offset;
+    uint64_t remaining;
+    char hash[64];
+    char identifier[1024];
+    uint8_t res_frame[PAYLOAD_MAX];
+    // Unsent parts of res_frame, PAYLOAD_MAX and RES_HEAD_LEN when sent
+    size_t tail_pos;
+    size_t head_pos;
+    bool in_data;
+    uint16_t data_len;
+    uint16_t data_sent;
+    // Set once sendfile turns out not to support the data file
+    bool copy_data;
+};
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static size_t conn_room(const struct peer_conn* conn) {
+    return sizeof(conn->out) - conn->out_len;
+}
+
+static void conn_queue(struct peer_conn* conn, const btide_packet* packet) {
+    serialize_packet(packet, conn->out + conn->out_len);
+    conn->out_len += PAYLOAD_MAX;
+}
+
+static void conn_queue_error(struct peer_conn* conn) {
+    btide_packet res_packet;
+    memset(&res_packet, 0, sizeof(res_packet));
+    res_packet.msg_code = PKT_MSG_RES;
+    res_packet.error = 1;
+    conn_queue(conn, &res_packet);
+}
+
+static void conn_end_transfer(struct peer_conn* conn) {
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    conn->remaining = 0;
+}
+
+// Sends the tail of the last RES and the header of the next, 1 if the socket is full
+static int conn_send_gap(struct peer_conn* conn) {
+    while (conn->tail_pos < PAYLOAD_MAX || conn->head_pos < RES_HEAD_LEN) {
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if (conn->tail_pos < PAYLOAD_MAX) {
+            iov[msg.msg_iovlen].iov_base = conn->res_frame + conn->tail_pos;
+            iov[msg.msg_iovlen++].iov_len = PAYLOAD_MAX - conn->tail_pos;
+        }
+        if (conn->head_pos < RES_HEAD_LEN) {
+            iov[msg.msg_iovlen].iov_base = conn->res_frame + conn->head_pos;
+            iov[msg.msg_iovlen++].iov_len = RES_HEAD_LEN - conn->head_pos;
+        }
+
+        // Hold a bare header back until its data follows
+        int flags = MSG_NOSIGNAL | (conn->head_pos < RES_HEAD_LEN ? MSG_MORE : 0);
+        ssize_t sent = sendmsg(conn->fd, &msg, flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            perror("send failed");
+            return -1;
+        }
+
+        size_t tail_sent = PAYLOAD_MAX - conn->tail_pos;
+        if ((size_t) sent < tail_sent) {
+            tail_sent = sent;
+        }
+        conn->tail_pos += tail_sent;
+        conn->head_pos += sent - tail_sent;
+    }
+    return 0;
+}
 
-    fd_set readfds;
+// Sends the data of the current RES, through user space only if sendfile cannot
+static int conn_send_data(struct peer_conn* conn) {
+    while (conn->data_sent < conn->data_len) {
+        off_t pos = (off_t) (conn->offset + conn->data_sent);
+        size_t want = conn->data_len - conn->data_sent;
+        ssize_t sent;
+        if (!conn->copy_data) {
+            sent = sendfile(conn->fd, conn->file_fd, &pos, want);
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                conn->copy_data = true;
+                continue;
+            }
+        } else {
+            char buffer[MAX_RES_DATA];
+            ssize_t bytes_read = pread(conn->file_fd, buffer, want, pos);
+            if (bytes_read < 0) {
+                printf("Error reading file\n");
+                return -1;
+            }
+            sent = bytes_read == 0 ? 0 : send(conn->fd, buffer, bytes_read, MSG_NOSIGNAL | MSG_MORE);
+        }
+
+        if (sent == 0) {
+            // The file shrank after the request was checked, the frame cannot be finished
+            printf("End of file reached before reading all the data\n");
+            return -1;
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            perror("send failed");
+            return -1;
+        }
+        conn->data_sent += sent;
+    }
+    return 0;
+}
+
+/*
+ * Streams the RES packets of the transfer in progress until it is done,
+ * 1 if the socket filled up first and -1 if the connection failed.
+ */
+static int conn_stream(struct peer_conn* conn) {
+    while (1) {
+        if (!conn->in_data) {
+            int ret = conn_send_gap(conn);
+            if (ret != 0) {
+                return ret;
+            }
+            if (conn->remaining == 0) {
+                conn_end_transfer(conn);
+                return 0;
+            }
+            // The tail of the last RES is out, its length field is free
+            conn->data_len = (conn->remaining > MAX_RES_DATA) ? MAX_RES_DATA : conn->remaining;
+            conn->data_sent = 0;
+            memcpy(conn->res_frame + RES_LEN_POS, &conn->data_len, sizeof(uint16_t));
+            conn->in_data = true;
+        }
+
+        int ret = conn_send_data(conn);
+        if (ret != 0) {
+            return ret;
+        }
+        conn->in_data = false;
+        conn->tail_pos = RES_HEAD_LEN + conn->data_len;
+        conn->offset += conn->data_len;
+        conn->remaining -= conn->data_len;
+        if (conn->remaining > 0) {
+            // The low half only, the requester restores the rest
+            uint32_t file_chunk_offset = (uint32_t) conn->offset;
+            memcpy(conn->res_frame + 4, &file_chunk_offset, sizeof(uint32_t));
+            conn->head_pos = 0;
+        }
+    }
+}
+
+// Looks up the requested range and queues its PRF, the RES packets follow from conn_stream
+static void conn_start_request(struct peer_conn* conn, const btide_packet* received_packet,
+                               package_node** package_list, pthread_mutex_t* mutex) {
+    uint32_t low_offset;
+    uint32_t low_data_len;
+    uint64_t requested_offset;
+    uint64_t requested_data_len;
+
+    memcpy(&low_offset, received_packet->pl.data, sizeof(low_offset));
+    memcpy(&low_data_len, received_packet->pl.data + 4, sizeof(low_data_len));
+    memcpy(conn->hash, received_packet->pl.data + 8, sizeof(conn->hash));
+    memcpy(conn->identifier, received_packet->pl.data + 72, sizeof(conn->identifier));
+    // Terminated for find_package, an identifier is shorter than the field
+    conn->identifier[sizeof(conn->identifier) - 1] = '\0';
+    requested_offset = low_offset;
+    requested_data_len = low_data_len;
+    if (received_packet->pl.data[REQ_VERSION_OFFSET] >= 2) {
+        uint64_t wide_offset;
+        uint64_t wide_data_len;
+        memcpy(&wide_offset, received_packet->pl.data + REQ_OFFSET64_OFFSET, sizeof(wide_offset));
+        memcpy(&wide_data_len, received_packet->pl.data + REQ_LEN64_OFFSET, sizeof(wide_data_len));
+        // Stray bytes from an older peer are taken for version 1
+        if ((uint32_t) wide_offset == low_offset && (uint32_t) wide_data_len == low_data_len) {
+            requested_offset = wide_offset;
+            requested_data_len = wide_data_len;
+        }
+    }
+
+    // The list is only needed to open the file, the descriptor outlives a REMPACKAGE
+    pthread_mutex_lock(mutex);
+    package_node* package = find_package(*package_list, conn->identifier);
+    if (!package) {
+        pthread_mutex_unlock(mutex);
+        conn_queue_error(conn);
+        return;
+    }
+
+    if (received_packet->pl.data[REQ_FLAGS_OFFSET] & REQ_FLAG_PROOF) {
+        btide_packet prf_packet;
+        build_proof(package, conn->hash, &prf_packet);
+        conn_queue(conn, &prf_packet);
+    }
 
-    //initialise all client_socket[] to 0 so not checked
-    for (i = 0; i < max_peers; i++) {
-        client_socket[i] = 0;
+    // The package was validated once at ADDPACKAGE, its state lives in the tracker
+    conn->file_fd = open(package->package_path, O_RDONLY);
+    pthread_mutex_unlock(mutex);
+    if (conn->file_fd < 0) {
+        conn_queue_error(conn);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(conn->file_fd, &st) < 0 || (uint64_t) st.st_size < requested_offset ||
+        (uint64_t) st.st_size - requested_offset < requested_data_len) {
+        printf("End of file reached before reading all the data\n");
+        conn_end_transfer(conn);
+        conn_queue_error(conn);
+        return;
+    }
+    if (requested_data_len == 0) {
+        conn_end_transfer(conn);
+        return;
     }
 
+    conn->offset = requested_offset;
+    conn->remaining = requested_data_len;
+    memset(conn->res_frame, 0, sizeof(conn->res_frame));
+    uint16_t msg_code = PKT_MSG_RES;
+    uint32_t file_chunk_offset = (uint32_t) requested_offset;
+    memcpy(conn->res_frame, &msg_code, sizeof(msg_code));
+    memcpy(conn->res_frame + 4, &file_chunk_offset, sizeof(file_chunk_offset));
+    memcpy(conn->res_frame + RES_HASH_POS, conn->hash, sizeof(conn->hash));
+    memcpy(conn->res_frame + RES_IDENT_POS, conn->identifier, sizeof(conn->identifier));
+    conn->tail_pos = PAYLOAD_MAX;
+    conn->head_pos = 0;
+    conn->in_data = false;
+}
+
+// Sends queued output until it is gone or the socket is full, -1 if the connection failed
+static int conn_flush(struct peer_conn* conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("send failed");
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    return 0;
+}
+
+static void conn_close(int epoll_fd, struct peer_conn* conn, int* n_conns) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn_end_transfer(conn);
+    free(conn);
+    (*n_conns)--;
+}
+
+// Handles one received packet, -1 when the peer asked to disconnect
+static int conn_handle(struct peer_conn* conn, const btide_packet* received_packet,
+                       package_node** package_list, pthread_mutex_t* mutex) {
+    if (received_packet->msg_code == PKT_MSG_DSN) {
+        printf("Received DSN from %s, port %d. Closing connection.\n", inet_ntoa(conn->address.sin_addr), ntohs(conn->address.sin_port));
+        return -1;
+    }
+
+    if (received_packet->msg_code == PKT_MSG_ACP) {
+        btide_packet ack_packet;
+        memset(&ack_packet, 0, sizeof(ack_packet));
+        ack_packet.msg_code = PKT_MSG_ACK;
+        conn_queue(conn, &ack_packet);
+    }
+
+    if (received_packet->msg_code == PKT_MSG_REQ) {
+        conn_start_request(conn, received_packet, package_list, mutex);
+    }
+    return 0;
+}
+
+/*
+ * Moves a connection along until it blocks: handle the buffered packets,
+ * flush the queue, stream the transfer in progress, and once all of that
+ * is done receive more. Returns -1 when the connection is finished.
+ */
+static int conn_service(struct peer_conn* conn, package_node** package_list, pthread_mutex_t* mutex) {
+    while (1) {
+        // A request may queue a PRF and an error RES
+        while (conn->file_fd < 0 && conn_room(conn) >= 2 * PAYLOAD_MAX) {
+            const btide_packet* received_packet = packet_reader_next(&conn->reader);
+            if (!received_packet) {
+                break;
+            }
+            if (conn_handle(conn, received_packet, package_list, mutex) < 0) {
+                return -1;
+            }
+        }
+
+        if (conn_flush(conn) < 0) {
+            return -1;
+        }
+        if (conn->out_len > 0) {
+            return 0;  // Wait for EPOLLOUT
+        }
+        if (conn->file_fd >= 0) {
+            int ret = conn_stream(conn);
+            if (ret < 0) {
+                return -1;
+            }
+            if (ret > 0) {
+                return 0;  // Wait for EPOLLOUT
+            }
+            continue;
+        }
+        if (packet_reader_ready(&conn->reader)) {
+            continue;
+        }
+
+        ssize_t valread = packet_reader_fill(&conn->reader, conn->fd);
+        if (valread == 0) {
+            // Clean closure from client
+            printf("Host disconnected, ip %s, port %d\n", inet_ntoa(conn->address.sin_addr), ntohs(conn->address.sin_port));
+            return -1;
+        }
+        if (valread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;  // Wait for EPOLLIN
+            }
+            perror("recv failed");
+            return -1;
+        }
+    }
+}
+
+// Accepts every pending connection, each one starts with an ACP
+static void accept_peers(int server_fd, int epoll_fd, int max_peers, int* n_conns) {
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        int new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
+        if (new_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        struct peer_conn* conn = NULL;
+        if (*n_conns >= max_peers || set_nonblocking(new_socket) < 0 ||
+            (conn = malloc(sizeof(*conn))) == NULL) {
+            close(new_socket);
+            continue;
+        }
+        conn->fd = new_socket;
+        conn->address = address;
+        packet_reader_init(&conn->reader);
+        conn->out_len = 0;
+        conn->out_sent = 0;
+        conn->file_fd = -1;
+        conn->remaining = 0;
+        conn->copy_data = false;
+
+        btide_packet acp_packet;
+        memset(&acp_packet, 0, sizeof(acp_packet));
+        acp_packet.msg_code = PKT_MSG_ACP;
+        conn_queue(conn, &acp_packet);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &ev) < 0) {
+            perror("epoll_ctl");
+            close(new_socket);
+            free(conn);
+            continue;
+        }
+        (*n_conns)++;
+        // Registering reports the socket writable, the ACP goes out from that event
+    }
+}
+
+int init_server(int port, int max_peers, package_node **package_list, pthread_mutex_t *mutex) {
+    int server_fd, epoll_fd;
+    int n_conns = 0;
+    struct sockaddr_in address;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
     // Create a master socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
@@ -226,210 +704,46 @@ int init_server(int port, int max_peers, package_node **package_list, pthread_mu
         exit(EXIT_FAILURE);
     }
 
-    // Try to specify maximum of 3 pending connections for the master socket
-    if (listen(server_fd, 3) < 0) {
+    // Up to max_peers may arrive at once, let the kernel queue them
+    if (listen(server_fd, SOMAXCONN) < 0 || set_nonblocking(server_fd) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
-    // Accept the incoming connection
-    socklen_t addrlen = sizeof(address);
-    while (1) {
-        FD_ZERO(&readfds);
-
-        FD_SET(server_fd, &readfds);
-        max_sd = server_fd;
-
-        for (i = 0; i < max_peers; i++) {
-            sd = client_socket[i];
-
-            if (sd > 0)
-                FD_SET(sd, &readfds);
-
-            if (sd > max_sd)
-                max_sd = sd;
-        }
-
-        activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
-
-        if ((activity < 0) && (errno != EINTR)) {
-            printf("select error");
-        }
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
 
-        if (FD_ISSET(server_fd, &readfds)) {
-            if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) >= 0) {
-                // Send ACP to newly connected client
-                btide_packet acp_packet;
-                acp_packet.msg_code = PKT_MSG_ACP;
-                acp_packet.error = 0;
-                memset(acp_packet.pl.data, 0, DATA_MAX);
-                send_packet(new_socket, &acp_packet);
+    // The master socket is the only one registered without a connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
 
-                // Add new socket to array of sockets
-                for (i = 0; i < max_peers; i++) {
-                    if (client_socket[i] == 0) {
-                        client_socket[i] = new_socket;
-                        break;
-                    }
-                }
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
             }
+            continue;
+        }
 
-            // Add new socket to array of sockets
-            for (i = 0; i < max_peers; i++) {
-                // If position is empty
-                if (client_socket[i] == 0) {
-                    client_socket[i] = new_socket;
-                    break;
-                }
+        for (int i = 0; i < ready; i++) {
+            struct peer_conn* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_peers(server_fd, epoll_fd, max_peers, &n_conns);
+                continue;
             }
-        }
 
-        for (i = 0; i < max_peers; i++) {
-            sd = client_socket[i];
-            if (FD_ISSET(sd, &readfds)) { 
-                if ((valread = recv(sd, buffer, BUFFER_SIZE - 1, 0)) == 0) {
-                    // Clean closure from client
-                    getpeername(sd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
-                    printf("Host disconnected, ip %s, port %d\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                    close(sd);
-                    client_socket[i] = 0;
-                } else if (valread > 0) {
-                    buffer[valread] = '\0';
-                    btide_packet* received_packet = (btide_packet*)buffer;
-
-                    if (received_packet->msg_code == PKT_MSG_DSN) {
-                        // Handle DSN packet
-                        printf("Received DSN from %s, port %d. Closing connection.\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                        close(sd);
-                        client_socket[i] = 0;
-                        continue;  // Skip further processing since connection is closed
-                    }
-                    
-                    if (received_packet->msg_code == PKT_MSG_ACP) {
-                        send_ack(sd);
-                    }
-
-                    if (received_packet->msg_code == PKT_MSG_REQ) {
-                        pthread_mutex_lock(mutex);  // Lock the mutex before accessing package_list
-
-                        char requested_identifier[1024] = {0}; // Initializes all to zero
-                        char requested_hash[64] = {0}; // Initializes all to zero
-                        uint32_t requested_offset;
-                        uint32_t requested_data_len;
-                        
-                        memcpy(&requested_offset, received_packet->pl.data, sizeof(requested_offset));
-                        memcpy(&requested_data_len, received_packet->pl.data + 4, sizeof(requested_data_len));
-                        memcpy(requested_hash, received_packet->pl.data + 8, 64);
-                        memcpy(requested_identifier, received_packet->pl.data + 72, 1024);
-
-                        package_node* package = find_package(*package_list, requested_identifier);
-
-                        if (!package) {
-                            btide_packet res_packet;
-                            res_packet.msg_code = PKT_MSG_RES;
-                            res_packet.error = 1;
-                            send_packet(sd, &res_packet);
-                            return 0;
-                        }
-
-                        struct bpkg_obj* obj = bpkg_load(package->bpkg_path);
-                        if (!obj) {
-                            btide_packet res_packet;
-                            res_packet.msg_code = PKT_MSG_RES;
-                            res_packet.error = 1;
-                            send_packet(sd, &res_packet);
-                            return 0;
-                        }
-
-                        const char* filename = package->package_path;
-
-                        bpkg_obj_destroy(obj);
-
-                        FILE *file = fopen(filename, "rb");
-                        if (!file) {
-                            btide_packet res_packet;
-                            res_packet.msg_code = PKT_MSG_RES;
-                            res_packet.error = 1;
-                            send_packet(sd, &res_packet);
-                            return 0;
-                        }
-
-                        // Seek to the start offset within the file
-                        if (fseek(file, requested_offset, SEEK_SET) != 0) {
-                            perror("Failed to seek in file");
-                            fclose(file);
-                            return EXIT_FAILURE;
-                        }
-
-                        // Allocate buffer to hold the data temporarily
-                        char *buffer = malloc(MAX_RES_DATA);
-                        if (!buffer) {
-                            printf("Failed to allocate memory for the buffer\n");
-                            fclose(file);
-                            pthread_mutex_unlock(mutex);
-                            return EXIT_FAILURE;
-                        }
-
-                        // Calculate number of packets needed
-                        int num_packets = (requested_data_len + MAX_RES_DATA - 1) / MAX_RES_DATA;
-                        int remaining_data = requested_data_len;
-                        uint32_t offset_increment = 0;
-
-                        uint32_t file_chunk_offset;
-
-                        for (int j = 0; j < num_packets; j++) {
-                            uint16_t current_packet_size = (remaining_data > MAX_RES_DATA) ? MAX_RES_DATA : remaining_data;
-
-                            // Seek to the current offset within the file
-                            if (fseek(file, requested_offset + offset_increment, SEEK_SET) != 0) {
-                                perror("Failed to seek in file");
-                                free(buffer);
-                                fclose(file);
-                                pthread_mutex_unlock(mutex);
-                                return EXIT_FAILURE;
-                            }
-
-                            // Read the current chunk of data from the file
-                            size_t bytes_read = fread(buffer, 1, current_packet_size, file);
-                            if (bytes_read < current_packet_size) {
-                                if (feof(file)) {
-                                    printf("End of file reached before reading all the data\n");
-                                }
-                                if (ferror(file)) {
-                                    printf("Error reading file\n");
-                                }
-                                free(buffer);
-                                fclose(file);
-                                pthread_mutex_unlock(mutex);
-                                return EXIT_FAILURE;
-                            }
-
-                            file_chunk_offset = offset_increment + requested_offset;
-                            // Prepare and send the response packet
-                            btide_packet res_packet;
-                            res_packet.msg_code = PKT_MSG_RES;
-                            res_packet.error = 0;  // Assuming no error
-                            memcpy(res_packet.pl.data, &file_chunk_offset, sizeof(uint32_t));
-                            memcpy(res_packet.pl.data + 4, buffer, MAX_RES_DATA);
-                            memcpy(res_packet.pl.data + 4 + MAX_RES_DATA, &current_packet_size, sizeof(uint16_t));
-                            memcpy(res_packet.pl.data + 6 + MAX_RES_DATA, requested_hash, sizeof(requested_hash));
-                            memcpy(res_packet.pl.data + 70 + MAX_RES_DATA, requested_identifier, sizeof(requested_identifier));
-
-                            send_packet(sd, &res_packet);
-
-                            remaining_data -= current_packet_size;
-                            offset_increment += current_packet_size;
-                        }
-
-                        free(buffer);
-                        fclose(file);
-                        pthread_mutex_unlock(mutex);
-                    }
-                } else {
-                    perror("recv failed");
-                    close(sd);
-                    client_socket[i] = 0;
-                }
+            // A reset peer shows up as EPOLLERR, a closed one is seen by recv
+            if ((events[i].events & EPOLLERR) ||
+                conn_service(conn, package_list, mutex) < 0) {
+                conn_close(epoll_fd, conn, &n_conns);
             }
         }
     }
@@ -462,7 +776,10 @@ int connect_to_peer(const char* ip, int port) {
 
     // Wait for ACP
     btide_packet acp_packet;
-    receive_packet(sockfd, &acp_packet);
+    if (receive_packet(sockfd, &acp_packet) < 0) {
+        close(sockfd);
+        return -1;
+    }
     if (acp_packet.msg_code != PKT_MSG_ACP) {
         printf("Expected ACP but received: %d\n", acp_packet.msg_code);
         close(sockfd);
@@ -494,6 +811,7 @@ int disconnect_from_peer(peer_node **head, const char *ip, int port) {
                 prev->next = current->next;
             }
             free(current->ip);
+            free(current->reader);
             free(current);
             return 0;  // Success
         }
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <chk/pkgchk.h>
 #include <crypt/sha256.h>
 #include <tree/merkletree.h>
@@ -5,91 +7,654 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 //SUBMISSION 18!!!
 #define SHA256_HEX_LEN (64)
 
+/*
+ * Takes "-j N" out of the argument list so the positional
+ * arguments keep their places, returns N or 1 if not given.
+ */
+int jobs_select(int* argc, char** argv) {
+	int jobs = 1;
+	for(int i = 1; i < *argc; i++) {
+		if(strcmp(argv[i], "-j") != 0) {
+			continue;
+		}
+		if(i + 1 >= *argc || (jobs = atoi(argv[i + 1])) < 1) {
+			puts("-j requires a thread count of at least 1");
+			exit(1);
+		}
+		for(int j = i; j + 2 <= *argc; j++) {
+			argv[j] = argv[j + 2];
+		}
+		*argc -= 2;
+		i--;
+	}
+	return jobs;
+}
+
+// Indexed by enum bpkg_io_mode
+static const char* io_names[] = { "read", "mmap", "direct" };
+
+/*
+ * Takes "-io read|mmap|direct" out of the argument list like -j,
+ * returns 1 and sets mode if it was given, 0 otherwise.
+ */
+int io_select(int* argc, char** argv, enum bpkg_io_mode* mode) {
+	int given = 0;
+	for(int i = 1; i < *argc; i++) {
+		if(strcmp(argv[i], "-io") != 0) {
+			continue;
+		}
+		int m = 0;
+		while(i + 1 < *argc && m < 3 && strcmp(argv[i + 1], io_names[m]) != 0) {
+			m++;
+		}
+		if(i + 1 >= *argc || m == 3) {
+			puts("-io requires one of read, mmap or direct");
+			exit(1);
+		}
+		*mode = (enum bpkg_io_mode) m;
+		given = 1;
+		for(int j = i; j + 2 <= *argc; j++) {
+			argv[j] = argv[j + 2];
+		}
+		*argc -= 2;
+		i--;
+	}
+	return given;
+}
+
+/*
+ * Takes "--paranoid" out of the argument list like -j, returns 1 if
+ * it was given so verification ignores the fingerprint cache.
+ */
+int paranoid_select(int* argc, char** argv) {
+	int given = 0;
+	for(int i = 1; i < *argc; i++) {
+		if(strcmp(argv[i], "--paranoid") != 0) {
+			continue;
+		}
+		given = 1;
+		for(int j = i; j + 1 <= *argc; j++) {
+			argv[j] = argv[j + 1];
+		}
+		*argc -= 1;
+		i--;
+	}
+	return given;
+}
+
+/*
+ * Takes "--fp-cache DIR" out of the argument list like -j, returns DIR,
+ * where verification then keeps its fingerprint cache, or NULL.
+ */
+const char* fp_cache_select(int* argc, char** argv) {
+	const char* dir = NULL;
+	for(int i = 1; i < *argc; i++) {
+		if(strcmp(argv[i], "--fp-cache") != 0) {
+			continue;
+		}
+		if(i + 1 >= *argc) {
+			puts("--fp-cache requires a directory");
+			exit(1);
+		}
+		dir = argv[i + 1];
+		for(int j = i; j + 2 <= *argc; j++) {
+			argv[j] = argv[j + 2];
+		}
+		*argc -= 2;
+		i--;
+	}
+	return dir;
+}
+
+static double seconds_now(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * With -io given, the verifying queries report how fast the data
+ * file was read and hashed on stderr, leaving stdout untouched.
+ */
+void io_report(const struct bpkg_obj* obj, int report, double started) {
+	if(!report) {
+		return;
+	}
+	double elapsed = seconds_now() - started;
+	fprintf(stderr, "%s: verified %" PRIu64 " bytes in %.3f s, %.1f MiB/s\n",
+			io_names[obj->io], obj->size, elapsed,
+			elapsed > 0 ? obj->size / elapsed / (1 << 20) : 0.0);
+}
+
+/*
+ * Reads a proof as printed by -proof: the chunk position, the chunk hash,
+ * then one sibling hash per line from the leaf level up.
+ */
+int proof_read(FILE* in, struct merkle_proof* proof) {
+	char line[256];
+	unsigned long chunk;
+	char* end;
+
+	if(!fgets(line, sizeof(line), in)) {
+		return -1;
+	}
+	chunk = strtoul(line, &end, 10);
+	if(end == line || chunk > UINT32_MAX) {
+		return -1;
+	}
+	proof->chunk = (uint32_t) chunk;
+	if(!fgets(line, sizeof(line), in) ||
+			sha256_hex_to_digest(line, proof->leaf) != 0) {
+		return -1;
+	}
+	proof->len = 0;
+	while(fgets(line, sizeof(line), in)) {
+		if(line[0] == '\n') {
+			continue;
+		}
+		if(proof->len == MERKLE_MAX_DEPTH ||
+				sha256_hex_to_digest(line, proof->siblings[proof->len]) != 0) {
+			return -1;
+		}
+		proof->len++;
+	}
+	return 0;
+}
+
+/*
+ * -verify_proof <root hash> <nchunks> [proof file], reads stdin without a
+ * file. Only the root and the chunk count are needed, no .bpkg is loaded:
+ * the count fixes the depth every proof of that tree must reach.
+ */
+int proof_verify_main(int argc, char** argv) {
+	uint8_t root[SHA256_DIGEST_LENGTH];
+	struct merkle_proof proof;
+	unsigned long nchunks;
+	uint32_t depth = 0;
+	char* end;
+	FILE* in = stdin;
+	int ret;
+
+	if(argc < 3 || sha256_hex_to_digest(argv[2], root) != 0) {
+		puts("root hash not provided");
+		return 1;
+	}
+	nchunks = argc >= 4 ? strtoul(argv[3], &end, 10) : 0;
+	if(argc < 4 || *end != '\0' || nchunks == 0 || (nchunks & (nchunks - 1)) != 0) {
+		puts("chunk count not provided, it must be a power of two");
+		return 1;
+	}
+	while(((unsigned long) 1 << depth) < nchunks) {
+		depth++;
+	}
+	if(argc >= 5 && !(in = fopen(argv[4], "r"))) {
+		perror("Unable to open proof");
+		return 1;
+	}
+	ret = proof_read(in, &proof);
+	if(in != stdin) {
+		fclose(in);
+	}
+	if(ret != 0) {
+		puts("Malformed proof");
+		return 1;
+	}
+	if(!merkle_proof_verify(&proof, root, depth)) {
+		puts("Proof invalid");
+		return 1;
+	}
+	puts("Proof valid");
+	return 0;
+}
+
+/*
+ * -compile <in.bpkg> <out.bpkgc>, any package bpkg_load accepts
+ * is written in the compiled format.
+ */
+int compile_main(int argc, char** argv) {
+	struct bpkg_obj* obj;
+	int ret;
+
+	if(argc < 4) {
+		puts("input and output packages not provided");
+		return 1;
+	}
+	obj = bpkg_load(argv[2]);
+	if(!obj) {
+		return 1;
+	}
+	ret = bpkg_compile(obj, argv[3]) == 0 ? 0 : 1;
+	bpkg_obj_destroy(obj);
+	return ret;
+}
+
+void proof_print(FILE* out, const struct merkle_proof* proof) {
+	char hex[SHA256_HEX_LEN];
+	fprintf(out, "%u\n", proof->chunk);
+	sha256_digest_to_hex(proof->leaf, hex);
+	fprintf(out, "%.64s\n", hex);
+	for(uint32_t i = 0; i < proof->len; i++) {
+		sha256_digest_to_hex(proof->siblings[i], hex);
+		fprintf(out, "%.64s\n", hex);
+	}
+}
+
+// Query number for a flag, 0 if it is not one
+int flag_select(const char* flag) {
+	static const char* flags[] = { "-all_hashes", "-chunk_check",
+			"-min_hashes", "-hashes_of", "-file_check", "-proof" };
+	for(int i = 0; i < 6; i++) {
+		if(strcmp(flag, flags[i]) == 0) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+// Complaint for a query that needs a hash argument and has none
+const char* flag_missing_arg(int asel) {
+	if(asel == 4) {
+		return "filename not provided";
+	}
+	if(asel == 6) {
+		return "chunk hash not provided";
+	}
+	return NULL;
+}
+
 int arg_select(int argc, char** argv, int* asel, char* harg) {
 	
 	
 	char* cursor = argv[2];
 	*asel = 0;
+	if(argc >= 2 && strcmp(argv[1], "-selftest") == 0) {
+		exit(sha256_self_test(stdout) ? 1 : 0);
+	}
+	if(argc >= 2 && strcmp(argv[1], "-verify_proof") == 0) {
+		exit(proof_verify_main(argc, argv));
+	}
+	if(argc >= 2 && strcmp(argv[1], "-compile") == 0) {
+		exit(compile_main(argc, argv));
+	}
 	if(argc < 3) {
 		puts("bpkg or flag not provided");
 		exit(1);
 	}
 
-	if(strcmp(cursor, "-all_hashes") == 0) {
-		*asel = 1;
-	}
-	if(strcmp(cursor, "-chunk_check") == 0) {
-		*asel = 2;
-	}
-	if(strcmp(cursor, "-min_hashes") == 0) {
-		*asel = 3;
-	}
-	if(strcmp(cursor, "-hashes_of") == 0) {
+	*asel = flag_select(cursor);
+	if(flag_missing_arg(*asel)) {
 		if(argc < 4) {
-			puts("filename not provided");
+			puts(flag_missing_arg(*asel));
 			exit(1);
 		}
-		*asel = 4;
 		strncpy(harg, argv[3], SHA256_HEX_LEN + 1);
 	}
-	if(strcmp(cursor, "-file_check") == 0) {
-		*asel = 5;
-	}
 	return *asel;
 }
 
 
-void bpkg_print_hashes(struct bpkg_query* qry) {
+void bpkg_print_hashes(FILE* out, struct bpkg_query* qry) {
+	char hex[SHA256_HEX_LEN];
+	if(qry->message) {
+		fprintf(out, "%s\n", qry->message);
+	}
 	for(int i = 0; i < qry->len; i++) {
-		printf("%.64s\n", qry->hashes[i]);
+		sha256_digest_to_hex(qry->hashes[i], hex);
+		fprintf(out, "%.64s\n", hex);
 	}
 	
 }
 
+/*
+ * Runs query asel against a loaded package and prints its result to out,
+ * taking result buffers from arena when one is given.
+ * @return 0, or 1 if asel is not a query
+ */
+int query_run(FILE* out, struct bpkg_obj* obj, int asel, const char* hash,
+		int io_given, struct bpkg_arena* arena) {
+	struct bpkg_query qry = { 0 };
+
+	if(asel == 1) {
+		qry = bpkg_get_all_hashes_arena(obj, arena);
+		bpkg_print_hashes(out, &qry);
+		bpkg_query_destroy(&qry);
+	} else if(asel == 2) {
+		double started = seconds_now();
+		qry = bpkg_get_completed_chunks_arena(obj, arena);
+		io_report(obj, io_given, started);
+		bpkg_print_hashes(out, &qry);
+		bpkg_query_destroy(&qry);
+	} else if(asel == 3) {
+		//print_merkle_tree_hashes(obj->merkle_tree);
+		double started = seconds_now();
+		qry = bpkg_get_min_completed_hashes_arena(obj, arena);
+		io_report(obj, io_given, started);
+		bpkg_print_hashes(out, &qry);
+		bpkg_query_destroy(&qry);
+	} else if(asel == 4) {
+		uint8_t digest[SHA256_DIGEST_LENGTH];
+		if(sha256_hex_to_digest(hash, digest) != 0) {
+			fprintf(out, "No node found with the given hash: %.64s\n", hash);
+		} else {
+			qry = bpkg_get_all_chunk_hashes_from_hash_arena(obj, 
+					digest, arena);
+			// A miss is reported through out like any result, so -batch tags it
+			if(qry.message) {
+				fprintf(out, "%s: %.64s\n", qry.message, hash);
+			} else {
+				bpkg_print_hashes(out, &qry);
+			}
+		}
+		bpkg_query_destroy(&qry);
+	} else if(asel == 5) {
+		qry = bpkg_file_check(obj);
+		bpkg_print_hashes(out, &qry);
+		bpkg_query_destroy(&qry);
+	} else if(asel == 6) {
+		uint8_t digest[SHA256_DIGEST_LENGTH];
+		struct merkle_proof proof;
+		ssize_t node = -1;
+		if(sha256_hex_to_digest(hash, digest) == 0) {
+			node = find_hash(obj->merkle_tree, digest);
+		}
+		if(node < 0 || !merkle_is_leaf(obj->merkle_tree, node)) {
+			fprintf(out, "No chunk found with the given hash: %.64s\n", hash);
+		} else {
+			merkle_proof_build(obj->merkle_tree,
+					node - (obj->merkle_tree->n_leaves - 1), &proof);
+			proof_print(out, &proof);
+		}
+	} else {
+		fprintf(out, "Argument is invalid\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * -batch [manifest] runs one query per line, "<package> <flag> [hash]",
+ * read from the manifest or stdin. The whole input is read first and
+ * grouped by package so each package is loaded and its tree built once;
+ * packages are spread over the -j workers, each query's output is
+ * written as one block whose lines carry the input line number, then a
+ * tab, and the block ends with a line holding the number alone.
+ */
+struct batch_query {
+	size_t line;
+	char* package;
+	int asel;
+	char hash[SHA256_HEX_LEN + 1];
+	const char* error;
+};
+
+struct batch {
+	struct batch_query* queries;
+	size_t len;
+	// Start of each package's run of queries, with len at the end
+	size_t* groups;
+	size_t ngroups;
+	size_t next;
+	uint32_t threads;
+	enum bpkg_io_mode io;
+	int paranoid;
+	const char* fp_cache;
+	pthread_mutex_t lock;
+};
+
+static int batch_query_cmp(const void* a, const void* b) {
+	const struct batch_query* x = a;
+	const struct batch_query* y = b;
+	int c = strcmp(x->package, y->package);
+	if(c != 0) {
+		return c;
+	}
+	return (x->line > y->line) - (x->line < y->line);
+}
+
+/*
+ * Parses one manifest line into qry, blank lines and # comments are
+ * skipped. A malformed line still becomes a query so that its error
+ * is reported under its own tag.
+ * @return 1 if qry was filled, 0 if the line holds no query, -1 on error
+ */
+static int batch_parse(char* line, size_t lineno, struct batch_query* qry) {
+	const char* sep = " \t\r\n";
+	char* save = NULL;
+	char* package = strtok_r(line, sep, &save);
+	char* flag = strtok_r(NULL, sep, &save);
+	char* arg = strtok_r(NULL, sep, &save);
+
+	if(!package || package[0] == '#') {
+		return 0;
+	}
+	memset(qry, 0, sizeof(*qry));
+	qry->line = lineno;
+	qry->package = strdup(package);
+	if(!qry->package) {
+		return -1;
+	}
+	if(!flag) {
+		qry->error = "bpkg or flag not provided";
+		return 1;
+	}
+	qry->asel = flag_select(flag);
+	if(!qry->asel) {
+		qry->error = "Argument is invalid";
+	} else if(flag_missing_arg(qry->asel)) {
+		if(!arg) {
+			qry->error = flag_missing_arg(qry->asel);
+			return 1;
+		}
+		snprintf(qry->hash, sizeof(qry->hash), "%s", arg);
+	}
+	return 1;
+}
+
+static int batch_read(FILE* in, struct batch* batch) {
+	char* line = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	size_t lineno = 0;
+	int ret = 0;
+
+	while(getline(&line, &size, in) >= 0) {
+		lineno++;
+		if(batch->len == capacity) {
+			size_t grown = capacity ? capacity * 2 : 64;
+			struct batch_query* queries = realloc(batch->queries,
+					grown * sizeof(*queries));
+			if(!queries) {
+				ret = -1;
+				break;
+			}
+			batch->queries = queries;
+			capacity = grown;
+		}
+		int parsed = batch_parse(line, lineno, &batch->queries[batch->len]);
+		if(parsed < 0) {
+			ret = -1;
+			break;
+		}
+		batch->len += parsed;
+	}
+	free(line);
+	return ret;
+}
+
+static int batch_group(struct batch* batch) {
+	qsort(batch->queries, batch->len, sizeof(*batch->queries), batch_query_cmp);
+	batch->groups = malloc((batch->len + 1) * sizeof(*batch->groups));
+	if(!batch->groups) {
+		return -1;
+	}
+	for(size_t i = 0; i < batch->len; i++) {
+		if(i == 0 || strcmp(batch->queries[i].package,
+				batch->queries[i - 1].package) != 0) {
+			batch->groups[batch->ngroups++] = i;
+		}
+	}
+	batch->groups[batch->ngroups] = batch->len;
+	return 0;
+}
+
+// Writes text to stdout a line at a time under the query's tag
+static void batch_emit(struct batch* batch, size_t line, const char* text, size_t len) {
+	pthread_mutex_lock(&batch->lock);
+	while(len > 0) {
+		const char* nl = memchr(text, '\n', len);
+		size_t n = nl ? (size_t) (nl - text) : len;
+		printf("%zu\t%.*s\n", line, (int) n, text);
+		n += nl ? 1 : 0;
+		text += n;
+		len -= n;
+	}
+	printf("%zu\n", line);
+	fflush(stdout);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static void batch_run_group(struct batch* batch, size_t first, size_t end,
+		struct bpkg_arena* arena) {
+	struct bpkg_obj* obj = bpkg_load(batch->queries[first].package);
+	if(obj) {
+		obj->merkle_tree = build_merkle_tree_mt(obj->chunks, obj->nchunks,
+				batch->threads);
+		obj->threads = batch->threads;
+		obj->io = batch->io;
+		obj->paranoid = batch->paranoid;
+		obj->fp_cache = batch->fp_cache;
+		if(obj->merkle_tree && arena->capacity < obj->merkle_tree->n_nodes) {
+			bpkg_arena_destroy(arena);
+			bpkg_arena_init(arena, obj->merkle_tree->n_nodes);
+		}
+	}
+
+	for(size_t i = first; i < end; i++) {
+		struct batch_query* qry = &batch->queries[i];
+		char* text = NULL;
+		size_t len = 0;
+		FILE* out = open_memstream(&text, &len);
+		if(!out) {
+			perror("Unable to buffer query output");
+			exit(1);
+		}
+		if(qry->error) {
+			fprintf(out, "%s\n", qry->error);
+		} else if(!obj) {
+			fprintf(out, "Unable to load package\n");
+		} else {
+			query_run(out, obj, qry->asel, qry->hash, 0, arena);
+			bpkg_arena_reset(arena);
+		}
+		fclose(out);
+		batch_emit(batch, qry->line, text, len);
+		free(text);
+	}
+
+	if(obj) {
+		bpkg_obj_destroy(obj);
+	}
+}
+
+static void* batch_worker(void* arg) {
+	struct batch* batch = arg;
+	struct bpkg_arena arena = { 0 };
+
+	for(;;) {
+		pthread_mutex_lock(&batch->lock);
+		size_t g = batch->next < batch->ngroups ? batch->next++ : batch->ngroups;
+		pthread_mutex_unlock(&batch->lock);
+		if(g == batch->ngroups) {
+			break;
+		}
+		batch_run_group(batch, batch->groups[g], batch->groups[g + 1], &arena);
+	}
+	bpkg_arena_destroy(&arena);
+	return NULL;
+}
+
+int batch_main(int argc, char** argv, int jobs, enum bpkg_io_mode io, int paranoid,
+		const char* fp_cache) {
+	struct batch batch = { 0 };
+	FILE* in = stdin;
+	int ret = 0;
+
+	if(argc >= 3 && !(in = fopen(argv[2], "r"))) {
+		perror("Unable to open manifest");
+		return 1;
+	}
+	if(batch_read(in, &batch) != 0 || batch_group(&batch) != 0) {
+		perror("Unable to read manifest");
+		ret = 1;
+	}
+	if(in != stdin) {
+		fclose(in);
+	}
+
+	// Packages are the unit of parallelism, spare jobs go to each package
+	size_t workers = (size_t) jobs < batch.ngroups ? (size_t) jobs : batch.ngroups;
+	if(ret == 0 && workers > 0) {
+		pthread_t threads[workers];
+		int joinable[workers];
+		batch.threads = jobs / workers;
+		batch.io = io;
+		batch.paranoid = paranoid;
+		batch.fp_cache = fp_cache;
+		pthread_mutex_init(&batch.lock, NULL);
+		for(size_t t = 1; t < workers; t++) {
+			joinable[t] = pthread_create(&threads[t], NULL, batch_worker, &batch) == 0;
+		}
+		batch_worker(&batch);
+		for(size_t t = 1; t < workers; t++) {
+			if(joinable[t]) {
+				pthread_join(threads[t], NULL);
+			}
+		}
+		pthread_mutex_destroy(&batch.lock);
+	}
+
+	for(size_t i = 0; i < batch.len; i++) {
+		free(batch.queries[i].package);
+	}
+	free(batch.queries);
+	free(batch.groups);
+	return ret;
+}
+
 int main(int argc, char** argv) {
 	
 	int argselect = 0;
 	char hash[SHA256_HEX_LEN + 1];
+	int jobs = jobs_select(&argc, argv);
+	enum bpkg_io_mode io = BPKG_IO_READ;
+	int io_given = io_select(&argc, argv, &io);
+	int paranoid = paranoid_select(&argc, argv);
+	const char* fp_cache = fp_cache_select(&argc, argv);
+
+	if(argc >= 2 && strcmp(argv[1], "-batch") == 0) {
+		return batch_main(argc, argv, jobs, io, paranoid, fp_cache);
+	}
 
 
 	if(arg_select(argc, argv, &argselect, hash)) {
-		struct bpkg_query qry = { 0 };
 		struct bpkg_obj* obj = bpkg_load(argv[1]);
 		if (!obj) {
 			exit(1);
 		}
 
-    	struct merkle_tree_node* root = build_merkle_tree(obj->chunks, 0, obj->nchunks - 1);
-		obj->merkle_root = root;
-
-		if(argselect == 1) {
-			qry = bpkg_get_all_hashes(obj);
-			bpkg_print_hashes(&qry);
-			bpkg_query_destroy(&qry);
-		} else if(argselect == 2) {
-			qry = bpkg_get_completed_chunks(obj);
-			bpkg_print_hashes(&qry);
-			bpkg_query_destroy(&qry);
-		} else if(argselect == 3) {
-			//print_merkle_tree_hashes(obj->merkle_root);
-			qry = bpkg_get_min_completed_hashes(obj);
-			bpkg_print_hashes(&qry);
-			bpkg_query_destroy(&qry);
-		} else if(argselect == 4) {
-			qry = bpkg_get_all_chunk_hashes_from_hash(obj, 
-					hash);
-			bpkg_print_hashes(&qry);
-			bpkg_query_destroy(&qry);
-		} else if(argselect == 5) {
-			qry = bpkg_file_check(obj);
-			bpkg_print_hashes(&qry);
-			bpkg_query_destroy(&qry);
-		} else {
-			puts("Argument is invalid");
+		obj->merkle_tree = build_merkle_tree_mt(obj->chunks, obj->nchunks, jobs);
+		obj->threads = jobs;
+		obj->io = io;
+		obj->paranoid = paranoid;
+		obj->fp_cache = fp_cache;
+
+		if(query_run(stdout, obj, argselect, hash, io_given, NULL) != 0) {
 			return 1;
 		}
 		bpkg_obj_destroy(obj);
@@ -0,0 +1,92 @@
+#include <chk/pkgchk.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * pkgmake <data file> <chunk size> <out.bpkg> [-j N] [-io read|mmap|direct]
+ *		[-ident ID]
+ * Hashes the data file on N workers and writes a package for it,
+ * as a compiled package when out ends in .bpkgc.
+ */
+
+// Indexed by enum bpkg_io_mode
+static const char* io_names[] = { "read", "mmap", "direct" };
+
+static void usage(void) {
+	puts("usage: pkgmake <data file> <chunk size> <out.bpkg> "
+			"[-j N] [-io read|mmap|direct] [-ident ID]");
+	exit(1);
+}
+
+static int ends_with(const char* s, const char* suffix) {
+	size_t n = strlen(s);
+	size_t m = strlen(suffix);
+	return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+int main(int argc, char** argv) {
+	const char* positional[3];
+	int npositional = 0;
+	int jobs = 1;
+	enum bpkg_io_mode io = BPKG_IO_READ;
+	const char* ident = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-j") == 0) {
+			if(i + 1 >= argc || (jobs = atoi(argv[++i])) < 1) {
+				puts("-j requires a thread count of at least 1");
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-io") == 0) {
+			int m = 0;
+			while(i + 1 < argc && m < 3 && strcmp(argv[i + 1], io_names[m]) != 0) {
+				m++;
+			}
+			if(i + 1 >= argc || m == 3) {
+				puts("-io requires one of read, mmap or direct");
+				exit(1);
+			}
+			io = (enum bpkg_io_mode) m;
+			i++;
+		} else if(strcmp(argv[i], "-ident") == 0) {
+			if(i + 1 >= argc || strlen(argv[i + 1]) > MAX_IDENT_LEN) {
+				puts("-ident requires an identifier of at most 1024 characters");
+				exit(1);
+			}
+			ident = argv[++i];
+		} else if(npositional < 3) {
+			positional[npositional++] = argv[i];
+		} else {
+			usage();
+		}
+	}
+	if(npositional < 3) {
+		usage();
+	}
+
+	char* end;
+	unsigned long chunk_size = strtoul(positional[1], &end, 10);
+	if(*end != '\0' || chunk_size == 0 || chunk_size > UINT32_MAX) {
+		puts("chunk size must be a positive number of bytes");
+		exit(1);
+	}
+
+	struct bpkg_obj* obj = bpkg_make(positional[0], (uint32_t) chunk_size, jobs, io);
+	if(!obj) {
+		exit(1);
+	}
+	if(ident) {
+		memset(obj->ident, 0, sizeof(obj->ident));
+		memcpy(obj->ident, ident, strlen(ident));
+	}
+
+	int ret;
+	if(ends_with(positional[2], ".bpkgc")) {
+		ret = bpkg_compile(obj, positional[2]);
+	} else {
+		ret = bpkg_save(obj, positional[2]);
+	}
+	bpkg_obj_destroy(obj);
+	return ret == 0 ? 0 : 1;
+}
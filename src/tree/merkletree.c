@@ -6,86 +6,228 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+
+// Below this many chunks a single thread builds the tree faster than a pool can start
+#define MERKLE_PARALLEL_MIN_LEAVES 4096
+// Subtrees per worker, more than one so uneven scheduling evens out
+#define MERKLE_SUBTREES_PER_THREAD 4
+
+struct merkle_build_job {
+    struct merkle_tree* tree;
+    uint32_t root_depth;
+    size_t first;
+    size_t count;
+};
+
+// Power of two with at most 50% load, so probe runs stay short
+static size_t merkle_index_slots(size_t n_nodes) {
+    size_t n_slots = 1;
+    while (n_slots < 2 * n_nodes) {
+        n_slots <<= 1;
+    }
+    return n_slots;
+}
 
-struct merkle_tree_node* create_node(const char* hash) {
-    struct merkle_tree_node* node = malloc(sizeof(struct merkle_tree_node));
-    if (!node) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+static size_t merkle_index_slot(const uint8_t* hash, size_t mask) {
+    uint64_t prefix;
+    memcpy(&prefix, hash, sizeof(prefix));
+    return (size_t) prefix & mask;
+}
+
+// Inserted in node order and duplicates skipped, so lookups find the smallest index
+static void merkle_index_build(struct merkle_tree* tree) {
+    uint32_t* index = merkle_index(tree);
+    memset(index, 0, (tree->index_mask + 1) * sizeof(uint32_t));
+
+    for (size_t node = 0; node < tree->n_nodes; node++) {
+        size_t slot = merkle_index_slot(tree->hashes[node], tree->index_mask);
+        while (index[slot] != 0 && !sha256_digest_eq(tree->hashes[index[slot] - 1], tree->hashes[node])) {
+            slot = (slot + 1) & tree->index_mask;
+        }
+        if (index[slot] == 0) {
+            index[slot] = (uint32_t) (node + 1);
+        }
     }
-    if (!node->computed_hash) {
-        perror("Memory allocation failed");
-        free(node);
-        exit(EXIT_FAILURE);
+}
+
+/*
+ * Hashes the interior nodes of the subtrees rooted at depth root_depth,
+ * indices first .. first + count - 1 within that level, for every depth
+ * from root_depth up to (not including) from_depth. Each level of those
+ * subtrees is a contiguous run of the array, walked bottom up.
+ */
+static void merkle_hash_levels(struct merkle_tree* tree, uint32_t root_depth, size_t first, size_t count, uint32_t from_depth) {
+    for (uint32_t d = from_depth; d-- > root_depth; ) {
+        uint32_t below = d - root_depth;
+        size_t start = ((size_t) 1 << d) - 1 + (first << below);
+        size_t end = start + (count << below);
+        for (size_t i = start; i < end; i++) {
+            sha256_merkle_parent(tree->hashes[MERKLE_LEFT(i)], tree->hashes[MERKLE_RIGHT(i)], tree->hashes[i]);
+        }
     }
-    strncpy(node->computed_hash, hash, MAX_HASH_LEN);
-    node->computed_hash[MAX_HASH_LEN] = '\0'; // Null-terminate the string
-    node->left = NULL;
-    node->right = NULL;
-    node->is_leaf = 0;
-    return node;
 }
 
-struct merkle_tree_node* build_merkle_tree(struct chunk_obj* chunks, int start, int end) {
-    if (start > end) {
-        return NULL;
+static void* merkle_build_worker(void* arg) {
+    struct merkle_build_job* job = arg;
+    merkle_hash_levels(job->tree, job->root_depth, job->first, job->count, job->tree->depth);
+    return NULL;
+}
+
+/*
+ * Splits the tree at the shallowest depth with enough subtrees for every
+ * worker, hashes those subtrees on the pool, then merges the levels above
+ * the split on the calling thread.
+ */
+static void merkle_hash_parallel(struct merkle_tree* tree, uint32_t threads) {
+    uint32_t split = 0;
+    while (split < tree->depth && ((size_t) 1 << split) < (size_t) threads * MERKLE_SUBTREES_PER_THREAD) {
+        split++;
+    }
+
+    size_t n_subtrees = (size_t) 1 << split;
+    if (threads > n_subtrees) {
+        threads = n_subtrees;
     }
-    if (start == end) {
-        struct merkle_tree_node* leaf_node = create_node(chunks[start].hash);
-        leaf_node->is_leaf = 1;
-        return leaf_node;
+
+    pthread_t workers[threads];
+    struct merkle_build_job jobs[threads];
+    int joinable[threads];
+
+    for (uint32_t t = 0; t < threads; t++) {
+        jobs[t].tree = tree;
+        jobs[t].root_depth = split;
+        jobs[t].first = n_subtrees * t / threads;
+        jobs[t].count = n_subtrees * (t + 1) / threads - jobs[t].first;
+        joinable[t] = pthread_create(&workers[t], NULL, merkle_build_worker, &jobs[t]) == 0;
+        if (!joinable[t]) {
+            // Fall back to doing this share on the calling thread
+            merkle_build_worker(&jobs[t]);
+        }
     }
 
-    int mid = (start + end) / 2;
-    struct merkle_tree_node* left_child = build_merkle_tree(chunks, start, mid);
-    struct merkle_tree_node* right_child = build_merkle_tree(chunks, mid + 1, end);
+    for (uint32_t t = 0; t < threads; t++) {
+        if (joinable[t]) {
+            pthread_join(workers[t], NULL);
+        }
+    }
+
+    merkle_hash_levels(tree, 0, 0, 1, split);
+}
+
+struct merkle_tree* build_merkle_tree(struct chunk_obj* chunks, uint32_t nchunks) {
+    return build_merkle_tree_mt(chunks, nchunks, 1);
+}
+
+struct merkle_tree* build_merkle_tree_mt(struct chunk_obj* chunks, uint32_t nchunks, uint32_t threads) {
+    if (nchunks == 0 || (nchunks & (nchunks - 1)) != 0) {
+        return NULL;
+    }
 
-    char combined_hash[2 * MAX_HASH_LEN + 1];
-    snprintf(combined_hash, sizeof(combined_hash), "%s%s", left_child->computed_hash, right_child->computed_hash);
+    size_t n_nodes = 2 * (size_t) nchunks - 1;
+    size_t n_slots = merkle_index_slots(n_nodes);
+    struct merkle_tree* tree = malloc(merkle_tree_bytes(n_nodes, n_slots));
+    if (!tree) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    tree->n_nodes = n_nodes;
+    tree->n_leaves = nchunks;
+    tree->depth = merkle_node_depth(n_nodes - 1);
+    tree->index_mask = n_slots - 1;
 
-    char parent_hash[MAX_HASH_LEN + 1];
-    compute_hash(combined_hash, parent_hash);
+    for (size_t c = 0; c < nchunks; c++) {
+        memcpy(tree->hashes[merkle_leaf_node(tree, c)], chunks[c].hash, SHA256_DIGEST_LENGTH);
+    }
 
-    struct merkle_tree_node* parent_node = create_node(parent_hash);
-    parent_node->left = left_child;
-    parent_node->right = right_child;
+    if (threads > 1 && nchunks >= MERKLE_PARALLEL_MIN_LEAVES) {
+        merkle_hash_parallel(tree, threads);
+    } else {
+        merkle_hash_levels(tree, 0, 0, 1, tree->depth);
+    }
 
-    return parent_node;
+    merkle_index_build(tree);
+    return tree;
 }
 
 
-int find_hash(struct merkle_tree_node* node, const char* hash) {
-    if (node == NULL) {
-        return 0;
+ssize_t find_hash(const struct merkle_tree* tree, const uint8_t* hash) {
+    if (tree == NULL) {
+        return -1;
     }
 
-    if (strcmp(node->computed_hash, hash) == 0) {
-        return 1; 
+    const uint32_t* index = merkle_index(tree);
+    for (size_t slot = merkle_index_slot(hash, tree->index_mask); index[slot] != 0; slot = (slot + 1) & tree->index_mask) {
+        size_t node = index[slot] - 1;
+        if (sha256_digest_eq(tree->hashes[node], hash)) {
+            return (ssize_t) node;
+        }
     }
 
-    return find_hash(node->left, hash) || find_hash(node->right, hash);
+    return -1;
 }
 
-void free_merkle_tree(struct merkle_tree_node* node) {
-    if (node == NULL) {
-        return;
+int merkle_proof_build(const struct merkle_tree* tree, size_t chunk, struct merkle_proof* proof) {
+    if (tree == NULL || chunk >= tree->n_leaves) {
+        return -1;
+    }
+
+    size_t node = merkle_leaf_node(tree, chunk);
+    proof->chunk = (uint32_t) chunk;
+    proof->len = 0;
+    memcpy(proof->leaf, tree->hashes[node], SHA256_DIGEST_LENGTH);
+    for (; node > 0; node = MERKLE_PARENT(node)) {
+        memcpy(proof->siblings[proof->len++], tree->hashes[MERKLE_SIBLING(node)], SHA256_DIGEST_LENGTH);
     }
-    free_merkle_tree(node->left);  // Free left subtree
-    free_merkle_tree(node->right); // Free right subtree
-    free(node);                    // Free the current node
+    return 0;
 }
 
-void print_merkle_tree_hashes(struct merkle_tree_node* node) {
-    if (node == NULL) {
-        return;  // Base case: if the node is NULL, return.
+int merkle_proof_verify(const struct merkle_proof* proof, const uint8_t* root, uint32_t depth) {
+    // A shorter path would start from an interior node instead of a leaf
+    if (proof->len != depth || proof->len >= MERKLE_MAX_DEPTH || (proof->chunk >> proof->len) != 0) {
+        return 0;
+    }
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint8_t parent[SHA256_DIGEST_LENGTH];
+    memcpy(digest, proof->leaf, SHA256_DIGEST_LENGTH);
+
+    // Bit i of the chunk position says whether the level i node is a right child
+    for (uint32_t i = 0; i < proof->len; i++) {
+        if ((proof->chunk >> i) & 1) {
+            sha256_merkle_parent(proof->siblings[i], digest, parent);
+        } else {
+            sha256_merkle_parent(digest, proof->siblings[i], parent);
+        }
+        memcpy(digest, parent, SHA256_DIGEST_LENGTH);
     }
+    return sha256_digest_eq(digest, root);
+}
 
-    // Recursive call to visit the left child
-    print_merkle_tree_hashes(node->left);
+void free_merkle_tree(struct merkle_tree* tree) {
+    free(tree);
+}
 
-    // Print the current node's hash value
-    printf("Node Hash: %s\n", node->computed_hash);
+/*
+ * In a perfect tree the in-order walk alternates leaves and interior
+ * nodes: position p holds a node whose height is the number of trailing
+ * zero bits of p + 1, and the bits above that give its place in the level.
+ */
+size_t merkle_inorder_node(const struct merkle_tree* tree, size_t p) {
+    uint32_t height = (uint32_t) __builtin_ctzll((unsigned long long) p + 1);
+    size_t level_index = (p + 1) >> (height + 1);
+    uint32_t depth = tree->depth - height;
+    return ((size_t) 1 << depth) - 1 + level_index;
+}
 
-    // Recursive call to visit the right child
-    print_merkle_tree_hashes(node->right);
-}
\ No newline at end of file
+void print_merkle_tree_hashes(const struct merkle_tree* tree) {
+    if (tree == NULL) {
+        return;
+    }
+
+    char hex[SHA256_HEXLEN];
+    for (size_t p = 0; p < tree->n_nodes; p++) {
+        sha256_digest_to_hex(tree->hashes[merkle_inorder_node(tree, p)], hex);
+        printf("Node Hash: %.64s\n", hex);
+    }
+}
@@ -0,0 +1,355 @@
+// sidecar.c
+// F_OFD_SETLK is a Linux extension
+#define _GNU_SOURCE
+#include <tree/sidecar.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Open file description locks also keep two openers in one process apart
+#ifdef F_OFD_SETLK
+#define SIDECAR_LOCK F_OFD_SETLK
+#else
+#define SIDECAR_LOCK F_SETLK
+#endif
+
+#define SIDECAR_ALIGN(n) (((n) + 63) & ~(uint64_t) 63)
+#define SIDECAR_PATH_MAX 4096
+
+static int sidecar_path(const char* bpkg_path, const char* suffix, char* out) {
+    int len = snprintf(out, SIDECAR_PATH_MAX, "%s%s", bpkg_path, suffix);
+    return (len < 0 || len >= SIDECAR_PATH_MAX) ? -1 : 0;
+}
+
+static int sidecar_pwrite(int fd, const void* buf, size_t len, uint64_t off) {
+    const uint8_t* p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t) off);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// Every section must lie inside the file and describe the same package shape
+static int sidecar_valid(const struct bpkg_sidecar_header* hdr, size_t len, const struct bpkg_fingerprint* bpkg) {
+    if (memcmp(hdr->magic, BPKG_SIDECAR_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != BPKG_SIDECAR_VERSION || hdr->chunk_bytes != sizeof(Chunk) ||
+        memcmp(&hdr->bpkg, bpkg, sizeof(*bpkg)) != 0) {
+        return 0;
+    }
+    if (hdr->nchunks == 0 || (hdr->nchunks & (hdr->nchunks - 1)) != 0 ||
+        hdr->chunks_off % 64 || hdr->tree_off % 64 ||
+        hdr->chunks_off + (uint64_t) hdr->nchunks * sizeof(Chunk) > len ||
+        hdr->tree_off + sizeof(struct merkle_tree) > len ||
+        hdr->verified_off % 64 ||
+        hdr->verified_off + bitset_words(hdr->nchunks) * sizeof(uint64_t) > len) {
+        return 0;
+    }
+
+    // The tracker walks depth levels up from each leaf, so it must be log2(nchunks)
+    const struct merkle_tree* tree = (const struct merkle_tree*) ((const uint8_t*) hdr + hdr->tree_off);
+    size_t slots = tree->index_mask + 1;
+    return tree->n_leaves == hdr->nchunks && tree->n_nodes == 2 * (size_t) hdr->nchunks - 1 &&
+        tree->depth == (uint32_t) __builtin_ctzll((unsigned long long) hdr->nchunks) &&
+        (slots & tree->index_mask) == 0 && slots >= tree->n_nodes &&
+        hdr->tree_off + merkle_tree_bytes(tree->n_nodes, slots) <= len;
+}
+
+struct bpkg_sidecar* bpkg_sidecar_open(const char* bpkg_path) {
+    char path[SIDECAR_PATH_MAX];
+    struct bpkg_fingerprint bpkg = {0};
+    if (sidecar_path(bpkg_path, BPKG_SIDECAR_SUFFIX, path) != 0 || bpkg_fingerprint_path(bpkg_path, &bpkg) != 0) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct bpkg_sidecar_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    const struct bpkg_sidecar_header* hdr = map;
+    struct bpkg_sidecar* sidecar = NULL;
+    if (!sidecar_valid(hdr, st.st_size, &bpkg) || !(sidecar = calloc(1, sizeof(*sidecar)))) {
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    sidecar->fd = fd;
+    sidecar->map = map;
+    sidecar->map_len = st.st_size;
+    sidecar->header = hdr;
+    sidecar->journal_fd = -1;
+    if (sidecar_path(bpkg_path, BPKG_JOURNAL_SUFFIX, path) == 0) {
+        sidecar->journal_fd = open(path, O_RDWR | O_CREAT, 0644);
+    }
+
+    // One writer per journal, any other opener of the package runs on checkpoints alone
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    if (sidecar->journal_fd >= 0 && fcntl(sidecar->journal_fd, SIDECAR_LOCK, &lock) != 0) {
+        close(sidecar->journal_fd);
+        sidecar->journal_fd = -1;
+    }
+
+    struct bpkg_obj* obj = &sidecar->obj;
+    memcpy(obj->ident, hdr->ident, sizeof(obj->ident));
+    memcpy(obj->filename, hdr->filename, sizeof(obj->filename));
+    obj->size = hdr->size;
+    obj->nchunks = hdr->nchunks;
+    obj->nhashes = hdr->nchunks - 1;
+    obj->chunks = (Chunk*) ((uint8_t*) map + hdr->chunks_off);
+    obj->merkle_tree = (struct merkle_tree*) ((uint8_t*) map + hdr->tree_off);
+    // Interior hashes are the first nhashes nodes of the tree
+    obj->hashes = obj->merkle_tree->hashes;
+    return sidecar;
+}
+
+struct bpkg_sidecar* bpkg_sidecar_create(const char* bpkg_path, const struct bpkg_obj* obj) {
+    const struct merkle_tree* tree = obj->merkle_tree;
+    char path[SIDECAR_PATH_MAX];
+    char tmp[SIDECAR_PATH_MAX];
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), "%s.%ld", BPKG_SIDECAR_SUFFIX, (long) getpid());
+
+    struct bpkg_sidecar_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (!tree || sidecar_path(bpkg_path, BPKG_SIDECAR_SUFFIX, path) != 0 ||
+        sidecar_path(bpkg_path, suffix, tmp) != 0 || bpkg_fingerprint_path(bpkg_path, &hdr.bpkg) != 0) {
+        return NULL;
+    }
+
+    memcpy(hdr.magic, BPKG_SIDECAR_MAGIC, sizeof(hdr.magic));
+    hdr.version = BPKG_SIDECAR_VERSION;
+    hdr.chunk_bytes = sizeof(Chunk);
+    hdr.nchunks = obj->nchunks;
+    hdr.size = obj->size;
+    memcpy(hdr.ident, obj->ident, sizeof(hdr.ident));
+    memcpy(hdr.filename, obj->filename, sizeof(hdr.filename));
+
+    size_t tree_bytes = merkle_tree_bytes(tree->n_nodes, tree->index_mask + 1);
+    hdr.chunks_off = SIDECAR_ALIGN(sizeof(hdr));
+    hdr.tree_off = SIDECAR_ALIGN(hdr.chunks_off + (uint64_t) obj->nchunks * sizeof(Chunk));
+    hdr.verified_off = SIDECAR_ALIGN(hdr.tree_off + tree_bytes);
+    uint64_t total = hdr.verified_off + bitset_words(obj->nchunks) * sizeof(uint64_t);
+
+    // Written under a temporary name so readers never map a partial file
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    int ok = ftruncate(fd, (off_t) total) == 0 &&
+        sidecar_pwrite(fd, &hdr, sizeof(hdr), 0) == 0 &&
+        sidecar_pwrite(fd, obj->chunks, (size_t) obj->nchunks * sizeof(Chunk), hdr.chunks_off) == 0 &&
+        sidecar_pwrite(fd, tree, tree_bytes, hdr.tree_off) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return NULL;
+    }
+    return bpkg_sidecar_open(bpkg_path);
+}
+
+static void journal_header_fill(const struct bpkg_sidecar* sidecar, struct bpkg_journal_header* jh) {
+    memset(jh, 0, sizeof(*jh));
+    memcpy(jh->magic, BPKG_JOURNAL_MAGIC, sizeof(BPKG_JOURNAL_MAGIC));
+    jh->version = BPKG_JOURNAL_VERSION;
+    jh->nchunks = sidecar->obj.nchunks;
+    memcpy(jh->root, sidecar->obj.merkle_tree->hashes[0], SHA256_DIGEST_LENGTH);
+    jh->base = sidecar->header->data;
+}
+
+static int journal_reset(struct bpkg_sidecar* sidecar) {
+    struct bpkg_journal_header jh;
+    journal_header_fill(sidecar, &jh);
+    sidecar->journal_pending = 0;
+    sidecar->journal_len = 0;
+    if (sidecar->journal_fd < 0 || ftruncate(sidecar->journal_fd, 0) != 0 ||
+        sidecar_pwrite(sidecar->journal_fd, &jh, sizeof(jh), 0) != 0 ||
+        fdatasync(sidecar->journal_fd) != 0) {
+        return -1;
+    }
+    sidecar->journal_len = sizeof(jh);
+    return 0;
+}
+
+static int journal_record_valid(const struct bpkg_sidecar* sidecar, const struct bpkg_journal_record* r) {
+    if (r->chunk >= sidecar->obj.nchunks) {
+        return 0;
+    }
+    if (r->type == BPKG_JOURNAL_VERIFIED) {
+        return 1;
+    }
+    return r->type == BPKG_JOURNAL_RANGE && r->from < r->to && r->to <= sidecar->obj.chunks[r->chunk].size;
+}
+
+/*
+ * Reads the records of a journal that extends the current checkpoint.
+ * A torn append leaves a short or garbled tail, replay stops before it
+ * and the length is cut back so later appends follow the last good record.
+ */
+static int journal_read(struct bpkg_sidecar* sidecar, struct bpkg_journal_record** records, size_t* count) {
+    struct bpkg_journal_header jh, expect;
+    struct stat st;
+    journal_header_fill(sidecar, &expect);
+    if (sidecar->journal_fd < 0 || fstat(sidecar->journal_fd, &st) != 0 ||
+        (size_t) st.st_size < sizeof(jh) ||
+        pread(sidecar->journal_fd, &jh, sizeof(jh), 0) != (ssize_t) sizeof(jh) ||
+        memcmp(&jh, &expect, sizeof(jh)) != 0) {
+        return -1;
+    }
+
+    size_t n = ((size_t) st.st_size - sizeof(jh)) / sizeof(**records);
+    *records = malloc((n ? n : 1) * sizeof(**records));
+    if (!*records) {
+        return -1;
+    }
+    ssize_t got = n ? pread(sidecar->journal_fd, *records, n * sizeof(**records), sizeof(jh)) : 0;
+    if (got < 0) {
+        free(*records);
+        return -1;
+    }
+
+    *count = 0;
+    n = (size_t) got / sizeof(**records);
+    while (*count < n && journal_record_valid(sidecar, &(*records)[*count])) {
+        (*count)++;
+    }
+    sidecar->journal_len = sizeof(jh) + *count * sizeof(**records);
+    sidecar->journal_pending = 0;
+    if ((uint64_t) st.st_size != sidecar->journal_len && ftruncate(sidecar->journal_fd, (off_t) sidecar->journal_len) != 0) {
+        free(*records);
+        return -1;
+    }
+    return 0;
+}
+
+static int timestamp_before(int64_t sec, int64_t nsec, const struct timespec* than) {
+    return sec < than->tv_sec || (sec == than->tv_sec && nsec < than->tv_nsec);
+}
+
+/*
+ * Nothing touched the data file after the journal was last written. File
+ * times come from a coarse clock, so a write landing in the same tick as
+ * the last flush leaves a tie. Like the fingerprint cache, a tie is racily
+ * clean and not trusted, the data file is rehashed instead.
+ */
+static int journal_covers(const struct bpkg_sidecar* sidecar, const struct bpkg_fingerprint* data) {
+    struct stat st;
+    if (sidecar->journal_fd < 0 || fstat(sidecar->journal_fd, &st) != 0) {
+        return 0;
+    }
+    return timestamp_before(data->mtime_sec, data->mtime_nsec, &st.st_mtim) &&
+           timestamp_before(data->ctime_sec, data->ctime_nsec, &st.st_mtim);
+}
+
+const uint64_t* bpkg_sidecar_resume(struct bpkg_sidecar* sidecar, const char* data_path,
+                                    struct bpkg_journal_record** records, size_t* count) {
+    const struct bpkg_fingerprint* base = &sidecar->header->data;
+    const struct bpkg_fingerprint none = {0};
+    struct bpkg_fingerprint data = {0};
+    *records = NULL;
+    *count = 0;
+    if (bpkg_fingerprint_path(data_path, &data) != 0 || memcmp(base, &none, sizeof(none)) == 0) {
+        return NULL;
+    }
+    const uint64_t* bits = (const uint64_t*) ((const uint8_t*) sidecar->map + sidecar->header->verified_off);
+
+    // A truncated or grown file can never hold what the bitset says
+    if (data.size != sidecar->obj.size) {
+        return NULL;
+    }
+    // Written to since the checkpoint, but still the file the journal describes and no later
+    if (data.dev == base->dev && data.ino == base->ino && journal_covers(sidecar, &data) &&
+        journal_read(sidecar, records, count) == 0) {
+        return bits;
+    }
+    if (memcmp(&data, base, sizeof(data)) == 0) {
+        journal_reset(sidecar);
+        return bits;
+    }
+    return NULL;
+}
+
+int bpkg_sidecar_store_verified(struct bpkg_sidecar* sidecar, const char* data_path, const uint64_t* done) {
+    size_t nbytes = bitset_words(sidecar->obj.nchunks) * sizeof(*done);
+
+    // Clear the stamp first so a torn update is never trusted
+    struct bpkg_fingerprint data = {0};
+    struct bpkg_fingerprint none = {0};
+    uint64_t stamp_off = offsetof(struct bpkg_sidecar_header, data);
+    int ret = -1;
+    if (bpkg_fingerprint_path(data_path, &data) == 0 &&
+        sidecar_pwrite(sidecar->fd, &none, sizeof(none), stamp_off) == 0 &&
+        sidecar_pwrite(sidecar->fd, done, nbytes, sidecar->header->verified_off) == 0 &&
+        fdatasync(sidecar->fd) == 0 &&
+        sidecar_pwrite(sidecar->fd, &data, sizeof(data), stamp_off) == 0 &&
+        fdatasync(sidecar->fd) == 0) {
+        ret = 0;
+    }
+    // Even after a failure the journal must not extend a checkpoint it no longer matches
+    journal_reset(sidecar);
+    return ret;
+}
+
+int bpkg_sidecar_journal_append(struct bpkg_sidecar* sidecar, enum bpkg_journal_type type,
+                                uint32_t chunk, uint32_t from, uint32_t to) {
+    if (sidecar->journal_fd < 0 || sidecar->journal_len == 0) {
+        return 0;
+    }
+    // The batch was due but never flushed, dropping a record only costs a refetch
+    if (sidecar->journal_pending == BPKG_JOURNAL_BATCH) {
+        return 1;
+    }
+    sidecar->journal[sidecar->journal_pending++] = (struct bpkg_journal_record) {
+        .type = type, .chunk = chunk, .from = from, .to = to,
+    };
+    return sidecar->journal_pending == BPKG_JOURNAL_BATCH;
+}
+
+int bpkg_sidecar_journal_flush(struct bpkg_sidecar* sidecar) {
+    if (sidecar->journal_pending == 0) {
+        return 0;
+    }
+    size_t nbytes = sidecar->journal_pending * sizeof(sidecar->journal[0]);
+    if (sidecar_pwrite(sidecar->journal_fd, sidecar->journal, nbytes, sidecar->journal_len) != 0 ||
+        fdatasync(sidecar->journal_fd) != 0) {
+        return -1;
+    }
+    sidecar->journal_len += nbytes;
+    sidecar->journal_pending = 0;
+    return 0;
+}
+
+void bpkg_sidecar_close(struct bpkg_sidecar* sidecar) {
+    if (!sidecar) {
+        return;
+    }
+    munmap(sidecar->map, sidecar->map_len);
+    close(sidecar->fd);
+    if (sidecar->journal_fd >= 0) {
+        close(sidecar->journal_fd);
+    }
+    free(sidecar);
+}
@@ -0,0 +1,250 @@
+// tracker.c
+#define _POSIX_C_SOURCE 200809L
+#include <tree/tracker.h>
+#include <crypt/sha256.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Past this size the journal is folded into a fresh checkpoint
+#define MERKLE_JOURNAL_COMPACT_BYTES (4u << 20)
+
+// Marks chunk c verified and walks up while the sibling is verified too
+static void merkle_tracker_mark(struct merkle_tracker* tracker, size_t c) {
+    if (bitset_test(tracker->done, c)) {
+        return;
+    }
+    bitset_set(tracker->done, c);
+    tracker->verified_chunks++;
+
+    size_t node = merkle_leaf_node(tracker->obj->merkle_tree, c);
+    while (node > 0 && merkle_tracker_verified(tracker, MERKLE_SIBLING(node))) {
+        node = MERKLE_PARENT(node);
+        bitset_set(tracker->nodes, node);
+    }
+}
+
+static int merkle_tracker_check_chunk(struct merkle_tracker* tracker, int fd, size_t c) {
+    const Chunk* chunk = &tracker->obj->chunks[c];
+    uint8_t* buffer = malloc(chunk->size);
+    if (!buffer) {
+        perror("Failed to allocate chunk buffer");
+        return 0;
+    }
+
+    int ok = 0;
+    if (pread(fd, buffer, chunk->size, (off_t) chunk->offset) == (ssize_t) chunk->size) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        sha256_hash(buffer, chunk->size, digest);
+        ok = sha256_digest_eq(digest, chunk->hash);
+    }
+    free(buffer);
+    return ok;
+}
+
+struct merkle_tracker* merkle_tracker_open(const char* bpkg_path, uint32_t threads) {
+    struct merkle_tracker* tracker = calloc(1, sizeof(*tracker));
+    if (!tracker) {
+        perror("Failed to allocate tracker");
+        return NULL;
+    }
+
+    tracker->sidecar = bpkg_sidecar_open(bpkg_path);
+    if (tracker->sidecar) {
+        tracker->obj = &tracker->sidecar->obj;
+    } else {
+        tracker->obj = bpkg_load(bpkg_path);
+        if (!tracker->obj) {
+            free(tracker);
+            return NULL;
+        }
+        tracker->obj->merkle_tree = build_merkle_tree_mt(tracker->obj->chunks, tracker->obj->nchunks, threads);
+
+        // Without a sidecar, e.g. in a read-only directory, the parsed package is kept instead
+        tracker->sidecar = bpkg_sidecar_create(bpkg_path, tracker->obj);
+        if (tracker->sidecar) {
+            bpkg_obj_destroy(tracker->obj);
+            tracker->obj = &tracker->sidecar->obj;
+        }
+    }
+
+    tracker->obj->threads = threads;
+    tracker->received = calloc(tracker->obj->nchunks, sizeof(*tracker->received));
+    tracker->done = bpkg_chunk_bitset(tracker->obj);
+    tracker->nodes = calloc(bitset_words(tracker->obj->merkle_tree->n_leaves), sizeof(*tracker->nodes));
+    if (!tracker->received || !tracker->done || !tracker->nodes) {
+        perror("Failed to allocate tracker state");
+        merkle_tracker_destroy(tracker);
+        return NULL;
+    }
+    return tracker;
+}
+
+// Queues a journal record, syncing the data it describes before a due batch goes out
+static void merkle_tracker_journal(struct merkle_tracker* tracker, int fd, enum bpkg_journal_type type,
+                                   size_t c, uint32_t from, uint32_t to) {
+    if (tracker->sidecar && bpkg_sidecar_journal_append(tracker->sidecar, type, (uint32_t) c, from, to) &&
+        fdatasync(fd) == 0) {
+        bpkg_sidecar_journal_flush(tracker->sidecar);
+    }
+}
+
+/*
+ * Folds everything verified into a new sidecar checkpoint, which empties
+ * the journal, then carries each partly received chunk over as one RANGE.
+ */
+static void merkle_tracker_checkpoint(struct merkle_tracker* tracker, int fd) {
+    const struct bpkg_obj* obj = tracker->obj;
+    if (!tracker->sidecar || !tracker->data_path || fdatasync(fd) != 0) {
+        return;
+    }
+    bpkg_sidecar_store_verified(tracker->sidecar, tracker->data_path, tracker->done);
+
+    for (size_t c = 0; c < obj->nchunks; c++) {
+        if (tracker->received[c] > 0 && !bitset_test(tracker->done, c)) {
+            merkle_tracker_journal(tracker, fd, BPKG_JOURNAL_RANGE, c, 0, tracker->received[c]);
+        }
+    }
+    bpkg_sidecar_journal_flush(tracker->sidecar);
+}
+
+/*
+ * Replays the journal over the checkpoint. Only chunks that received all
+ * their bytes since the checkpoint without being verified are hashed.
+ */
+static void merkle_tracker_replay(struct merkle_tracker* tracker, const char* data_path,
+                                  const struct bpkg_journal_record* records, size_t count) {
+    const struct bpkg_obj* obj = tracker->obj;
+    for (size_t i = 0; i < count; i++) {
+        const struct bpkg_journal_record* r = &records[i];
+        if (r->type == BPKG_JOURNAL_VERIFIED) {
+            tracker->received[r->chunk] = obj->chunks[r->chunk].size;
+            merkle_tracker_mark(tracker, r->chunk);
+        } else if (!bitset_test(tracker->done, r->chunk)) {
+            uint32_t room = obj->chunks[r->chunk].size - tracker->received[r->chunk];
+            tracker->received[r->chunk] += r->to - r->from < room ? r->to - r->from : room;
+        }
+    }
+
+    int fd = count > 0 ? open(data_path, O_RDONLY) : -1;
+    if (fd < 0) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint32_t c = records[i].chunk;
+        if (!bitset_test(tracker->done, c) && tracker->received[c] >= obj->chunks[c].size &&
+            merkle_tracker_check_chunk(tracker, fd, c)) {
+            merkle_tracker_mark(tracker, c);
+            merkle_tracker_journal(tracker, fd, BPKG_JOURNAL_VERIFIED, c, 0, 0);
+        }
+    }
+    if (fdatasync(fd) == 0) {
+        bpkg_sidecar_journal_flush(tracker->sidecar);
+    }
+    close(fd);
+}
+
+void merkle_tracker_seed(struct merkle_tracker* tracker, const char* data_path) {
+    const struct bpkg_obj* obj = tracker->obj;
+    free(tracker->data_path);
+    tracker->data_path = strdup(data_path);
+
+    struct bpkg_journal_record* records = NULL;
+    size_t count = 0;
+    const uint64_t* stored = tracker->sidecar ? bpkg_sidecar_resume(tracker->sidecar, data_path, &records, &count) : NULL;
+    uint64_t* found = stored ? NULL : bpkg_chunk_bitset(obj);
+    if (!stored && !found) {
+        return;
+    }
+    if (found) {
+        bpkg_verify_chunks(tracker->obj, data_path, found);
+    }
+
+    const uint64_t* bits = stored ? stored : found;
+    for (size_t c = bitset_next(bits, 0, obj->nchunks); c < obj->nchunks; c = bitset_next(bits, c + 1, obj->nchunks)) {
+        tracker->received[c] = obj->chunks[c].size;
+        merkle_tracker_mark(tracker, c);
+    }
+    free(found);
+
+    if (stored) {
+        merkle_tracker_replay(tracker, data_path, records, count);
+        free(records);
+    } else if (tracker->sidecar) {
+        bpkg_sidecar_store_verified(tracker->sidecar, data_path, tracker->done);
+    }
+}
+
+size_t merkle_tracker_record(struct merkle_tracker* tracker, int fd, uint64_t offset, uint32_t len) {
+    const struct bpkg_obj* obj = tracker->obj;
+    uint64_t end = offset + len;
+
+    // Chunks are stored in file order, find the first one ending past offset
+    size_t lo = 0, hi = obj->nchunks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (obj->chunks[mid].offset + obj->chunks[mid].size <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t newly = 0;
+    for (size_t c = lo; c < obj->nchunks && obj->chunks[c].offset < end; c++) {
+        const Chunk* chunk = &obj->chunks[c];
+        uint64_t chunk_end = chunk->offset + chunk->size;
+        uint64_t from = offset > chunk->offset ? offset : chunk->offset;
+        uint64_t to = end < chunk_end ? end : chunk_end;
+        if (to <= from || bitset_test(tracker->done, c)) {
+            continue;
+        }
+
+        // Resent data can overcount, so keep rechecking until the hash matches,
+        // the count stops at the chunk size so resends cannot wrap it
+        uint32_t room = chunk->size - tracker->received[c];
+        tracker->received[c] += to - from < room ? (uint32_t) (to - from) : room;
+        merkle_tracker_journal(tracker, fd, BPKG_JOURNAL_RANGE, c, (uint32_t) (from - chunk->offset), (uint32_t) (to - chunk->offset));
+        if (tracker->received[c] >= chunk->size && merkle_tracker_check_chunk(tracker, fd, c)) {
+            merkle_tracker_mark(tracker, c);
+            merkle_tracker_journal(tracker, fd, BPKG_JOURNAL_VERIFIED, c, 0, 0);
+            newly++;
+        }
+    }
+
+    // Completion, or a journal grown past its bound, starts a fresh checkpoint
+    if (newly > 0 && merkle_tracker_complete(tracker)) {
+        merkle_tracker_checkpoint(tracker, fd);
+    } else if (tracker->sidecar && tracker->sidecar->journal_len > MERKLE_JOURNAL_COMPACT_BYTES) {
+        merkle_tracker_checkpoint(tracker, fd);
+    }
+    return newly;
+}
+
+void merkle_tracker_destroy(struct merkle_tracker* tracker) {
+    if (!tracker) {
+        return;
+    }
+    // Records still queued go out once the data behind them is durable
+    if (tracker->sidecar && tracker->sidecar->journal_pending > 0 && tracker->data_path) {
+        int fd = open(tracker->data_path, O_RDONLY);
+        if (fd >= 0) {
+            if (fdatasync(fd) == 0) {
+                bpkg_sidecar_journal_flush(tracker->sidecar);
+            }
+            close(fd);
+        }
+    }
+    if (tracker->sidecar) {
+        bpkg_sidecar_close(tracker->sidecar);
+    } else if (tracker->obj) {
+        bpkg_obj_destroy(tracker->obj);
+    }
+    free(tracker->data_path);
+    free(tracker->received);
+    free(tracker->done);
+    free(tracker->nodes);
+    free(tracker);
+}